@@ -0,0 +1,203 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Allocations are aligned for any type */
+#define ARENA_ALIGN (sizeof(long double) > sizeof(void *) ? sizeof(long double) : sizeof(void *))
+
+/*
+ * Creates a new (empty) arena. No memory is taken until the first allocation.
+ * @param block_size the size of the blocks to allocate, 0 for ARENA_BLOCK
+ * @return a pointer to the Arena, or NULL on error
+ */
+Arena *
+arena_create(size_t block_size)
+{
+	Arena *arena = (Arena *)malloc(sizeof(Arena));
+	if (arena != NULL) {
+		arena->blocks = NULL;
+		arena->current = NULL;
+		arena->block_size = block_size > 0 ? block_size : ARENA_BLOCK;
+		arena->allocations = 0;
+		arena->next = NULL;
+	}
+
+	return arena;
+}
+
+/*
+ * Allocates a new block that can hold at least size bytes and links it after 
+ * the current block
+ * @return the new block, or NULL if we are out of memory
+ */
+static struct ArenaBlock *
+arena_add_block(Arena *arena, size_t size)
+{
+	struct ArenaBlock *block;
+
+	if (size < arena->block_size) {
+		size = arena->block_size;
+	}
+
+	/* The header and the data share a single allocation */
+	block = (struct ArenaBlock *)malloc(sizeof(struct ArenaBlock) + ARENA_ALIGN + size);
+	if (block == NULL) {
+		return NULL;
+	}
+	arena->allocations++;
+
+	block->size = size;
+	block->used = 0;
+	block->data = (char *)block + ((sizeof(struct ArenaBlock) + ARENA_ALIGN - 1) / ARENA_ALIGN) * ARENA_ALIGN;
+
+	if (arena->current == NULL) {
+		/* The first block */
+		block->next = arena->blocks;
+		arena->blocks = block;
+	} else {
+		block->next = arena->current->next;
+		arena->current->next = block;
+	}
+
+	return block;
+}
+
+/*
+ * Allocates memory from the arena. There is no way to free it, other than
+ * resetting the whole arena.
+ * @param arena a pointer to the Arena object
+ * @param size the number of bytes
+ * @return a pointer to the memory, or NULL if we are out of memory
+ */
+void *
+arena_alloc(Arena *arena, size_t size)
+{
+	struct ArenaBlock *block = arena->current != NULL ? arena->current : arena->blocks;
+	void *memory;
+
+	size = ((size + ARENA_ALIGN - 1) / ARENA_ALIGN) * ARENA_ALIGN;
+
+	/* Look for a block with room, reusing the blocks kept by arena_reset */
+	while (block != NULL && block->size - block->used < size) {
+		block = block->next;
+	}
+
+	if (block == NULL) {
+		block = arena_add_block (arena, size);
+		if (block == NULL) {
+			return NULL;
+		}
+	}
+
+	arena->current = block;
+	memory = block->data + block->used;
+	block->used += size;
+
+	return memory;
+}
+
+/*
+ * Copies a string into the arena
+ * @param arena a pointer to the Arena object
+ * @param string the string to copy
+ * @return a pointer to the copy, or NULL if we are out of memory
+ */
+char *
+arena_strdup(Arena *arena, const char *string)
+{
+	size_t length = strlen(string) + 1;
+	char *copy = (char *)arena_alloc (arena, length);
+
+	if (copy != NULL) {
+		memcpy(copy, string, length);
+	}
+
+	return copy;
+}
+
+/*
+ * Releases everything allocated from the arena. The blocks are kept, so they 
+ * are reused by the next allocations.
+ * @param arena a pointer to the Arena object
+ */
+void
+arena_reset(Arena *arena)
+{
+	struct ArenaBlock *block;
+
+	for (block = arena->blocks; block != NULL; block = block->next) {
+		block->used = 0;
+	}
+	arena->current = arena->blocks;
+}
+
+/*
+ * Frees the arena and all of its blocks
+ * @param arena a pointer to the Arena object
+ */
+void
+arena_free(Arena *arena)
+{
+	struct ArenaBlock *block = arena->blocks;
+	struct ArenaBlock *next;
+
+	while (block != NULL) {
+		next = block->next;
+		free(block);
+		block = next;
+	}
+	free(arena);
+}
+
+/*
+ * Takes an empty arena from the pool, or creates one when there is none
+ * @param pool a pointer to the ArenaPool object
+ * @return the arena, or NULL if we are out of memory
+ */
+Arena *
+arena_pool_take(ArenaPool *pool)
+{
+	Arena *arena = pool->free;
+
+	if (arena != NULL) {
+		pool->free = arena->next;
+		arena->next = NULL;
+	} else {
+		arena = arena_create (0);
+		if (arena != NULL) {
+			pool->created++;
+		}
+	}
+
+	return arena;
+}
+
+/*
+ * Gives an arena back to the pool. Everything allocated from it is released.
+ * @param pool a pointer to the ArenaPool object
+ * @param arena the arena, taken from the pool
+ */
+void
+arena_pool_give(ArenaPool *pool, Arena *arena)
+{
+	arena_reset (arena);
+	arena->next = pool->free;
+	pool->free = arena;
+}
+
+/*
+ * Frees the arenas in the pool. Arenas that were not given back are left to
+ * their takers.
+ * @param pool a pointer to the ArenaPool object
+ */
+void
+arena_pool_free(ArenaPool *pool)
+{
+	Arena *next;
+
+	while (pool->free != NULL) {
+		next = pool->free->next;
+		arena_free (pool->free);
+		pool->free = next;
+	}
+}
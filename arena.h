@@ -0,0 +1,65 @@
+/*
+ * The Arena is a bump allocator for objects that share a lifetime, such as
+ * everything that belongs to one message or one batch of messages. Memory is
+ * taken from large blocks and released all at once with arena_reset. The
+ * blocks are kept for reuse, so once the arena has grown to its working size
+ * it makes no more heap allocations.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/* The default block size */
+#define ARENA_BLOCK 4096
+
+struct ArenaBlock {
+	struct ArenaBlock *next;
+	size_t size; /* usable bytes in data */
+	size_t used;
+	char *data;
+};
+
+struct Arena {
+	struct ArenaBlock *blocks; /* all the blocks, in order */
+	struct ArenaBlock *current; /* the block we allocate from */
+	size_t block_size;
+	unsigned long allocations; /* heap allocations made, for the statistics */
+	struct Arena *next; /* the next free arena, in an ArenaPool */
+};
+
+typedef struct Arena Arena;
+
+/* Arenas for objects that come and go one at a time, each with its own arena.
+ * Arenas that are given back are reset and kept for the next taker. */
+typedef struct {
+	Arena *free; /* the arenas ready for use */
+	unsigned long created; /* for the statistics */
+} ArenaPool;
+
+Arena *
+arena_create(size_t block_size);
+
+void *
+arena_alloc(Arena *arena, size_t size);
+
+char *
+arena_strdup(Arena *arena, const char *string);
+
+void
+arena_reset(Arena *arena);
+
+void
+arena_free(Arena *arena);
+
+Arena *
+arena_pool_take(ArenaPool *pool);
+
+void
+arena_pool_give(ArenaPool *pool, Arena *arena);
+
+void
+arena_pool_free(ArenaPool *pool);
+
+#endif
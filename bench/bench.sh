@@ -0,0 +1,177 @@
+#!/bin/sh
+#
+# The end-to-end benchmark of pushr (make bench): builds pushr with its
+# directories in BENCH_DIR, queues BENCH_MESSAGES synthetic messages in the
+# file queue or the MySQL table, and runs pushr as a daemon against the mock
+# push service (bench/mockgcm) until they are all done. Reports the messages
+# sent a second, the CPU time and peak RSS of pushr, and the median and 99th
+# percentile of every stage of a message, from its metrics.
+#
+# Set in the environment:
+#   BENCH_MODE      files or mysql (files)
+#   BENCH_MESSAGES  how many messages (10000)
+#   BENCH_IDS       registration ids in every message (1)
+#   BENCH_PAYLOAD   the size of the data of every message, in bytes (100)
+#   BENCH_DIR       where pushr is built, and its directories (/tmp/pushr-bench)
+#   BENCH_PORT      the port of the mock (8099)
+#   BENCH_TIMEOUT   seconds to wait for the messages to be done (300)
+#   MOCK_OPTIONS    the options of the mock, e.g. "-l 20 -j 10 -u 0.01" (see
+#                   bench/mockgcm -h)
+#   BENCH_URL       where to send the requests instead of the mock, e.g. a
+#                   loopback profile (see loopback.h) to leave the network out:
+#                   "loopback:latency=0,unavailable=0.01"
+#   MYSQL           the client command, for the mysql mode, with the settings
+#                   of settings.h (mysql -h MYSQL_SERVER -u MYSQL_USER ...)
+# MYSQL_FLAGS and MYSQL_LIBS are handed to make, as the Makefile takes them.
+# In the mysql mode, the rows of the benchmark (with the CollapseKey
+# pushr-bench) are deleted first.
+
+MODE=${BENCH_MODE:-files}
+MESSAGES=${BENCH_MESSAGES:-10000}
+IDS=${BENCH_IDS:-1}
+PAYLOAD=${BENCH_PAYLOAD:-100}
+DIR=${BENCH_DIR:-/tmp/pushr-bench}
+PORT=${BENCH_PORT:-8099}
+TIMEOUT=${BENCH_TIMEOUT:-300}
+METRICS_PORT=$((PORT + 1))
+SOURCE=$(cd "$(dirname "$0")/.." && pwd)
+
+fail() {
+	echo "bench: $*" >&2
+	[ -n "$MOCK" ] && kill "$MOCK" 2>/dev/null
+	exit 1
+}
+
+setting() {
+	sed -n "s/^#define $1 \"\(.*\)\"/\1/p" "$SOURCE/settings.h"
+}
+
+now() {
+	date +%s%N
+}
+
+case $MODE in
+files) USE_MYSQL=0 ;;
+mysql) USE_MYSQL=1 ;;
+*) fail "BENCH_MODE is files or mysql" ;;
+esac
+if [ "$MODE" = mysql ] && [ -z "$MYSQL" ]; then
+	MYSQL="mysql -h $(setting MYSQL_SERVER) -u $(setting MYSQL_USER) -p$(setting MYSQL_PASSWORD) $(setting MYSQL_SCHEMA)"
+fi
+
+# Build pushr with its directories in DIR, as settings.h would be edited
+rm -rf "$DIR" && mkdir -p "$DIR/build" "$DIR/messages.queue" "$DIR/messages.sent" "$DIR/messages.error" \
+	|| fail "can't create $DIR"
+cp "$SOURCE"/*.c "$SOURCE"/*.h "$SOURCE/Makefile" "$DIR/build"
+sed -i -e "s#/var/pushr#$DIR#g" \
+	-e "s/^#define USE_MYSQL .*/#define USE_MYSQL $USE_MYSQL/" \
+	-e "s/^#define USE_FILES .*/#define USE_FILES $((1 - USE_MYSQL))/" \
+	-e "s/^#define USE_LOG .*/#define USE_LOG 0/" \
+	-e "s/^#define USE_METRICS .*/#define USE_METRICS 1/" \
+	-e "s/^#define METRICS_PORT .*/#define METRICS_PORT $METRICS_PORT/" \
+	"$DIR/build/settings.h"
+make -s -C "$DIR/build" CFLAGS="-O2 -g" ${MYSQL_FLAGS:+"MYSQL_FLAGS=$MYSQL_FLAGS"} \
+	${MYSQL_LIBS:+"MYSQL_LIBS=$MYSQL_LIBS"} > "$DIR/build.log" 2>&1 || fail "the build failed, see $DIR/build.log"
+
+if [ -z "$BENCH_URL" ]; then
+	"$SOURCE/bench/mockgcm" -p "$PORT" $MOCK_OPTIONS > "$DIR/mock.log" 2>&1 &
+	MOCK=$!
+	sleep 0.2
+	kill -0 "$MOCK" 2>/dev/null || fail "the mock didn't start, see $DIR/mock.log"
+fi
+
+# The messages: BENCH_IDS ids, and a data object of BENCH_PAYLOAD bytes
+if [ "$MODE" = files ]; then
+	awk -v messages="$MESSAGES" -v ids="$IDS" -v payload="$PAYLOAD" -v dir="$DIR/messages.queue" 'BEGIN {
+		data = "{\"bench\":\""
+		while (length(data) < payload - 2) data = data "x"
+		data = data "\"}"
+		for (m = 0; m < messages; m++) {
+			tokens = ""
+			for (i = 0; i < ids; i++) tokens = tokens (i ? "," : "") "\"bench-" m "-" i "\""
+			file = sprintf("%s/m%07d", dir, m)
+			print "[" tokens "]\n" data > file
+			close(file)
+		}
+	}'
+else
+	echo "DELETE FROM PushrMessages WHERE CollapseKey = 'pushr-bench';" | $MYSQL || fail "can't reach the MySQL table"
+	awk -v messages="$MESSAGES" -v ids="$IDS" -v payload="$PAYLOAD" 'BEGIN {
+		data = "{\"bench\":\""
+		while (length(data) < payload - 2) data = data "x"
+		data = data "\"}"
+		for (m = 0; m < messages; m++) {
+			tokens = ""
+			for (i = 0; i < ids; i++) tokens = tokens (i ? "," : "") "\"bench-" m "-" i "\""
+			if (m % 500 == 0) printf "%sINSERT INTO PushrMessages (RegistrationIds, NotificationKey, Data, " \
+			    "CollapseKey, TimeToLive, PackageName, Timestamp, ServerResponse) VALUES\n", (m ? ";\n" : "")
+			else printf ",\n"
+			printf "(\x27[%s]\x27, \x27\x27, \x27%s\x27, \x27pushr-bench\x27, 0, \x27\x27, NOW(), \x27\x27)", tokens, data
+		}
+		print ";"
+	}' | $MYSQL || fail "can't queue the messages"
+fi
+
+# Run pushr until the queue is empty
+START=$(now)
+(cd "$DIR/build" && PUSHR_URL="${BENCH_URL:-http://127.0.0.1:$PORT/gcm/send}" ./pushr daemon > "$DIR/pushr.log" 2>&1)
+PUSHR=
+while [ -z "$PUSHR" ] && [ $(( ($(now) - START) / 1000000000 )) -lt 5 ]; do
+	PUSHR=$(cat "$DIR/.lock" 2>/dev/null)
+	[ -n "$PUSHR" ] && ! kill -0 "$PUSHR" 2>/dev/null && PUSHR=
+done
+[ -n "$PUSHR" ] || fail "pushr didn't start, see $DIR/pushr.log"
+
+left() {
+	if [ "$MODE" = files ]; then
+		find "$DIR/messages.queue" -maxdepth 1 -type f | wc -l
+	else
+		echo "SELECT COUNT(*) FROM PushrMessages WHERE CollapseKey = 'pushr-bench' AND IsSent = 0 AND IsError = 0;" \
+			| $MYSQL -N
+	fi
+}
+
+while [ "$(left)" -gt 0 ]; do
+	kill -0 "$PUSHR" 2>/dev/null || fail "pushr stopped, see $DIR/pushr.log"
+	[ $(( ($(now) - START) / 1000000000 )) -lt "$TIMEOUT" ] || fail "the messages were not done in $TIMEOUT seconds"
+	sleep 0.05
+done
+END=$(now)
+
+# utime and stime are in clock ticks; the name may hold spaces, skip past it
+CPU=$(sed 's/.*) //' "/proc/$PUSHR/stat" | awk -v hz="$(getconf CLK_TCK)" '{ printf "%.2f", ($12 + $13) / hz }')
+RSS=$(awk '/^VmHWM/ { print $2 }' "/proc/$PUSHR/status")
+curl -s "http://127.0.0.1:$METRICS_PORT/metrics" > "$DIR/metrics.prom"
+
+kill -TERM "$PUSHR"
+while kill -0 "$PUSHR" 2>/dev/null; do
+	sleep 0.05
+done
+if [ -n "$MOCK" ]; then
+	kill -TERM "$MOCK"
+	wait "$MOCK"
+fi
+
+awk -v start="$START" -v end="$END" -v messages="$MESSAGES" -v cpu="$CPU" -v rss="$RSS" -v mode="$MODE" \
+	-v ids="$IDS" -v payload="$PAYLOAD" '
+	/^pushr_stage_quantile_seconds/ {
+		split($1, labels, "\"")
+		if (labels[4] == "0.5") p50[labels[2]] = $2 * 1000
+		if (labels[4] == "0.99") p99[labels[2]] = $2 * 1000
+	}
+	END {
+		seconds = (end - start) / 1e9
+		printf "pushr bench: %d messages (%s, %d ids, %d bytes) in %.2f s\n", messages, mode, ids, payload, seconds
+		printf "  throughput  %.0f messages/s\n", messages / seconds
+		printf "  cpu         %.2f s (%.0f%% of one core)\n", cpu, 100 * cpu / seconds
+		printf "  peak rss    %.1f MB\n", rss / 1024
+		split("pickup build round_trip write_back", stages, " ")
+		for (i = 1; i <= 4; i++) {
+			if (stages[i] in p50) {
+				printf "  %-11s p50 %.3f ms, p99 %.3f ms\n", stages[i], p50[stages[i]], p99[stages[i]]
+			}
+		}
+	}' "$DIR/metrics.prom"
+if [ -n "$MOCK" ]; then
+	cat "$DIR/mock.log"
+fi
@@ -0,0 +1,418 @@
+/*
+ * The micro-benchmarks of the code that runs once for every message: the
+ * StringBuffer and StringList primitives, building a message from a file and
+ * from a MySQL row, db_create_query and json_dirty_parse. Every benchmark is
+ * run over payloads from 100 bytes to 4 KB and over 1 to 1000 registration
+ * ids (where they matter), long enough to take the given time, and reports how
+ * long one operation took and how many heap allocations it made. The heap
+ * allocations are counted by wrapping malloc, calloc and realloc when linking
+ * (see the Makefile), so the ones made inside libc are not counted.
+ * The output is a tab separated line for every case, with a header line, so
+ * the numbers of two builds can be compared with join or a spreadsheet.
+ * Usage: microbench [-t milliseconds per case] [-f benchmark]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../pushr.h"
+
+#define BENCH_TOKEN_LENGTH 152 /* as long as a GCM registration id */
+
+static const int payload_sizes[] = { 100, 250, 500, 1000, 2000, 4096 };
+static const int id_counts[] = { 1, 10, 100, 1000 };
+
+/* The heap allocations made so far, see __wrap_malloc */
+static unsigned long allocations = 0;
+
+/* What the benchmarks work on, for one payload size and id count */
+typedef struct {
+	int size;
+	int ids;
+	char *payload; /* a JSON object of size bytes */
+	char *id_list; /* a JSON array of ids registration ids */
+	char **tokens; /* and the ids */
+	char *response; /* a GCM response with a result for every id */
+	char *row[DB_COLUMNS]; /* a MySQL row of the message */
+	int file; /* a queue file of the message */
+	Arena *arena; /* the memory of the message */
+	StringBuffer *buffer;
+	StringList *list;
+} Fixture;
+
+typedef void (*BenchFunction)(Fixture *fixture);
+
+typedef struct {
+	char *name;
+	BenchFunction function;
+	int by_size; /* run it for every payload size */
+	int by_ids; /* and for every id count */
+} Benchmark;
+
+/* Where the results go, so the compiler can't drop the work */
+static volatile void *sink;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t count, size_t size)
+{
+	allocations++;
+	return __real_calloc(count, size);
+}
+
+void *
+__wrap_realloc(void *pointer, size_t size)
+{
+	allocations++;
+	return __real_realloc(pointer, size);
+}
+
+/*
+ * Returns the time on the monotonic clock
+ * @return the time in nanoseconds
+ */
+static long long
+bench_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * The benchmarks, one operation each, on the data of a fixture
+ */
+
+static void
+bench_append(Fixture *fixture)
+{
+	string_buffer_recycle (fixture->buffer);
+	string_buffer_append (fixture->buffer, fixture->payload);
+	sink = fixture->buffer->data;
+}
+
+static void
+bench_append_char(Fixture *fixture)
+{
+	char *character;
+
+	string_buffer_recycle (fixture->buffer);
+	for (character = fixture->payload; *character != '\0'; character++) {
+		string_buffer_append_char (fixture->buffer, *character);
+	}
+	sink = fixture->buffer->data;
+}
+
+static void
+bench_get_string(Fixture *fixture)
+{
+	sink = string_buffer_get_string (fixture->buffer);
+}
+
+static void
+bench_string_buffer_fresh(Fixture *fixture)
+{
+	StringBuffer *buffer = string_buffer_create (250);
+
+	string_buffer_append (buffer, fixture->payload);
+	sink = string_buffer_get_string (buffer);
+	string_buffer_free (buffer);
+}
+
+/*
+ * Pushes the ids, reads them back, and recycles the list
+ * @param fixture the fixture
+ */
+static void
+bench_string_list(Fixture *fixture)
+{
+	char *token;
+	int i;
+
+	for (i = 0; i < fixture->ids; i++) {
+		string_list_push (fixture->list, fixture->tokens[i]);
+	}
+	while ((token = string_list_get_next (fixture->list)) != NULL) {
+		sink = token;
+	}
+	string_list_recycle (fixture->list);
+}
+
+static void
+bench_build_from_file(Fixture *fixture)
+{
+	MessageId *message_data;
+
+	arena_reset (fixture->arena);
+	message_data = create_message_data (fixture->arena);
+	string_buffer_recycle (fixture->buffer);
+	(void) lseek(fixture->file, 0, SEEK_SET);
+	build_message_from_file (fixture->file, fixture->buffer, message_data);
+	sink = message_data;
+}
+
+static void
+bench_build_from_row(Fixture *fixture)
+{
+	MYSQL_ROW row = fixture->row;
+	MessageId *message_data;
+
+	arena_reset (fixture->arena);
+	message_data = create_message_data (fixture->arena);
+	string_buffer_recycle (fixture->buffer);
+	build_message_from_row (&row, fixture->buffer, message_data);
+	sink = message_data;
+}
+
+static void
+bench_create_query(Fixture *fixture)
+{
+	arena_reset (fixture->arena);
+	sink = db_create_query (fixture->arena, "UPDATE PushrMessages SET IsSent = 1, ServerResponse = '%s' WHERE Id = %s",
+	                        2, fixture->payload, "1234567");
+}
+
+static void
+bench_json_dirty_parse(Fixture *fixture)
+{
+	int successes, fails;
+
+	json_dirty_parse (fixture->response, &successes, &fails);
+	sink = (void *)(long)successes;
+}
+
+static const Benchmark benchmarks[] = {
+	{ "string_buffer_append", bench_append, 1, 0 },
+	{ "string_buffer_append_char", bench_append_char, 1, 0 },
+	{ "string_buffer_get_string", bench_get_string, 1, 0 },
+	{ "string_buffer_create_append_free", bench_string_buffer_fresh, 1, 0 },
+	{ "string_list_push_get_next_recycle", bench_string_list, 0, 1 },
+	{ "build_message_from_file", bench_build_from_file, 1, 1 },
+	{ "build_message_from_row", bench_build_from_row, 1, 1 },
+	{ "db_create_query", bench_create_query, 1, 0 },
+	{ "json_dirty_parse", bench_json_dirty_parse, 0, 1 }
+};
+
+/*
+ * Sets up the data of the benchmarks: a message with a payload of the given
+ * size and the given number of registration ids, as a queue file, a MySQL row
+ * and a response of the push service
+ * @param fixture the fixture to fill
+ * @param size the size of the payload
+ * @param ids the number of registration ids
+ * @return 0 on success, -1 on error
+ */
+static int
+fixture_create(Fixture *fixture, int size, int ids)
+{
+	StringBuffer *text = string_buffer_create (size + ids * (BENCH_TOKEN_LENGTH + 30) + 100);
+	char path[] = "/tmp/pushr-microbench-XXXXXX";
+	int i;
+
+	memset(fixture, 0, sizeof(Fixture));
+	fixture->size = size;
+	fixture->ids = ids;
+	fixture->arena = arena_create (0);
+	fixture->buffer = string_buffer_create (250);
+	fixture->list = string_list_create ();
+	fixture->tokens = (char **)calloc(ids, sizeof(char *));
+	fixture->file = mkstemp(path);
+	if (text == NULL || fixture->arena == NULL || fixture->buffer == NULL || fixture->list == NULL
+	    || fixture->tokens == NULL || fixture->file == -1) {
+		return -1;
+	}
+	unlink(path);
+
+	/* {"bench":"xxx...x"} */
+	string_buffer_append (text, "{\"bench\":\"");
+	while (text->length < (unsigned int)size - 2) {
+		string_buffer_append_char (text, 'x');
+	}
+	string_buffer_append (text, "\"}");
+	fixture->payload = strdup(string_buffer_get_string (text));
+
+	string_buffer_recycle (text);
+	for (i = 0; i < ids; i++) {
+		int length;
+
+		fixture->tokens[i] = (char *)malloc(BENCH_TOKEN_LENGTH + 1);
+		if (fixture->tokens[i] == NULL) {
+			return -1;
+		}
+		length = snprintf(fixture->tokens[i], BENCH_TOKEN_LENGTH + 1, "bench-%d-", i);
+		memset(fixture->tokens[i] + length, 'a', BENCH_TOKEN_LENGTH - length);
+		fixture->tokens[i][BENCH_TOKEN_LENGTH] = '\0';
+		string_buffer_append (text, i == 0 ? "[\"" : ",\"");
+		string_buffer_append (text, fixture->tokens[i]);
+		string_buffer_append_char (text, '"');
+	}
+	string_buffer_append_char (text, ']');
+	fixture->id_list = strdup(string_buffer_get_string (text));
+
+	string_buffer_recycle (text);
+	string_buffer_append_format (text, "{\"multicast_id\":1,\"success\":%d,\"failure\":0,\"canonical_ids\":0,"
+	                             "\"results\":[", ids);
+	for (i = 0; i < ids; i++) {
+		string_buffer_append (text, i == 0 ? "{\"message_id\":\"0:1\"}" : ",{\"message_id\":\"0:1\"}");
+	}
+	string_buffer_append (text, "]}");
+	fixture->response = strdup(string_buffer_get_string (text));
+
+	/* Id, RegistrationIds, NotificationKey, Data, CollapseKey, DelayWhileIdle,
+	 * TimeToLive, PackageName, DryRun, and when it was queued */
+	fixture->row[0] = "1234567";
+	fixture->row[1] = fixture->id_list;
+	fixture->row[2] = "";
+	fixture->row[3] = fixture->payload;
+	fixture->row[4] = "bench";
+	fixture->row[5] = "0";
+	fixture->row[6] = "3600";
+	fixture->row[7] = "com.example.bench";
+	fixture->row[8] = "0";
+	fixture->row[9] = NULL;
+
+	/* The same message, as a queue file: a field on every line */
+	string_buffer_recycle (text);
+	string_buffer_append_format (text, "%s\n\n%s\nbench\n0\n3600\ncom.example.bench\n0\n", fixture->id_list,
+	                             fixture->payload);
+	if (write(fixture->file, text->data, text->length) != (ssize_t)text->length) {
+		return -1;
+	}
+
+	/* The buffer already holds a payload, for bench_get_string */
+	string_buffer_append (fixture->buffer, fixture->payload);
+	string_buffer_free (text);
+
+	return (fixture->payload != NULL && fixture->id_list != NULL && fixture->response != NULL) ? 0 : -1;
+}
+
+/*
+ * Frees the data of the benchmarks
+ * @param fixture the fixture
+ */
+static void
+fixture_free(Fixture *fixture)
+{
+	int i;
+
+	for (i = 0; fixture->tokens != NULL && i < fixture->ids; i++) {
+		free(fixture->tokens[i]);
+	}
+	free(fixture->tokens);
+	free(fixture->payload);
+	free(fixture->id_list);
+	free(fixture->response);
+	if (fixture->list != NULL) {
+		string_list_free (fixture->list);
+	}
+	if (fixture->buffer != NULL) {
+		string_buffer_free (fixture->buffer);
+	}
+	if (fixture->arena != NULL) {
+		arena_free (fixture->arena);
+	}
+	if (fixture->file != -1) {
+		close(fixture->file);
+	}
+}
+
+/*
+ * Runs a benchmark on a fixture, with twice as many iterations every time,
+ * until it takes the given time, and prints the last run
+ * @param benchmark the benchmark
+ * @param fixture the fixture
+ * @param target how long the last run should take, in nanoseconds
+ */
+static void
+bench_run(const Benchmark *benchmark, Fixture *fixture, long long target)
+{
+	unsigned long iterations = 1, i;
+	unsigned long allocated;
+	long long elapsed;
+
+	benchmark->function (fixture); /* Warm up the buffers and the arena */
+	for (;;) {
+		long long started = bench_clock ();
+
+		allocated = allocations;
+		for (i = 0; i < iterations; i++) {
+			benchmark->function (fixture);
+		}
+		elapsed = bench_clock () - started;
+		allocated = allocations - allocated;
+		if (elapsed >= target || iterations >= (1UL << 40)) {
+			break;
+		}
+		iterations *= 2;
+	}
+
+	printf("%s\t%d\t%d\t%lu\t%.1f\t%.2f\n", benchmark->name, benchmark->by_size ? fixture->size : 0,
+	       benchmark->by_ids ? fixture->ids : 0, iterations, (double)elapsed / iterations,
+	       (double)allocated / iterations);
+	fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long long target = 100 * 1000000LL;
+	char *filter = NULL;
+	unsigned int b, s, n;
+	int option;
+
+	while ((option = getopt(argc, argv, "t:f:")) != -1) {
+		switch (option) {
+		case 't':
+			target = atoll(optarg) * 1000000LL;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t milliseconds per case] [-f benchmark]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("benchmark\tpayload_bytes\tregistration_ids\titerations\tns_per_op\tallocations_per_op\n");
+	for (b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+		const Benchmark *benchmark = &benchmarks[b];
+		unsigned int sizes = benchmark->by_size ? sizeof(payload_sizes) / sizeof(payload_sizes[0]) : 1;
+		unsigned int counts = benchmark->by_ids ? sizeof(id_counts) / sizeof(id_counts[0]) : 1;
+
+		if (filter != NULL && strcmp(filter, benchmark->name) != 0) {
+			continue;
+		}
+		for (s = 0; s < sizes; s++) {
+			for (n = 0; n < counts; n++) {
+				Fixture fixture;
+
+				if (fixture_create (&fixture, payload_sizes[s], id_counts[benchmark->by_ids ? n : 0]) == -1) {
+					fprintf(stderr, "microbench: can't set up %s: out of memory, or no /tmp\n", benchmark->name);
+					fixture_free (&fixture);
+					return EXIT_FAILURE;
+				}
+				bench_run (benchmark, &fixture, target);
+				fixture_free (&fixture);
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
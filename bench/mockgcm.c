@@ -0,0 +1,381 @@
+/*
+ * A mock of the push service, to measure pushr without Google. It answers the
+ * POSTs to any path the way GCM does: a JSON object with the multicast id, the
+ * counts, and a result for every registration id of the request, after a
+ * configurable latency. Some ids fail (Unavailable or NotRegistered), some get
+ * a canonical id, and some requests are answered 503 with a Retry-After
+ * header, at the rates given on the command line (see usage). Every
+ * connection is kept alive, and served by a thread of its own.
+ * On SIGINT or SIGTERM, it prints how many requests and ids it answered.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "../stringbuffer.h"
+
+#define MOCK_READ_SIZE (64 * 1024)
+#define MOCK_MAX_REQUEST (16 * 1024 * 1024)
+
+typedef struct {
+	int port;
+	int latency; /* milliseconds */
+	int jitter; /* up to this many milliseconds more, at random */
+	double unavailable; /* the share of the ids that fail with Unavailable */
+	double not_registered; /* and with NotRegistered */
+	double canonical; /* the share of the ids that get a canonical id */
+	double down; /* the share of the requests answered 503 */
+	int retry_after; /* seconds, in the Retry-After header of a 503, 0 for none */
+} MockProfile;
+
+static MockProfile profile = { 8099, 0, 0, 0, 0, 0, 0, 1 };
+static volatile sig_atomic_t keep_running = 1;
+
+/* The statistics, printed when the mock stops */
+static unsigned long requests = 0;
+static unsigned long ids = 0;
+static unsigned long failed_ids = 0;
+static unsigned long down_requests = 0;
+
+/*
+ * Stops the server, on SIGINT or SIGTERM
+ * @param signal the signal
+ */
+static void
+stop_mock(int signal)
+{
+	(void) signal;
+	keep_running = 0;
+}
+
+/*
+ * Returns a random number in [0, 1)
+ * @param seed the random state of the thread
+ * @return the number
+ */
+static double
+mock_random(unsigned int *seed)
+{
+	return (double)rand_r(seed) / ((double)RAND_MAX + 1);
+}
+
+/*
+ * Counts the registration ids of a request: the strings in the
+ * "registration_ids" array of its body
+ * @param body the body
+ * @param length its length
+ * @return the number of ids, 1 if there is no array (a notification key)
+ */
+static int
+count_ids(char *body, size_t length)
+{
+	char *field = memmem(body, length, "\"registration_ids\"", 18);
+	char *end;
+	int quotes = 0;
+
+	if (field == NULL) {
+		return 1;
+	}
+	field += 18;
+	end = memchr(field, ']', length - (field - body));
+	if (end == NULL) {
+		return 1;
+	}
+	for (; field < end; field++) {
+		if (*field == '"') {
+			quotes++;
+		}
+	}
+
+	return quotes / 2;
+}
+
+/*
+ * Writes the whole buffer to the connection
+ * @param connection the socket
+ * @param data the bytes
+ * @param length and how many
+ * @return 0 on success, -1 on error
+ */
+static int
+write_all(int connection, char *data, size_t length)
+{
+	while (length > 0) {
+		ssize_t written = write(connection, data, length);
+
+		if (written == -1 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return -1;
+		}
+		data += written;
+		length -= written;
+	}
+
+	return 0;
+}
+
+/*
+ * Answers one request, as the push service would
+ * @param connection the socket
+ * @param body the body of the request
+ * @param length its length
+ * @param results a buffer for the results of the ids
+ * @param response a buffer for the whole response
+ * @param seed the random state of the thread
+ * @return 0 on success, -1 if the connection failed
+ */
+static int
+answer(int connection, char *body, size_t length, StringBuffer *results, StringBuffer *response, unsigned int *seed)
+{
+	int count = count_ids (body, length);
+	int success = 0, failure = 0, canonical = 0;
+	int delay = profile.latency + (profile.jitter > 0 ? rand_r(seed) % (profile.jitter + 1) : 0);
+	unsigned long id = __atomic_add_fetch(&requests, 1, __ATOMIC_RELAXED);
+	int i;
+
+	__atomic_fetch_add(&ids, count, __ATOMIC_RELAXED);
+	if (delay > 0) {
+		usleep(delay * 1000);
+	}
+
+	string_buffer_recycle (results);
+	string_buffer_recycle (response);
+	if (profile.down > 0 && mock_random (seed) < profile.down) {
+		__atomic_fetch_add(&down_requests, 1, __ATOMIC_RELAXED);
+		string_buffer_append (response, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n");
+		if (profile.retry_after > 0) {
+			string_buffer_append_format (response, "Retry-After: %d\r\n", profile.retry_after);
+		}
+		string_buffer_append (response, "\r\n");
+
+		return write_all (connection, response->data, response->length);
+	}
+
+	for (i = 0; i < count; i++) {
+		double draw = mock_random (seed);
+
+		if (i > 0) {
+			string_buffer_append_char (results, ',');
+		}
+		if (draw < profile.unavailable) {
+			string_buffer_append (results, "{\"error\":\"Unavailable\"}");
+			failure++;
+		} else if (draw < profile.unavailable + profile.not_registered) {
+			string_buffer_append (results, "{\"error\":\"NotRegistered\"}");
+			failure++;
+		} else if (draw < profile.unavailable + profile.not_registered + profile.canonical) {
+			string_buffer_append_format (results, "{\"message_id\":\"0:%lu\",\"registration_id\":\"canonical-%lu-%d\"}",
+			                             id, id, i);
+			success++;
+			canonical++;
+		} else {
+			string_buffer_append_format (results, "{\"message_id\":\"0:%lu\"}", id);
+			success++;
+		}
+	}
+	__atomic_fetch_add(&failed_ids, failure, __ATOMIC_RELAXED);
+
+	/* The body goes after the header, which needs its length: leave room for
+	 * the header, and move the body up against it */
+	string_buffer_append_format (response, "{\"multicast_id\":%lu,\"success\":%d,\"failure\":%d,\"canonical_ids\":%d,"
+	                             "\"results\":[%s]}", id, success, failure, canonical,
+	                             string_buffer_get_string (results));
+	length = response->length;
+	string_buffer_recycle (results);
+	string_buffer_append_format (results, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+	                             "Content-Length: %lu\r\n\r\n", (unsigned long)length);
+
+	if (write_all (connection, results->data, results->length) == -1) {
+		return -1;
+	}
+
+	return write_all (connection, response->data, response->length);
+}
+
+/*
+ * Serves the requests of one connection, until it is closed
+ * @param argument the socket
+ * @return NULL
+ */
+static void *
+serve(void *argument)
+{
+	int connection = (int)(long)argument;
+	StringBuffer *request = string_buffer_create (MOCK_READ_SIZE);
+	StringBuffer *results = string_buffer_create (1024);
+	StringBuffer *response = string_buffer_create (1024);
+	unsigned int seed = (unsigned int)connection ^ (unsigned int)pthread_self();
+	int open = (request != NULL && results != NULL && response != NULL);
+	int one = 1;
+
+	setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	while (open) {
+		char *end = memmem(request->data, request->length, "\r\n\r\n", 4);
+		char *content_length;
+		size_t header, body = 0;
+		ssize_t got;
+
+		if (end != NULL) {
+			/* The whole header is in, wait for the body */
+			header = end + 4 - request->data;
+			request->data[header - 1] = '\0';
+			content_length = strcasestr(request->data, "\r\nContent-Length:");
+			request->data[header - 1] = '\n';
+			if (content_length != NULL) {
+				body = strtoul(content_length + 17, NULL, 10);
+			}
+			if (header + body > MOCK_MAX_REQUEST) {
+				break;
+			}
+			if (request->length >= header + body) {
+				if (answer (connection, request->data + header, body, results, response, &seed) == -1) {
+					break;
+				}
+				/* Keep what came of the next request */
+				memmove(request->data, request->data + header + body, request->length - header - body);
+				request->length -= header + body;
+				continue;
+			}
+		} else if (request->length > MOCK_MAX_REQUEST) {
+			break;
+		}
+
+		if (string_buffer_reserve (request, MOCK_READ_SIZE) == 0) {
+			break;
+		}
+		got = read(connection, request->data + request->length, MOCK_READ_SIZE);
+		if (got == -1 && errno == EINTR) {
+			continue;
+		}
+		open = (got > 0);
+		if (open) {
+			request->length += got;
+			request->data[request->length] = '\0';
+		}
+	}
+
+	close(connection);
+	if (request != NULL) {
+		string_buffer_free (request);
+	}
+	if (results != NULL) {
+		string_buffer_free (results);
+	}
+	if (response != NULL) {
+		string_buffer_free (response);
+	}
+
+	return NULL;
+}
+
+/*
+ * Prints how to run the mock
+ * @param name the name of the program
+ */
+static void
+usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+	        "  -p port         the port to listen on, on 127.0.0.1 (8099)\n"
+	        "  -l ms           the latency of every request (0)\n"
+	        "  -j ms           up to this much more latency, at random (0)\n"
+	        "  -u share        the share of the ids that fail with Unavailable (0)\n"
+	        "  -n share        the share of the ids that fail with NotRegistered (0)\n"
+	        "  -c share        the share of the ids that get a canonical id (0)\n"
+	        "  -d share        the share of the requests answered 503 (0)\n"
+	        "  -r seconds      the Retry-After header of a 503, 0 for none (1)\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in address;
+	struct sigaction action;
+	int listener, option, one = 1;
+
+	while ((option = getopt(argc, argv, "p:l:j:u:n:c:d:r:h")) != -1) {
+		switch (option) {
+		case 'p':
+			profile.port = atoi(optarg);
+			break;
+		case 'l':
+			profile.latency = atoi(optarg);
+			break;
+		case 'j':
+			profile.jitter = atoi(optarg);
+			break;
+		case 'u':
+			profile.unavailable = atof(optarg);
+			break;
+		case 'n':
+			profile.not_registered = atof(optarg);
+			break;
+		case 'c':
+			profile.canonical = atof(optarg);
+			break;
+		case 'd':
+			profile.down = atof(optarg);
+			break;
+		case 'r':
+			profile.retry_after = atoi(optarg);
+			break;
+		default:
+			usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Without SA_RESTART, so the signal interrupts accept */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_mock;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(profile.port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener == -1 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1
+	    || bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listener, 1024) == -1) {
+		fprintf(stderr, "mockgcm: can't listen on port %d: %s\n", profile.port, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	while (keep_running) {
+		int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+		pthread_attr_t attributes;
+		pthread_t thread;
+
+		if (connection == -1) {
+			continue;
+		}
+		pthread_attr_init(&attributes);
+		pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attributes, serve, (void *)(long)connection) != 0) {
+			close(connection);
+		}
+		pthread_attr_destroy(&attributes);
+	}
+
+	close(listener);
+	printf("mockgcm: %lu requests (%lu answered 503), %lu ids (%lu failed)\n",
+	       __atomic_load_n(&requests, __ATOMIC_RELAXED), __atomic_load_n(&down_requests, __ATOMIC_RELAXED),
+	       __atomic_load_n(&ids, __ATOMIC_RELAXED), __atomic_load_n(&failed_ids, __ATOMIC_RELAXED));
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,143 @@
+#include "circuitbreaker.h"
+
+#include <string.h>
+
+/*
+ * Initializes a closed CircuitBreaker
+ * @param breaker the pointer to the CircuitBreaker object
+ * @param endpoint what it guards
+ * @param threshold the failures in a row that open it, 0 to never open
+ * @param open_time how long it stays open, in milliseconds
+ * @param probes the requests to let through while half open
+ */
+void
+circuit_breaker_init(CircuitBreaker *breaker, char *endpoint, int threshold, long long open_time, int probes)
+{
+	memset(breaker, 0, sizeof(CircuitBreaker));
+	breaker->endpoint = endpoint;
+	breaker->state = CIRCUIT_CLOSED;
+	breaker->threshold = threshold > 0 ? threshold : 0;
+	breaker->open_time = open_time;
+	breaker->probes = probes > 0 ? probes : 1;
+}
+
+/*
+ * Opens the CircuitBreaker
+ * @param breaker the pointer to the CircuitBreaker object
+ * @param now the time, in milliseconds
+ */
+static void
+circuit_breaker_open(CircuitBreaker *breaker, long long now)
+{
+	breaker->state = CIRCUIT_OPEN;
+	breaker->opened = now;
+	breaker->probing = 0;
+	breaker->passed = 0;
+	breaker->generation++;
+	breaker->opens++;
+}
+
+/*
+ * Tells whether a request would be let through now. Once it was open for
+ * long enough, it is half open from now on.
+ * @param breaker the pointer to the CircuitBreaker object
+ * @param now the time, in milliseconds
+ * @return 1 if a request would be let through, 0 if not
+ */
+int
+circuit_breaker_ready(CircuitBreaker *breaker, long long now)
+{
+	if (breaker->state == CIRCUIT_OPEN && now - breaker->opened >= breaker->open_time) {
+		breaker->state = CIRCUIT_HALF_OPEN;
+	}
+
+	switch (breaker->state) {
+	case CIRCUIT_CLOSED:
+		return 1;
+	case CIRCUIT_HALF_OPEN:
+		return breaker->probing + breaker->passed < breaker->probes;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Lets a request through, if it can go now
+ * @param breaker the pointer to the CircuitBreaker object
+ * @param now the time, in milliseconds
+ * @param probe will be set to the generation of the breaker if the request
+ * probes the endpoint (never 0), 0 if not. Hand it to circuit_breaker_done.
+ * @return 1 if the request can go, 0 if not
+ */
+int
+circuit_breaker_allow(CircuitBreaker *breaker, long long now, int *probe)
+{
+	*probe = 0;
+	if (! circuit_breaker_ready (breaker, now)) {
+		return 0;
+	}
+
+	if (breaker->state == CIRCUIT_HALF_OPEN) {
+		breaker->probing++;
+		*probe = breaker->generation;
+	}
+
+	return 1;
+}
+
+/*
+ * Counts a request that is done
+ * @param breaker the pointer to the CircuitBreaker object
+ * @param failed 1 if it failed (a network error or a 5xx status), 0 if not
+ * @param probe what circuit_breaker_allow set for it
+ * @param now the time, in milliseconds
+ * @return 1 if the CircuitBreaker opened or closed, 0 if not
+ */
+int
+circuit_breaker_done(CircuitBreaker *breaker, int failed, int probe, long long now)
+{
+	if (breaker->state == CIRCUIT_CLOSED) {
+		breaker->failures = failed ? breaker->failures + 1 : 0;
+		if (breaker->threshold > 0 && breaker->failures >= breaker->threshold) {
+			circuit_breaker_open (breaker, now);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (breaker->state != CIRCUIT_HALF_OPEN || probe != breaker->generation) {
+		return 0; /* Sent before it last opened, it tells nothing new */
+	}
+
+	breaker->probing--;
+	if (failed) {
+		circuit_breaker_open (breaker, now);
+		return 1;
+	}
+	if (++breaker->passed >= breaker->probes) {
+		breaker->state = CIRCUIT_CLOSED;
+		breaker->failures = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Tells how long until the CircuitBreaker is half open
+ * @param breaker the pointer to the CircuitBreaker object
+ * @param now the time, in milliseconds
+ * @return the time in milliseconds, or -1 if it isn't open
+ */
+long long
+circuit_breaker_wait(CircuitBreaker *breaker, long long now)
+{
+	long long left;
+
+	if (breaker->state != CIRCUIT_OPEN) {
+		return -1;
+	}
+
+	left = breaker->opened + breaker->open_time - now;
+	return left > 0 ? left : 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * The CircuitBreaker stops the requests to an endpoint that is down. It is
+ * closed while the endpoint works. After threshold requests in a row fail
+ * (a network error or a 5xx status), it opens: no request is let through for
+ * open_time milliseconds. Then it is half open, and lets through up to probes
+ * requests to probe the endpoint. When they all succeed, it closes again,
+ * when one fails, it opens again. Every time it opens starts a new
+ * generation: a probe that comes back after that tells nothing of the
+ * endpoint now, and is not counted.
+ */
+
+#ifndef _CIRCUITBREAKER_H_
+#define _CIRCUITBREAKER_H_
+
+#define CIRCUIT_CLOSED 0
+#define CIRCUIT_OPEN 1
+#define CIRCUIT_HALF_OPEN 2
+
+typedef struct {
+	char *endpoint; /* what it guards, for the messages */
+	int state;
+	int threshold; /* the failures in a row that open it, 0 to never open */
+	int failures; /* in a row, while closed */
+	long long open_time; /* how long it stays open, in milliseconds */
+	long long opened; /* when it last opened */
+	int generation; /* goes up every time it opens, the probes carry it */
+	int probes; /* the requests to let through while half open */
+	int probing; /* of them, in flight */
+	int passed; /* of them, that succeeded */
+	unsigned long opens; /* for the statistics */
+} CircuitBreaker;
+
+void
+circuit_breaker_init(CircuitBreaker *breaker, char *endpoint, int threshold, long long open_time, int probes);
+
+int
+circuit_breaker_ready(CircuitBreaker *breaker, long long now);
+
+int
+circuit_breaker_allow(CircuitBreaker *breaker, long long now, int *probe);
+
+int
+circuit_breaker_done(CircuitBreaker *breaker, int failed, int probe, long long now);
+
+long long
+circuit_breaker_wait(CircuitBreaker *breaker, long long now);
+
+#endif
@@ -0,0 +1,254 @@
+#include "coalescer.h"
+#include "stringbuffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Hashes the rest of a message (FNV-1a)
+ * @param rest the rest of the message
+ * @return the hash
+ */
+static unsigned int
+coalescer_hash(const char *rest)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*rest != '\0') {
+		hash ^= (unsigned char)*rest++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Creates the Coalescer
+ * @param group_count how many payloads can wait at the same time. With none,
+ * every message is dispatched on its own.
+ * @param max_tokens the most registration ids in one request
+ * @param dispatch the function that sends a request
+ * @param context passed to dispatch
+ * @return a pointer to the Coalescer, or NULL if we are out of memory
+ */
+Coalescer *
+coalescer_create(int group_count, int max_tokens, CoalescerDispatch dispatch, void *context)
+{
+	Coalescer *coalescer = (Coalescer *)calloc(1, sizeof(Coalescer));
+	int i;
+
+	if (coalescer == NULL) {
+		return NULL;
+	}
+
+	coalescer->max_tokens = max_tokens;
+	coalescer->dispatch = dispatch;
+	coalescer->context = context;
+	if (group_count > 0) {
+		coalescer->groups = (struct CoalescerGroup *)calloc(group_count, sizeof(struct CoalescerGroup));
+		if (coalescer->groups == NULL) {
+			free(coalescer);
+			return NULL;
+		}
+		coalescer->group_count = group_count;
+	}
+
+	for (i = 0; i < coalescer->group_count; i++) {
+		coalescer->groups[i].rest = string_buffer_create (250);
+		if (coalescer->groups[i].rest == NULL) {
+			coalescer_free (coalescer);
+			return NULL;
+		}
+	}
+
+	return coalescer;
+}
+
+/*
+ * Dispatches the messages of a group, and frees the group
+ * @param coalescer the pointer to the Coalescer object
+ * @param group the group
+ */
+static void
+coalescer_dispatch(Coalescer *coalescer, struct CoalescerGroup *group)
+{
+	if (group->part_count == 0) {
+		return;
+	}
+
+	coalescer->requests++;
+	coalescer->dispatch(coalescer->context, string_buffer_get_string (group->rest),
+	                    group->parts, group->part_count, group->token_count);
+	group->part_count = 0;
+	group->token_count = 0;
+}
+
+/*
+ * Finds the group of a payload. When there is none, a free group is taken
+ * for it, and when no group is free, the fullest one is dispatched to make
+ * room.
+ * @param coalescer the pointer to the Coalescer object
+ * @param rest the rest of the message
+ * @param hash the hash of the rest
+ * @return the group
+ */
+static struct CoalescerGroup *
+coalescer_group(Coalescer *coalescer, char *rest, unsigned int hash)
+{
+	struct CoalescerGroup *free_group = NULL;
+	struct CoalescerGroup *fullest = &coalescer->groups[0];
+	int i;
+
+	for (i = 0; i < coalescer->group_count; i++) {
+		struct CoalescerGroup *group = &coalescer->groups[i];
+		if (group->part_count == 0) {
+			if (free_group == NULL) {
+				free_group = group;
+			}
+			continue;
+		}
+		if (group->hash == hash && strcmp(string_buffer_get_string (group->rest), rest) == 0) {
+			return group;
+		}
+		if (group->token_count > fullest->token_count) {
+			fullest = group;
+		}
+	}
+
+	if (free_group == NULL) {
+		coalescer_dispatch (coalescer, fullest);
+		free_group = fullest;
+	}
+
+	string_buffer_recycle (free_group->rest);
+	string_buffer_append (free_group->rest, rest);
+	free_group->hash = hash;
+
+	return free_group;
+}
+
+/*
+ * Dispatches a part of a message in a request of its own
+ * @param coalescer the pointer to the Coalescer object
+ * @param rest the rest of the message
+ * @param part the part
+ */
+static void
+coalescer_dispatch_part(Coalescer *coalescer, char *rest, CoalescedPart *part)
+{
+	coalescer->requests++;
+	coalescer->dispatch(coalescer->context, rest, part, 1, part->count);
+}
+
+/*
+ * Adds a message. It may be dispatched right away, with the messages that
+ * wait in its group, or wait for more messages with the same payload. A
+ * message with more registration ids than a request can take is split, its
+ * first part fills up the group and the next ones take whole requests. A 
+ * message that fits in a request is never split. Messages without 
+ * registration ids (e.g. sent to a notification key) are always dispatched 
+ * on their own.
+ * @param coalescer the pointer to the Coalescer object
+ * @param rest the rest of the message: all the fields but the registration ids
+ * @param tokens the registration ids
+ * @param count the number of registration ids
+ * @param message the caller's message, handed to dispatch
+ * @return the number of parts the message was split in. They may be 
+ * dispatched (and done) before this returns.
+ */
+int
+coalescer_add(Coalescer *coalescer, char *rest, char **tokens, int count, void *message)
+{
+	CoalescedPart part;
+	struct CoalescerGroup *group;
+	int parts = 0;
+
+	part.message = message;
+	part.offset = 0;
+	coalescer->messages++;
+
+	if (coalescer->group_count == 0 || count == 0) {
+		/* On their own, in parts that fit */
+		do {
+			part.tokens = tokens + part.offset;
+			part.count = count - part.offset < coalescer->max_tokens ? count - part.offset : coalescer->max_tokens;
+			coalescer_dispatch_part (coalescer, rest, &part);
+			part.offset += part.count;
+			parts++;
+		} while (part.offset < count);
+
+		return parts;
+	}
+
+	group = coalescer_group (coalescer, rest, coalescer_hash (rest));
+	while (part.offset < count) {
+		int left = count - part.offset;
+		int room = coalescer->max_tokens - group->token_count;
+
+		if (left <= coalescer->max_tokens && left > room) {
+			/* It fits in a request of its own, send the ones before it */
+			coalescer_dispatch (coalescer, group);
+			room = coalescer->max_tokens;
+		}
+
+		part.tokens = tokens + part.offset;
+		part.count = left < room ? left : room;
+		parts++;
+
+		if (group->part_count == group->part_space) {
+			int space = group->part_space > 0 ? group->part_space * 2 : 16;
+			CoalescedPart *grown = (CoalescedPart *)realloc(group->parts, space * sizeof(CoalescedPart));
+			if (grown != NULL) {
+				group->parts = grown;
+				group->part_space = space;
+			}
+		}
+
+		if (group->part_count < group->part_space) {
+			group->parts[group->part_count++] = part;
+			group->token_count += part.count;
+			if (group->token_count == coalescer->max_tokens) {
+				coalescer_dispatch (coalescer, group);
+			}
+		} else {
+			/* Out of memory, send it on its own */
+			coalescer_dispatch_part (coalescer, rest, &part);
+		}
+		part.offset += part.count;
+	}
+
+	return parts;
+}
+
+/*
+ * Dispatches all the messages that wait
+ * @param coalescer the pointer to the Coalescer object
+ */
+void
+coalescer_flush(Coalescer *coalescer)
+{
+	int i;
+
+	for (i = 0; i < coalescer->group_count; i++) {
+		coalescer_dispatch (coalescer, &coalescer->groups[i]);
+	}
+}
+
+/*
+ * Frees the Coalescer. Flush it first, the messages that wait are dropped.
+ * @param coalescer the pointer to the Coalescer object
+ */
+void
+coalescer_free(Coalescer *coalescer)
+{
+	int i;
+
+	for (i = 0; i < coalescer->group_count; i++) {
+		if (coalescer->groups[i].rest != NULL) {
+			string_buffer_free (coalescer->groups[i].rest);
+		}
+		free(coalescer->groups[i].parts);
+	}
+	free(coalescer->groups);
+	free(coalescer);
+}
@@ -0,0 +1,59 @@
+/*
+ * The Coalescer packs messages that differ only in their registration ids
+ * into shared requests. Messages wait in groups, one for every payload (the
+ * rest of the message's fields), and a group is dispatched once it holds as
+ * many registration ids as one request can take, or when the Coalescer is
+ * flushed. A message with more registration ids than that is split in parts,
+ * that are dispatched as they fill up. The dispatched request lists the parts
+ * in the order of their registration ids, so the results can be handed back
+ * to every message.
+ */
+
+#ifndef _COALESCER_H_
+#define _COALESCER_H_
+
+#include "stringbuffer.h"
+
+/* A message, or a part of it, as it is packed in a request */
+typedef struct {
+	void *message; /* the caller's message */
+	char **tokens; /* the registration ids of the part */
+	int count;
+	int offset; /* of the first of them in the message */
+} CoalescedPart;
+
+/* Sends a request: the registration ids of all the parts, then the rest */
+typedef void (*CoalescerDispatch)(void *context, char *rest, CoalescedPart *parts, int part_count, int token_count);
+
+struct CoalescerGroup {
+	unsigned int hash; /* of the rest */
+	StringBuffer *rest; /* the fields the messages share */
+	CoalescedPart *parts; /* empty when the group is free */
+	int part_count;
+	int part_space;
+	int token_count;
+};
+
+typedef struct {
+	struct CoalescerGroup *groups;
+	int group_count;
+	int max_tokens; /* the most registration ids in one request */
+	CoalescerDispatch dispatch;
+	void *context; /* for dispatch */
+	unsigned long messages; /* for the statistics */
+	unsigned long requests;
+} Coalescer;
+
+Coalescer *
+coalescer_create(int group_count, int max_tokens, CoalescerDispatch dispatch, void *context);
+
+int
+coalescer_add(Coalescer *coalescer, char *rest, char **tokens, int count, void *message);
+
+void
+coalescer_flush(Coalescer *coalescer);
+
+void
+coalescer_free(Coalescer *coalescer);
+
+#endif
@@ -0,0 +1,381 @@
+#include "filering.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* The calls we make, the kernel must support all of them */
+static const int file_ring_ops[] = {
+	IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_RENAMEAT
+};
+
+/*
+ * Checks that the kernel supports the calls we make
+ * @param ring the pointer to the FileRing object
+ * @return 1 if it does, 0 if it doesn't
+ */
+static int
+file_ring_probe(FileRing *ring)
+{
+	struct io_uring_probe *probe;
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	unsigned int i;
+	int supported = 1;
+
+	probe = (struct io_uring_probe *)calloc(1, size);
+	if (probe == NULL) {
+		return 0;
+	}
+
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+		free(probe);
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(file_ring_ops) / sizeof(file_ring_ops[0]); i++) {
+		int op = file_ring_ops[i];
+		if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+			supported = 0;
+		}
+	}
+
+	free(probe);
+	return supported;
+}
+
+/*
+ * Creates the FileRing
+ * @param entries how many calls can be prepared at a time
+ * @return a pointer to the FileRing, or NULL if io_uring can't be used
+ */
+FileRing *
+file_ring_create(unsigned entries)
+{
+	struct io_uring_params params;
+	FileRing *ring = (FileRing *)calloc(1, sizeof(FileRing));
+	char *sq;
+	char *cq;
+
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd == -1) {
+		/* Not there (ENOSYS), or not allowed (EPERM) */
+		free(ring);
+		return NULL;
+	}
+	ring->entries = params.sq_entries;
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		/* Both rings are in one mapping */
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                     ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		file_ring_free (ring);
+		return NULL;
+	}
+	if (ring->cq_ring_size > 0) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                     ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			file_ring_free (ring);
+			return NULL;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	                                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		file_ring_free (ring);
+		return NULL;
+	}
+
+	sq = (char *)ring->sq_ring;
+	cq = ring->cq_ring != NULL ? (char *)ring->cq_ring : sq;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	if (! file_ring_probe (ring)) {
+		file_ring_free (ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+/*
+ * Prepares a call
+ * @param ring the pointer to the FileRing object
+ * @param opcode the call
+ * @param fd the file (or directory) it is made on
+ * @param result where to write the result, or NULL
+ * @return the submission entry to fill in, or NULL if the ring is full
+ */
+static struct io_uring_sqe *
+file_ring_prepare(FileRing *ring, int opcode, int fd, int *result)
+{
+	unsigned index;
+	struct io_uring_sqe *sqe;
+
+	if (ring->queued == ring->entries) {
+		return NULL;
+	}
+
+	index = (*ring->sq_tail + ring->queued) & *ring->sq_mask;
+	ring->queued++;
+
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = (unsigned long long)(uintptr_t)result;
+	ring->sq_array[index] = index;
+	if (result != NULL) {
+		*result = -ECANCELED; /* until it is made */
+	}
+
+	return sqe;
+}
+
+/*
+ * Prepares an openat call
+ * @param ring the pointer to the FileRing object
+ * @param dir the directory the path is relative to
+ * @param path the file, it must stay valid until the call is run
+ * @param flags as for openat
+ * @param mode as for openat
+ * @param result gets the file descriptor, or -errno
+ * @return 0 on success, -1 if the ring is full
+ */
+int
+file_ring_openat(FileRing *ring, int dir, const char *path, int flags, mode_t mode, int *result)
+{
+	struct io_uring_sqe *sqe = file_ring_prepare (ring, IORING_OP_OPENAT, dir, result);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->addr = (unsigned long long)(uintptr_t)path;
+	sqe->open_flags = flags;
+	sqe->len = mode;
+
+	return 0;
+}
+
+/*
+ * Prepares a statx call, for the size and the modification time of a file
+ * @param ring the pointer to the FileRing object
+ * @param dir the directory the path is relative to
+ * @param path the file, it must stay valid until the call is run
+ * @param info gets the size and the modification time of the file
+ * @param result gets 0, or -errno
+ * @return 0 on success, -1 if the ring is full
+ */
+int
+file_ring_statx(FileRing *ring, int dir, const char *path, struct statx *info, int *result)
+{
+	struct io_uring_sqe *sqe = file_ring_prepare (ring, IORING_OP_STATX, dir, result);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->addr = (unsigned long long)(uintptr_t)path;
+	sqe->len = STATX_SIZE | STATX_MTIME;
+	sqe->off = (unsigned long long)(uintptr_t)info;
+
+	return 0;
+}
+
+/*
+ * Prepares a read call, from the start of the file
+ * @param ring the pointer to the FileRing object
+ * @param fd the file
+ * @param buffer where to read to
+ * @param length how much to read
+ * @param result gets the number of bytes read, or -errno
+ * @return 0 on success, -1 if the ring is full
+ */
+int
+file_ring_read(FileRing *ring, int fd, void *buffer, size_t length, int *result)
+{
+	struct io_uring_sqe *sqe = file_ring_prepare (ring, IORING_OP_READ, fd, result);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->addr = (unsigned long long)(uintptr_t)buffer;
+	sqe->len = length;
+
+	return 0;
+}
+
+/*
+ * Prepares a write call, at the start of the file
+ * @param ring the pointer to the FileRing object
+ * @param fd the file
+ * @param buffer what to write
+ * @param length how much to write
+ * @param result gets the number of bytes written, or -errno
+ * @return 0 on success, -1 if the ring is full
+ */
+int
+file_ring_write(FileRing *ring, int fd, const void *buffer, size_t length, int *result)
+{
+	struct io_uring_sqe *sqe = file_ring_prepare (ring, IORING_OP_WRITE, fd, result);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->addr = (unsigned long long)(uintptr_t)buffer;
+	sqe->len = length;
+
+	return 0;
+}
+
+/*
+ * Prepares a close call
+ * @param ring the pointer to the FileRing object
+ * @param fd the file
+ * @param result gets 0, or -errno
+ * @return 0 on success, -1 if the ring is full
+ */
+int
+file_ring_close(FileRing *ring, int fd, int *result)
+{
+	return file_ring_prepare (ring, IORING_OP_CLOSE, fd, result) != NULL ? 0 : -1;
+}
+
+/*
+ * Prepares a renameat call
+ * @param ring the pointer to the FileRing object
+ * @param old_dir the directory old_path is relative to
+ * @param old_path the file, it must stay valid until the call is run
+ * @param new_dir the directory new_path is relative to
+ * @param new_path its new name, it must stay valid until the call is run
+ * @param result gets 0, or -errno
+ * @return 0 on success, -1 if the ring is full
+ */
+int
+file_ring_renameat(FileRing *ring, int old_dir, const char *old_path, int new_dir, const char *new_path, int *result)
+{
+	struct io_uring_sqe *sqe = file_ring_prepare (ring, IORING_OP_RENAMEAT, old_dir, result);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->addr = (unsigned long long)(uintptr_t)old_path;
+	sqe->len = new_dir;
+	sqe->addr2 = (unsigned long long)(uintptr_t)new_path;
+
+	return 0;
+}
+
+/*
+ * Makes the next call wait for the last one prepared, e.g. to close a file
+ * after reading it. The next call is made even if the last one fails.
+ * @param ring the pointer to the FileRing object
+ */
+void
+file_ring_link(FileRing *ring)
+{
+	if (ring->queued > 0) {
+		unsigned index = (*ring->sq_tail + ring->queued - 1) & *ring->sq_mask;
+		ring->sqes[index].flags |= IOSQE_IO_HARDLINK;
+	}
+}
+
+/*
+ * Makes all the calls that were prepared, and waits for them
+ * @param ring the pointer to the FileRing object
+ * @return 0 on success, -1 on error (check errno)
+ */
+int
+file_ring_run(FileRing *ring)
+{
+	unsigned submit = ring->queued;
+	unsigned waiting = ring->queued;
+
+	if (ring->queued == 0) {
+		return 0;
+	}
+
+	/* Hand the prepared calls to the kernel */
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+	ring->queued = 0;
+
+	while (waiting > 0) {
+		unsigned head;
+		unsigned tail;
+		long submitted = syscall(__NR_io_uring_enter, ring->fd, submit, waiting, IORING_ENTER_GETEVENTS, NULL, 0);
+
+		if (submitted == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		submit -= submitted;
+
+		/* Write the results of the calls that are done */
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			int *result = (int *)(uintptr_t)cqe->user_data;
+
+			if (result != NULL) {
+				*result = cqe->res;
+			}
+			head++;
+			waiting--;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/*
+ * Frees the FileRing
+ * @param ring the pointer to the FileRing object
+ */
+void
+file_ring_free(FileRing *ring)
+{
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring != NULL) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring != NULL) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	close(ring->fd);
+	free(ring);
+}
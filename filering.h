@@ -0,0 +1,72 @@
+/*
+ * The FileRing batches file system calls with io_uring: the calls are
+ * prepared one by one, then submitted together with a single system call,
+ * and run waits until all of them are done. Every call writes its result
+ * where it is told to, as the system call would return it, but with -errno
+ * on error.
+ * io_uring needs Linux 5.11 (for renameat). When it is not there, or not
+ * allowed, file_ring_create returns NULL and the caller makes the calls
+ * itself.
+ */
+
+#ifndef _FILERING_H_
+#define _FILERING_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/stat.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+typedef struct {
+	int fd; /* the io_uring */
+	unsigned entries; /* how many calls can be prepared at a time */
+	unsigned queued; /* prepared, and not yet run */
+	unsigned *sq_head; /* the submission ring */
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head; /* the completion ring */
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring; /* the mappings, to unmap them */
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} FileRing;
+
+FileRing *
+file_ring_create(unsigned entries);
+
+int
+file_ring_openat(FileRing *ring, int dir, const char *path, int flags, mode_t mode, int *result);
+
+int
+file_ring_statx(FileRing *ring, int dir, const char *path, struct statx *info, int *result);
+
+int
+file_ring_read(FileRing *ring, int fd, void *buffer, size_t length, int *result);
+
+int
+file_ring_write(FileRing *ring, int fd, const void *buffer, size_t length, int *result);
+
+int
+file_ring_close(FileRing *ring, int fd, int *result);
+
+int
+file_ring_renameat(FileRing *ring, int old_dir, const char *old_path, int new_dir, const char *new_path, int *result);
+
+void
+file_ring_link(FileRing *ring);
+
+int
+file_ring_run(FileRing *ring);
+
+void
+file_ring_free(FileRing *ring);
+
+#endif
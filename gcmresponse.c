@@ -0,0 +1,452 @@
+#include "gcmresponse.h"
+#include "stringbuffer.h"
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The states of the tokenizer */
+enum {
+	GCM_VALUE, /* a value is next */
+	GCM_VALUE_FIRST, /* a value or the end of an empty array */
+	GCM_KEY, /* a key is next */
+	GCM_KEY_FIRST, /* a key or the end of an empty object */
+	GCM_COLON,
+	GCM_NEXT, /* a comma or the end of the container */
+	GCM_STRING,
+	GCM_ESCAPE,
+	GCM_UNICODE,
+	GCM_LITERAL, /* a number, true, false or null */
+	GCM_DONE
+};
+
+/* The fields we keep */
+enum {
+	GCM_FIELD_NONE,
+	GCM_FIELD_MULTICAST_ID,
+	GCM_FIELD_SUCCESS,
+	GCM_FIELD_FAILURE,
+	GCM_FIELD_CANONICAL_IDS,
+	GCM_FIELD_RESULTS,
+	GCM_FIELD_MESSAGE_ID,
+	GCM_FIELD_REGISTRATION_ID,
+	GCM_FIELD_ERROR
+};
+
+/*
+ * Prepares the GcmResponse for a new response
+ * @param response the pointer to the GcmResponse object
+ * @param arena where the results (and the tokenizer's buffer) are allocated
+ */
+void
+gcm_response_init(GcmResponse *response, Arena *arena)
+{
+	response->multicast_id = 0;
+	response->success = -1;
+	response->failure = -1;
+	response->canonical_ids = -1;
+	response->results = NULL;
+	response->result_count = 0;
+	response->complete = 0;
+	response->error = 0;
+	response->status = 0;
+	response->retry_after = 0;
+	response->first_byte = 0;
+
+	response->arena = arena;
+	response->result_space = 0;
+	response->state = GCM_VALUE;
+	response->key = 0;
+	response->depth = 0;
+	response->token = string_buffer_create_in (arena, 64);
+	response->code = 0;
+	response->digits = 0;
+	response->surrogate = 0;
+	if (response->token == NULL) {
+		response->error = 1; /* Out of memory */
+	}
+}
+
+/*
+ * Are we inside one of the objects of the results array
+ * @param response the pointer to the GcmResponse object
+ */
+static int
+gcm_in_result(GcmResponse *response)
+{
+	return response->depth == 3 && response->field[0] == GCM_FIELD_RESULTS
+	       && response->stack[1] == '[' && response->stack[2] == '{';
+}
+
+/*
+ * Opens an object or an array
+ * @param response the pointer to the GcmResponse object
+ * @param bracket '{' or '['
+ */
+static void
+gcm_open(GcmResponse *response, char bracket)
+{
+	if (response->depth == GCM_MAX_DEPTH || (response->depth == 0 && bracket != '{')) {
+		response->error = 1; /* Too deep, or not an object at all */
+		return;
+	}
+
+	response->stack[response->depth] = bracket;
+	response->field[response->depth] = GCM_FIELD_NONE;
+	response->depth++;
+	response->state = bracket == '{' ? GCM_KEY_FIRST : GCM_VALUE_FIRST;
+
+	if (gcm_in_result (response)) {
+		/* A new entry, grow the array when it is full */
+		if (response->result_count == response->result_space) {
+			int space = response->result_space > 0 ? response->result_space * 2 : 16;
+			GcmResult *results = (GcmResult *)arena_alloc (response->arena, space * sizeof(GcmResult));
+			if (results == NULL) {
+				response->error = 1;
+				return;
+			}
+			if (response->result_count > 0) {
+				memcpy(results, response->results, response->result_count * sizeof(GcmResult));
+			}
+			response->results = results;
+			response->result_space = space;
+		}
+		memset(&response->results[response->result_count], 0, sizeof(GcmResult));
+		response->result_count++;
+	}
+}
+
+/*
+ * Closes an object or an array
+ * @param response the pointer to the GcmResponse object
+ */
+static void
+gcm_close(GcmResponse *response)
+{
+	response->depth--;
+	if (response->depth == 0) {
+		response->complete = 1;
+		response->state = GCM_DONE;
+	} else {
+		response->state = GCM_NEXT;
+	}
+}
+
+/*
+ * Handles the key that was just read
+ * @param response the pointer to the GcmResponse object
+ */
+static void
+gcm_key(GcmResponse *response)
+{
+	char *key = string_buffer_get_string (response->token);
+	int field = GCM_FIELD_NONE;
+
+	if (response->depth == 1) {
+		if (strcmp(key, "multicast_id") == 0) {
+			field = GCM_FIELD_MULTICAST_ID;
+		} else if (strcmp(key, "success") == 0) {
+			field = GCM_FIELD_SUCCESS;
+		} else if (strcmp(key, "failure") == 0) {
+			field = GCM_FIELD_FAILURE;
+		} else if (strcmp(key, "canonical_ids") == 0) {
+			field = GCM_FIELD_CANONICAL_IDS;
+		} else if (strcmp(key, "results") == 0) {
+			field = GCM_FIELD_RESULTS;
+		}
+	} else if (gcm_in_result (response)) {
+		if (strcmp(key, "message_id") == 0) {
+			field = GCM_FIELD_MESSAGE_ID;
+		} else if (strcmp(key, "registration_id") == 0) {
+			field = GCM_FIELD_REGISTRATION_ID;
+		} else if (strcmp(key, "error") == 0) {
+			field = GCM_FIELD_ERROR;
+		}
+	}
+
+	response->field[response->depth - 1] = field;
+	response->state = GCM_COLON;
+}
+
+/*
+ * Handles the value that was just read
+ * @param response the pointer to the GcmResponse object
+ * @param string is the value a string (or a literal)
+ */
+static void
+gcm_value(GcmResponse *response, int string)
+{
+	char *value = string_buffer_get_string (response->token);
+	int field = response->field[response->depth - 1];
+
+	response->state = GCM_NEXT;
+
+	if (response->depth == 1 && ! string) {
+		switch (field) {
+		case GCM_FIELD_MULTICAST_ID:
+			response->multicast_id = strtoull(value, NULL, 10);
+			break;
+		case GCM_FIELD_SUCCESS:
+			response->success = atoi(value);
+			break;
+		case GCM_FIELD_FAILURE:
+			response->failure = atoi(value);
+			break;
+		case GCM_FIELD_CANONICAL_IDS:
+			response->canonical_ids = atoi(value);
+			break;
+		}
+	} else if (string && gcm_in_result (response)) {
+		GcmResult *result = &response->results[response->result_count - 1];
+		char **target = NULL;
+
+		switch (field) {
+		case GCM_FIELD_MESSAGE_ID:
+			target = &result->message_id;
+			break;
+		case GCM_FIELD_REGISTRATION_ID:
+			target = &result->registration_id;
+			break;
+		case GCM_FIELD_ERROR:
+			target = &result->error;
+			break;
+		}
+		if (target != NULL) {
+			*target = (char *)arena_alloc (response->arena, response->token->length + 1);
+			if (*target == NULL) {
+				response->error = 1;
+				return;
+			}
+			memcpy(*target, value, response->token->length + 1);
+		}
+	}
+}
+
+/*
+ * Adds a character given as a \u escape to the string being read, in UTF-8
+ * @param response the pointer to the GcmResponse object
+ */
+static void
+gcm_unicode(GcmResponse *response)
+{
+	unsigned int code = response->code;
+	char bytes[4];
+	int length;
+
+	if (code >= 0xD800 && code <= 0xDBFF) {
+		/* The first half of a pair, wait for the second */
+		response->surrogate = code;
+		return;
+	}
+	if (code >= 0xDC00 && code <= 0xDFFF && response->surrogate != 0) {
+		code = 0x10000 + ((response->surrogate - 0xD800) << 10) + (code - 0xDC00);
+	}
+	response->surrogate = 0;
+
+	if (code < 0x80) {
+		bytes[0] = code;
+		length = 1;
+	} else if (code < 0x800) {
+		bytes[0] = 0xC0 | (code >> 6);
+		bytes[1] = 0x80 | (code & 0x3F);
+		length = 2;
+	} else if (code < 0x10000) {
+		bytes[0] = 0xE0 | (code >> 12);
+		bytes[1] = 0x80 | ((code >> 6) & 0x3F);
+		bytes[2] = 0x80 | (code & 0x3F);
+		length = 3;
+	} else {
+		bytes[0] = 0xF0 | (code >> 18);
+		bytes[1] = 0x80 | ((code >> 12) & 0x3F);
+		bytes[2] = 0x80 | ((code >> 6) & 0x3F);
+		bytes[3] = 0x80 | (code & 0x3F);
+		length = 4;
+	}
+	string_buffer_append_n (response->token, bytes, length);
+}
+
+/*
+ * Reads the next part of the response. It can be any part, split anywhere.
+ * @param response the pointer to the GcmResponse object
+ * @param data the characters that arrived
+ * @param length how many characters
+ * @return 1 if all is well so far, 0 if this is not the JSON we expect
+ */
+int
+gcm_response_feed(GcmResponse *response, const char *data, size_t length)
+{
+	const char *end = data + length;
+	const char *stop;
+	char character;
+
+	while (data < end && ! response->error) {
+		character = *data;
+
+		switch (response->state) {
+		case GCM_STRING:
+			/* Copy everything up to the closing quote or an escape at once */
+			stop = data;
+			while (stop < end && *stop != '"' && *stop != '\\') {
+				stop++;
+			}
+			string_buffer_append_n (response->token, data, stop - data);
+			data = stop;
+			if (data == end) {
+				continue; /* The rest is in the next part */
+			}
+			if (*data == '"') {
+				if (response->key) {
+					gcm_key (response);
+				} else {
+					gcm_value (response, 1);
+				}
+			} else {
+				response->state = GCM_ESCAPE;
+			}
+			break;
+
+		case GCM_ESCAPE:
+			response->state = GCM_STRING;
+			switch (character) {
+			case 'b':
+				string_buffer_append_char (response->token, '\b');
+				break;
+			case 'f':
+				string_buffer_append_char (response->token, '\f');
+				break;
+			case 'n':
+				string_buffer_append_char (response->token, '\n');
+				break;
+			case 'r':
+				string_buffer_append_char (response->token, '\r');
+				break;
+			case 't':
+				string_buffer_append_char (response->token, '\t');
+				break;
+			case 'u':
+				response->code = 0;
+				response->digits = 0;
+				response->state = GCM_UNICODE;
+				break;
+			default:
+				/* \" \\ \/ stand for themselves */
+				string_buffer_append_char (response->token, character);
+			}
+			break;
+
+		case GCM_UNICODE:
+			if (character >= '0' && character <= '9') {
+				response->code = response->code * 16 + (character - '0');
+			} else if (character >= 'a' && character <= 'f') {
+				response->code = response->code * 16 + (character - 'a' + 10);
+			} else if (character >= 'A' && character <= 'F') {
+				response->code = response->code * 16 + (character - 'A' + 10);
+			} else {
+				response->error = 1;
+				break;
+			}
+			response->digits++;
+			if (response->digits == 4) {
+				gcm_unicode (response);
+				response->state = GCM_STRING;
+			}
+			break;
+
+		case GCM_LITERAL:
+			if ((character >= '0' && character <= '9') || (character >= 'a' && character <= 'z')
+			    || character == '-' || character == '+' || character == '.' || character == 'E') {
+				string_buffer_append_char (response->token, character);
+				break;
+			}
+			/* The literal is over, this character is handled in the next state */
+			gcm_value (response, 0);
+			continue;
+
+		case GCM_VALUE_FIRST:
+		case GCM_KEY_FIRST:
+			if (character == (response->state == GCM_VALUE_FIRST ? ']' : '}')) {
+				gcm_close (response);
+				break;
+			}
+			if (character != ' ' && character != '\t' && character != '\n' && character != '\r') {
+				/* Anything else is read as usual */
+				response->state = response->state == GCM_VALUE_FIRST ? GCM_VALUE : GCM_KEY;
+				continue;
+			}
+			break;
+
+		default:
+			if (character == ' ' || character == '\t' || character == '\n' || character == '\r') {
+				break; /* Whitespace between the tokens */
+			}
+
+			if (response->state == GCM_VALUE) {
+				if (character == '{' || character == '[') {
+					gcm_open (response, character);
+				} else if (response->depth == 0) {
+					response->error = 1; /* Not JSON, probably an HTML error page */
+				} else if (character == '"') {
+					string_buffer_recycle (response->token);
+					response->key = 0;
+					response->state = GCM_STRING;
+				} else if (character == '-' || (character >= '0' && character <= '9')
+				           || character == 't' || character == 'f' || character == 'n') {
+					string_buffer_recycle (response->token);
+					string_buffer_append_char (response->token, character);
+					response->state = GCM_LITERAL;
+				} else {
+					response->error = 1;
+				}
+			} else if (response->state == GCM_KEY && character == '"') {
+				string_buffer_recycle (response->token);
+				response->key = 1;
+				response->state = GCM_STRING;
+			} else if (response->state == GCM_COLON && character == ':') {
+				response->state = GCM_VALUE;
+			} else if (response->state == GCM_NEXT && character == ',') {
+				response->state = response->stack[response->depth - 1] == '{' ? GCM_KEY : GCM_VALUE;
+			} else if (response->state == GCM_NEXT && character == (response->stack[response->depth - 1] == '{' ? '}' : ']')) {
+				gcm_close (response);
+			} else {
+				response->error = 1; /* Unexpected, or something after the object */
+			}
+		}
+		data++;
+	}
+
+	return ! response->error;
+}
+
+/*
+ * Called once the whole response arrived
+ * @param response the pointer to the GcmResponse object
+ * @return 1 if a complete JSON object was read, 0 otherwise
+ */
+int
+gcm_response_finish(GcmResponse *response)
+{
+	if (! response->complete) {
+		response->error = 1; /* Cut short */
+	}
+
+	return ! response->error;
+}
+
+/*
+ * Gets the counters of the response. A response without them is not the JSON
+ * we are used to, so it counts as a single failure.
+ * @param response the pointer to the finished GcmResponse object
+ * @param successes pointer to an int that will hold the number of successful sends
+ * @param fails pointer to an int that will hold the number of failed sends
+ */
+void
+gcm_response_counts(GcmResponse *response, int *successes, int *fails)
+{
+	if (response->error || response->success < 0 || response->failure < 0) {
+		*successes = 0;
+		*fails = 1;
+	} else {
+		*successes = response->success;
+		*fails = response->failure;
+	}
+}
@@ -0,0 +1,67 @@
+/*
+ * The GcmResponse reads the JSON reply of the push service as it arrives, a
+ * chunk at a time, without building a tree. It keeps the multicast id, the
+ * counters, and the result of every registration id:
+ * {"multicast_id":1,"success":1,"failure":1,"canonical_ids":0,
+ *  "results":[{"message_id":"0:1"},{"error":"NotRegistered"}]}
+ * Everything it keeps is allocated from an Arena.
+ */
+
+#ifndef _GCMRESPONSE_H_
+#define _GCMRESPONSE_H_
+
+#include <stddef.h>
+
+#include "stringbuffer.h"
+#include "arena.h"
+
+/* The deepest nesting we follow */
+#define GCM_MAX_DEPTH 16
+
+typedef struct {
+	char *message_id; /* set when the message was accepted for the token */
+	char *registration_id; /* the canonical registration id, when the token was replaced */
+	char *error; /* the reason (e.g. NotRegistered), when it was not accepted */
+} GcmResult;
+
+typedef struct {
+	/* The response, as far as it was read */
+	unsigned long long multicast_id;
+	int success; /* the counters, or -1 when they are missing */
+	int failure;
+	int canonical_ids;
+	GcmResult *results; /* one for every registration id, in the order sent */
+	int result_count;
+	int complete; /* set once the whole object was read */
+	int error; /* set when the response is not a JSON object */
+	long status; /* the HTTP status, set by the Sender */
+	long retry_after; /* the seconds the Retry-After header asks for, or 0 */
+	long first_byte; /* the microseconds from the start of the request to the first byte of the response */
+
+	/* The tokenizer */
+	Arena *arena;
+	int result_space;
+	int state;
+	int key; /* is the string being read a key */
+	int depth;
+	char stack[GCM_MAX_DEPTH]; /* '{' or '[' for every open container */
+	int field[GCM_MAX_DEPTH]; /* the field of the last key at every depth */
+	StringBuffer *token; /* the string or literal being read */
+	unsigned int code; /* the \u escape being read */
+	int digits;
+	unsigned int surrogate; /* the first half of a surrogate pair */
+} GcmResponse;
+
+void
+gcm_response_init(GcmResponse *response, Arena *arena);
+
+int
+gcm_response_feed(GcmResponse *response, const char *data, size_t length);
+
+int
+gcm_response_finish(GcmResponse *response);
+
+void
+gcm_response_counts(GcmResponse *response, int *successes, int *fails);
+
+#endif
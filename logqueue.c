@@ -0,0 +1,685 @@
+#include "logqueue.h"
+#include "settings.h"
+#include "stringbuffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/* The longest header: the length of a record and the newline */
+#define LOG_MAX_HEADER 20
+
+/*
+ * Builds the path of a segment file
+ * @param name the StringBuffer to build it in
+ * @param directory the directory
+ * @param segment the number of the segment
+ * @param suffix .log or .results
+ * @return the path
+ */
+static char *
+log_queue_path(StringBuffer *name, char *directory, unsigned long long segment, char *suffix)
+{
+	string_buffer_recycle (name);
+	string_buffer_append_format (name, "%s/%016llx%s", directory, segment, suffix);
+
+	return string_buffer_get_string (name);
+}
+
+/*
+ * Looks for segments in a directory
+ * @param path the directory
+ * @param from the smallest number to look for
+ * @param newest 1 to find the newest segment, 0 for the oldest
+ * @param found will hold the number of the segment
+ * @return 1 if a segment was found, 0 if there is none, -1 on error
+ */
+static int
+log_queue_scan(char *path, unsigned long long from, int newest, unsigned long long *found)
+{
+	DIR *d = opendir(path);
+	struct dirent *entry;
+	int result = 0;
+
+	if (d == NULL) {
+		return -1;
+	}
+
+	while ((entry = readdir(d)) != NULL) {
+		unsigned long long number;
+		char *end;
+
+		if (strlen(entry->d_name) != 20 || strcmp(entry->d_name + 16, ".log") != 0) {
+			continue; /* Not a segment */
+		}
+		number = strtoull(entry->d_name, &end, 16);
+		if (end != entry->d_name + 16 || number < from) {
+			continue;
+		}
+		if (result == 0 || (newest ? number > *found : number < *found)) {
+			*found = number;
+			result = 1;
+		}
+	}
+	closedir(d);
+
+	return result;
+}
+
+/*
+ * Writes where we are to the checkpoint file. The file is replaced at once,
+ * so it always holds a whole checkpoint.
+ * @param queue the pointer to the LogQueue object
+ * @return 0 on success, -1 on error
+ */
+static int
+log_queue_save(LogQueue *queue)
+{
+	char line[64];
+	int length = snprintf(line, sizeof(line), "%016llx %lld\n", queue->segment, (long long)queue->offset);
+	int file;
+
+	string_buffer_recycle (queue->name);
+	string_buffer_append_format (queue->name, "%s/checkpoint.tmp", queue->path);
+	string_buffer_recycle (queue->target);
+	string_buffer_append_format (queue->target, "%s/checkpoint", queue->path);
+
+	file = open(string_buffer_get_string (queue->name), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file == -1) {
+		return -1;
+	}
+	if (write(file, line, length) != length) {
+		close(file);
+		return -1;
+	}
+	close(file);
+
+	return rename(string_buffer_get_string (queue->name), string_buffer_get_string (queue->target));
+}
+
+/*
+ * Finds a record past the checkpoint that was handed out
+ * @param queue the pointer to the LogQueue object
+ * @param position the offset of the record
+ * @return its index, or where it goes if it is not there
+ */
+static size_t
+log_queue_find(LogQueue *queue, unsigned long position)
+{
+	size_t low = 0;
+	size_t high = queue->handed_count;
+
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (queue->handed[middle].position < position) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+/*
+ * Keeps track of a record that was handed out, so it is not handed out again
+ * @param queue the pointer to the LogQueue object
+ * @param position the offset of the record
+ * @param done 1 if its outcome is listed, 0 if it is being sent
+ * @return 1 on success, 0 if out of memory
+ */
+static int
+log_queue_track(LogQueue *queue, unsigned long position, int done)
+{
+	size_t i = log_queue_find (queue, position);
+
+	if (i < queue->handed_count && queue->handed[i].position == position) {
+		queue->handed[i].done = done;
+		return 1;
+	}
+
+	if (queue->handed_count == queue->handed_space) {
+		size_t space = queue->handed_space > 0 ? queue->handed_space * 2 : 64;
+		LogRecord *grown = (LogRecord *)realloc(queue->handed, space * sizeof(LogRecord));
+		if (grown == NULL) {
+			return 0;
+		}
+		queue->handed = grown;
+		queue->handed_space = space;
+	}
+
+	/* Mostly the last one, records are handed out in order */
+	memmove(queue->handed + i + 1, queue->handed + i, (queue->handed_count - i) * sizeof(LogRecord));
+	queue->handed[i].position = position;
+	queue->handed[i].done = done;
+	queue->handed_count++;
+
+	return 1;
+}
+
+/*
+ * Forgets the records that were handed out before an offset
+ * @param queue the pointer to the LogQueue object
+ * @param offset the offset
+ */
+static void
+log_queue_forget(LogQueue *queue, off_t offset)
+{
+	size_t before = log_queue_find (queue, offset);
+
+	memmove(queue->handed, queue->handed + before, (queue->handed_count - before) * sizeof(LogRecord));
+	queue->handed_count -= before;
+}
+
+/*
+ * Finds the records past the checkpoint that are done, in the results
+ * segment: their outcomes were written, but a record before them was left
+ * for later, or we stopped before the checkpoint was saved
+ * @param queue the pointer to the LogQueue object
+ * @return 1 on success, 0 on error
+ */
+static int
+log_queue_recover(LogQueue *queue)
+{
+	FILE *results = fopen(log_queue_path (queue->name, queue->path, queue->segment, ".results"), "r");
+	unsigned long position;
+	unsigned long length;
+	int success;
+	int result = 1;
+
+	if (results == NULL) {
+		return errno == ENOENT;
+	}
+
+	while (fscanf(results, "%lu %d %lu", &position, &success, &length) == 3) {
+		/* Skip the newline, the response and the newline after it */
+		if (fseeko(results, (off_t)length + 2, SEEK_CUR) == -1) {
+			result = 0;
+			break;
+		}
+		if ((off_t)position >= queue->offset && ! log_queue_track (queue, position, 1)) {
+			result = 0;
+			break;
+		}
+	}
+	fclose(results);
+
+	return result;
+}
+
+/*
+ * Opens the log queue, and finds where we left it
+ * @param path the directory of the segments
+ * @param archive the directory where read segments are moved, or NULL to
+ * delete them
+ * @return a pointer to the LogQueue, or NULL on error
+ */
+LogQueue *
+log_queue_open(char *path, char *archive)
+{
+	LogQueue *queue = (LogQueue *)calloc(1, sizeof(LogQueue));
+	struct stat info;
+	FILE *checkpoint;
+
+	if (queue == NULL) {
+		return NULL;
+	}
+
+	queue->path = path;
+	queue->archive = archive;
+	queue->file = -1;
+	queue->deferred = -1;
+	queue->data = string_buffer_create (4096);
+	queue->results = string_buffer_create (1024);
+	queue->name = string_buffer_create (256);
+	queue->target = string_buffer_create (256);
+	if (queue->data == NULL || queue->results == NULL || queue->name == NULL || queue->target == NULL
+	    || stat(path, &info) == -1 || ! S_ISDIR(info.st_mode)) {
+		log_queue_close (queue);
+		return NULL;
+	}
+
+	string_buffer_append_format (queue->name, "%s/checkpoint", path);
+	checkpoint = fopen(string_buffer_get_string (queue->name), "r");
+	if (checkpoint != NULL) {
+		long long offset = 0;
+		if (fscanf(checkpoint, "%llx %lld", &queue->segment, &offset) == 2) {
+			queue->offset = offset;
+		}
+		fclose(checkpoint);
+	} else if (log_queue_scan (path, 0, 0, &queue->segment) != 1) {
+		queue->segment = 0; /* Nothing written yet */
+	}
+	if (! log_queue_recover (queue)) {
+		log_queue_close (queue);
+		return NULL;
+	}
+
+	return queue;
+}
+
+/*
+ * Reads the header of a record
+ * @param data the record
+ * @param available the bytes we have of it
+ * @param header will hold the length of the header
+ * @param length will hold the length of the message
+ * @return 1 on success, 0 if we don't have the whole header, -1 if it is corrupt
+ */
+static int
+log_queue_header(const char *data, size_t available, size_t *header, size_t *length)
+{
+	size_t value = 0;
+	size_t i;
+
+	for (i = 0; i < available && i < LOG_MAX_HEADER; i++) {
+		if (data[i] == '\n' && i > 0) {
+			*header = i + 1;
+			*length = value;
+			return 1;
+		}
+		if (data[i] < '0' || data[i] > '9') {
+			return -1;
+		}
+		value = value * 10 + (data[i] - '0');
+		if (value > LOG_MAX_RECORD) {
+			return -1;
+		}
+	}
+
+	return i < LOG_MAX_HEADER ? 0 : -1;
+}
+
+/*
+ * Reads more of the segment, after the data we have
+ * @param queue the pointer to the LogQueue object
+ * @param want how many bytes to read
+ * @return 1 on success, 0 on error
+ */
+static int
+log_queue_fill(LogQueue *queue, size_t want)
+{
+	ssize_t got;
+
+	if (! string_buffer_reserve (queue->data, want)) {
+		return 0;
+	}
+
+	while (want > 0) {
+		got = pread(queue->file, queue->data->data + queue->data->length, want,
+		            queue->offset + queue->data->length);
+		if (got == -1) {
+			return 0;
+		} else if (got == 0) {
+			break;
+		}
+		queue->data->length += got;
+		want -= got;
+	}
+	queue->data->data[queue->data->length] = '\0';
+
+	return 1;
+}
+
+/*
+ * Reads the records from the offset on: LOG_READ_SIZE bytes of them, or one
+ * record if it is longer. A corrupt record can't be told from the ones after
+ * it, so everything up to the end of the segment is skipped.
+ * @param queue the pointer to the LogQueue object
+ * @param size the size of the segment
+ * @return the number of whole records read, or -1 on error
+ */
+static int
+log_queue_load(LogQueue *queue, off_t size)
+{
+	size_t want = size - queue->offset;
+	size_t at = 0;
+	size_t header;
+	size_t length;
+	int records = 0;
+	int status;
+
+	string_buffer_recycle (queue->data);
+	queue->consumed = 0;
+	if (! log_queue_fill (queue, want < LOG_READ_SIZE ? want : LOG_READ_SIZE)) {
+		return -1;
+	}
+
+	for (;;) {
+		status = log_queue_header (queue->data->data + at, queue->data->length - at, &header, &length);
+		if (status == -1 && records == 0) {
+			/* Corrupt, skip it and what follows */
+			queue->skipped += size - queue->offset;
+			queue->offset = size;
+			string_buffer_recycle (queue->data);
+			return 0;
+		}
+		if (status != 1 || at + header + length > queue->data->length) {
+			if (status == 1 && records == 0 && queue->offset + header + length <= (size_t)size) {
+				/* A record longer than we read, read the rest of it */
+				unsigned int had = queue->data->length;
+				if (! log_queue_fill (queue, header + length - had)) {
+					return -1;
+				}
+				if (queue->data->length > had) {
+					continue;
+				}
+			}
+			break;
+		}
+		at += header + length;
+		records++;
+	}
+
+	return records;
+}
+
+/*
+ * Moves a segment that was read to the archive, or deletes it
+ * @param queue the pointer to the LogQueue object
+ * @return 0 on success, -1 on error
+ */
+static int
+log_queue_retire(LogQueue *queue)
+{
+	char *name = log_queue_path (queue->name, queue->path, queue->segment, ".log");
+
+	if (queue->archive == NULL) {
+		return unlink(name);
+	}
+
+	return rename(name, log_queue_path (queue->target, queue->archive, queue->segment, ".log"));
+}
+
+/*
+ * Reads the next records. Once a sealed segment is read to the end, it is
+ * retired, and the next segment is read.
+ * @param queue the pointer to the LogQueue object
+ * @return the number of records read, 0 when there are none (yet), -1 on error
+ */
+int
+log_queue_read(LogQueue *queue)
+{
+	struct stat info;
+	int records;
+
+	for (;;) {
+		if (queue->file == -1) {
+			queue->file = open(log_queue_path (queue->name, queue->path, queue->segment, ".log"), O_RDONLY);
+			if (queue->file == -1) {
+				int found;
+				if (errno != ENOENT) {
+					return -1;
+				}
+				/* Not there (yet), maybe there are newer ones */
+				found = log_queue_scan (queue->path, queue->segment + 1, 0, &queue->segment);
+				if (found != 1) {
+					return found;
+				}
+				queue->offset = 0;
+				queue->handed_count = 0;
+				continue;
+			}
+		}
+
+		if (fstat(queue->file, &info) == -1) {
+			return -1;
+		}
+		if (info.st_size > queue->offset) {
+			records = log_queue_load (queue, info.st_size);
+			if (records != 0 || info.st_size < LOG_SEGMENT_SIZE) {
+				return records;
+			}
+		} else if (info.st_size < LOG_SEGMENT_SIZE) {
+			return 0; /* More is coming */
+		}
+
+		/* Sealed. Wait for the producers that are still writing to it */
+		if (flock(queue->file, LOCK_EX) == -1 || fstat(queue->file, &info) == -1) {
+			return -1;
+		}
+		(void) flock(queue->file, LOCK_UN);
+		if (info.st_size > queue->offset) {
+			records = log_queue_load (queue, info.st_size);
+			if (records != 0) {
+				return records;
+			}
+			/* A record that will never be whole */
+			queue->skipped += info.st_size - queue->offset;
+		}
+
+		/* All done, go on to the next segment */
+		close(queue->file);
+		queue->file = -1;
+		if (log_queue_retire (queue) == -1 && errno != ENOENT) {
+			return -1;
+		}
+		queue->segment++;
+		queue->offset = 0;
+		queue->handed_count = 0;
+		string_buffer_recycle (queue->data);
+		if (log_queue_save (queue) == -1) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * Hands out the next record that was read. The records that are done, or
+ * still being sent, are passed over.
+ * @param queue the pointer to the LogQueue object
+ * @param length will hold the length of the message
+ * @param position will hold the offset of the record in the segment
+ * @return the message (not null-terminated), or NULL when all were handed out
+ */
+char *
+log_queue_next(LogQueue *queue, size_t *length, unsigned long *position)
+{
+	for (;;) {
+		char *record = queue->data->data + queue->consumed;
+		size_t header;
+		size_t i;
+
+		if (log_queue_header (record, queue->data->length - queue->consumed, &header, length) != 1
+		    || queue->consumed + header + *length > queue->data->length) {
+			return NULL;
+		}
+
+		*position = queue->offset + queue->consumed;
+		i = log_queue_find (queue, *position);
+		if (i == queue->handed_count || queue->handed[i].position != *position) {
+			if (! log_queue_track (queue, *position, 0)) {
+				return NULL; /* Out of memory, it is handed out later */
+			}
+			queue->consumed += header + *length;
+			return record + header;
+		}
+		queue->consumed += header + *length;
+	}
+}
+
+/*
+ * Lists the outcome of a record, to be written with log_queue_commit
+ * @param queue the pointer to the LogQueue object
+ * @param position the offset of the record
+ * @param success 1 if the message was sent, 0 if it failed
+ * @param response the server response
+ * @param length the length of the response
+ */
+void
+log_queue_result(LogQueue *queue, unsigned long position, int success, char *response, size_t length)
+{
+	string_buffer_append_format (queue->results, "%lu %d %lu\n", position, success, (unsigned long)length);
+	string_buffer_append_n (queue->results, response, length);
+	string_buffer_append_char (queue->results, '\n');
+	(void) log_queue_track (queue, position, 1);
+}
+
+/*
+ * Leaves a record that was handed out for later: it is read again after the
+ * next commit, the records after it that are done are not
+ * @param queue the pointer to the LogQueue object
+ * @param position the offset of the record
+ */
+void
+log_queue_defer(LogQueue *queue, unsigned long position)
+{
+	size_t i = log_queue_find (queue, position);
+
+	if (i < queue->handed_count && queue->handed[i].position == position) {
+		memmove(queue->handed + i, queue->handed + i + 1, (queue->handed_count - i - 1) * sizeof(LogRecord));
+		queue->handed_count--;
+	}
+	if (queue->deferred == -1 || (off_t)position < queue->deferred) {
+		queue->deferred = position;
+	}
+}
+
+/*
+ * Writes the outcomes to the results segment, all at once, and moves the
+ * checkpoint past the records that were handed out, up to the first one that
+ * was left for later, or is still being sent
+ * @param queue the pointer to the LogQueue object
+ * @return 0 on success, -1 on error (outcomes that were not written are kept
+ * for the next time)
+ */
+int
+log_queue_commit(LogQueue *queue)
+{
+	off_t offset = queue->offset + (off_t)queue->consumed;
+	int result = 0;
+	size_t i;
+
+	if (queue->results->length > 0) {
+		int file = open(log_queue_path (queue->name, queue->path, queue->segment, ".results"),
+		                O_WRONLY | O_APPEND | O_CREAT, 0644);
+		ssize_t written = -1;
+
+		if (file != -1) {
+			written = write(file, string_buffer_get_string (queue->results), queue->results->length);
+			close(file);
+		}
+		if (written == (ssize_t)queue->results->length) {
+			string_buffer_recycle (queue->results);
+		} else {
+			result = -1;
+		}
+	}
+
+	/* The messages were sent, don't send them again */
+	if (queue->deferred != -1 && queue->deferred < offset) {
+		offset = queue->deferred;
+	}
+	for (i = 0; i < queue->handed_count && (off_t)queue->handed[i].position < offset; i++) {
+		if (! queue->handed[i].done) {
+			offset = queue->handed[i].position;
+			break;
+		}
+	}
+	queue->offset = offset;
+	log_queue_forget (queue, offset);
+	queue->deferred = -1;
+	queue->consumed = 0;
+	string_buffer_recycle (queue->data);
+	if (log_queue_save (queue) == -1) {
+		result = -1;
+	}
+
+	return result;
+}
+
+/*
+ * Writes the outcomes, and frees the LogQueue
+ * @param queue the pointer to the LogQueue object
+ */
+void
+log_queue_close(LogQueue *queue)
+{
+	if (queue->results != NULL && queue->data != NULL && queue->name != NULL && queue->target != NULL) {
+		(void) log_queue_commit (queue);
+	}
+	if (queue->file != -1) {
+		close(queue->file);
+	}
+	if (queue->data != NULL) {
+		string_buffer_free (queue->data);
+	}
+	if (queue->results != NULL) {
+		string_buffer_free (queue->results);
+	}
+	if (queue->name != NULL) {
+		string_buffer_free (queue->name);
+	}
+	if (queue->target != NULL) {
+		string_buffer_free (queue->target);
+	}
+	free(queue->handed);
+	free(queue);
+}
+
+/*
+ * Appends a message to the log queue, for producers written in C. Producers
+ * in other languages take the same steps: open the newest segment for
+ * appending, take a shared lock on it, and if it is not sealed, append the
+ * record with one write. If it is sealed, go on to the next segment.
+ * @param path the directory of the segments
+ * @param message the message, in the format of a queue file
+ * @param length the length of the message
+ * @return 0 on success, -1 on error
+ */
+int
+log_queue_append(char *path, char *message, size_t length)
+{
+	StringBuffer *name;
+	StringBuffer *record;
+	unsigned long long segment = 0;
+	int result = -1;
+	int file = -1;
+	struct stat info;
+
+	if (length > LOG_MAX_RECORD || log_queue_scan (path, 0, 1, &segment) == -1) {
+		return -1;
+	}
+
+	name = string_buffer_create (256);
+	record = string_buffer_create (length + LOG_MAX_HEADER);
+	if (name != NULL && record != NULL) {
+		string_buffer_append_format (record, "%lu\n", (unsigned long)length);
+		string_buffer_append_n (record, message, length);
+
+		while ((file = open(log_queue_path (name, path, segment, ".log"), O_WRONLY | O_APPEND | O_CREAT, 0644)) != -1) {
+			if (flock(file, LOCK_SH) == -1 || fstat(file, &info) == -1) {
+				close(file);
+				file = -1;
+				break;
+			}
+			if (info.st_size < LOG_SEGMENT_SIZE) {
+				break;
+			}
+			/* Sealed, the record starts the next one */
+			close(file);
+			segment++;
+		}
+	}
+
+	if (file != -1) {
+		if (write(file, string_buffer_get_string (record), record->length) == (ssize_t)record->length) {
+			result = 0;
+		}
+		close(file); /* and the lock with it */
+	}
+	if (name != NULL) {
+		string_buffer_free (name);
+	}
+	if (record != NULL) {
+		string_buffer_free (record);
+	}
+
+	return result;
+}
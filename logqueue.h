@@ -0,0 +1,79 @@
+/*
+ * The LogQueue is a queue of messages in segment files: producers append
+ * messages to the newest segment, and pushr reads them in order. A segment is
+ * named after its number (%016llx.log). Every record is the length of the
+ * message in decimal on a line of its own, then the message, in the format of
+ * a queue file.
+ * Producers append a record with a single write, holding a shared lock
+ * (flock) on the segment. A segment that has reached LOG_SEGMENT_SIZE is
+ * sealed: no one appends to it anymore, and the next record starts the next
+ * segment. See log_queue_append.
+ * pushr keeps its place in a checkpoint file, and appends the outcome of every
+ * record to a results segment next to it (%016llx.results): a line with
+ * "<offset> <sent> <length>", then the response and a newline. A sealed
+ * segment that was read to the end is deleted, or archived. Records can be
+ * left for later (log_queue_defer), the checkpoint stops at the first of them.
+ * The records after it that are done are not sent again: pushr keeps track of
+ * them, and after a restart finds them in the results segment.
+ */
+
+#ifndef _LOGQUEUE_H_
+#define _LOGQUEUE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "stringbuffer.h"
+
+/* The longest record we accept, anything longer is corrupt */
+#define LOG_MAX_RECORD (64 * 1024 * 1024)
+
+/* A record past the checkpoint that was handed out */
+typedef struct {
+	unsigned long position; /* its offset in the segment */
+	int done; /* 1 once its outcome is listed, 0 while it is being sent */
+} LogRecord;
+
+typedef struct {
+	char *path; /* the directory */
+	char *archive; /* where read segments are moved, or NULL to delete them */
+	unsigned long long segment; /* the segment being read */
+	int file; /* its descriptor, or -1 */
+	off_t offset; /* of the first record not done yet */
+	StringBuffer *data; /* the records read from offset */
+	size_t consumed; /* bytes of data handed out */
+	off_t deferred; /* the first record handed out that is left for later, or -1 */
+	LogRecord *handed; /* the records past offset that are not handed out again, by position */
+	size_t handed_count;
+	size_t handed_space;
+	StringBuffer *results; /* outcomes not yet written */
+	unsigned long skipped; /* bytes of corrupt records that were skipped */
+	StringBuffer *name; /* to build file names in */
+	StringBuffer *target;
+} LogQueue;
+
+LogQueue *
+log_queue_open(char *path, char *archive);
+
+int
+log_queue_read(LogQueue *queue);
+
+char *
+log_queue_next(LogQueue *queue, size_t *length, unsigned long *position);
+
+void
+log_queue_result(LogQueue *queue, unsigned long position, int success, char *response, size_t length);
+
+void
+log_queue_defer(LogQueue *queue, unsigned long position);
+
+int
+log_queue_commit(LogQueue *queue);
+
+void
+log_queue_close(LogQueue *queue);
+
+int
+log_queue_append(char *path, char *message, size_t length);
+
+#endif
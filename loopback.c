@@ -0,0 +1,325 @@
+#define _GNU_SOURCE /* for memmem */
+
+#include "loopback.h"
+#include "sender.h"
+#include "stringbuffer.h"
+#include "gcmresponse.h"
+#include "ratelimit.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <curl/curl.h>
+
+/*
+ * Returns a random number in [0, 1)
+ * @param seed the random state
+ * @return the number
+ */
+static double
+loopback_random(unsigned int *seed)
+{
+	return (double)rand_r(seed) / ((double)RAND_MAX + 1);
+}
+
+/*
+ * Reads a loopback profile (see loopback.h)
+ * @param profile the profile to fill in
+ * @param settings the comma separated settings. They are split in place, and
+ * the rules point in them, so they must outlive the profile.
+ * @param seed gets the seed of the random draws
+ * @return 0 on success, -1 if a setting is not known
+ */
+int
+loopback_parse(LoopbackProfile *profile, char *settings, unsigned int *seed)
+{
+	char *position = NULL;
+	char *setting;
+
+	memset(profile, 0, sizeof(LoopbackProfile));
+	profile->retry_after = 1;
+	*seed = 1;
+
+	for (setting = strtok_r(settings, ",", &position); setting != NULL; setting = strtok_r(NULL, ",", &position)) {
+		char *value = strchr(setting, '=');
+
+		if (value == NULL) {
+			return -1;
+		}
+		*value++ = '\0';
+
+		if (strcmp(setting, "latency") == 0) {
+			profile->latency = atoi(value);
+		} else if (strcmp(setting, "jitter") == 0) {
+			profile->jitter = atoi(value);
+		} else if (strcmp(setting, "slow") == 0) {
+			char *latency = strchr(value, ':');
+			profile->slow = atof(value);
+			profile->slow_latency = latency != NULL ? atoi(latency + 1) : 0;
+		} else if (strcmp(setting, "fail") == 0) {
+			profile->fail = atof(value);
+		} else if (strcmp(setting, "down") == 0) {
+			profile->down = atof(value);
+		} else if (strcmp(setting, "retry_after") == 0) {
+			profile->retry_after = atoi(value);
+		} else if (strcmp(setting, "unavailable") == 0) {
+			profile->unavailable = atof(value);
+		} else if (strcmp(setting, "not_registered") == 0) {
+			profile->not_registered = atof(value);
+		} else if (strcmp(setting, "canonical") == 0) {
+			profile->canonical = atof(value);
+		} else if (strcmp(setting, "seed") == 0) {
+			*seed = (unsigned int)strtoul(value, NULL, 10);
+		} else if (strncmp(setting, "token.", 6) == 0 && setting[6] != '\0'
+		           && profile->rule_count < LOOPBACK_MAX_RULES) {
+			LoopbackRule *rule = &profile->rules[profile->rule_count++];
+			rule->text = setting + 6;
+			rule->error = strcmp(value, "canonical") == 0 ? NULL : value;
+		} else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the result of one registration id, as the push service would
+ * @param loopback the pointer to the Loopback object
+ * @param results the StringBuffer to write it in
+ * @param token the registration id
+ * @param length the length of the id
+ * @param counts the successes, failures and canonical ids so far, updated
+ */
+static void
+loopback_result(Loopback *loopback, StringBuffer *results, char *token, size_t length, int counts[3])
+{
+	LoopbackProfile *profile = &loopback->profile;
+	double draw = loopback_random (&loopback->seed);
+	char *error = NULL;
+	int canonical = 0;
+	int i;
+
+	for (i = 0; i < profile->rule_count; i++) {
+		if (memmem(token, length, profile->rules[i].text, strlen(profile->rules[i].text)) != NULL) {
+			error = profile->rules[i].error;
+			canonical = (error == NULL);
+			break;
+		}
+	}
+	if (i == profile->rule_count) {
+		if (draw < profile->unavailable) {
+			error = "Unavailable";
+		} else if (draw < profile->unavailable + profile->not_registered) {
+			error = "NotRegistered";
+		} else {
+			canonical = (draw < profile->unavailable + profile->not_registered + profile->canonical);
+		}
+	}
+
+	if (error != NULL) {
+		string_buffer_append_format (results, "{\"error\":\"%s\"}", error);
+		counts[1]++;
+	} else if (canonical) {
+		string_buffer_append_format (results, "{\"message_id\":\"0:%lu\",\"registration_id\":\"canonical-",
+		                             loopback->requests);
+		string_buffer_append_n (results, token, length);
+		string_buffer_append (results, "\"}");
+		counts[0]++;
+		counts[2]++;
+	} else {
+		string_buffer_append_format (results, "{\"message_id\":\"0:%lu\"}", loopback->requests);
+		counts[0]++;
+	}
+}
+
+/*
+ * Answers a request, as the push service would: with a network error, a 503,
+ * or a result for every registration id in its body
+ * @param loopback the pointer to the Loopback object
+ * @param transfer the transfer
+ * @param now the time, see rate_limiter_clock
+ */
+static void
+loopback_answer(Loopback *loopback, struct SenderTransfer *transfer, double now)
+{
+	LoopbackProfile *profile = &loopback->profile;
+	StringBuffer *results; /* in the transfer's arena, it is reset once the transfer is done */
+	char *ids = strstr(transfer->message->data, "\"registration_ids\"");
+	char *end = ids != NULL ? strchr(ids, ']') : NULL;
+	int counts[3] = { 0, 0, 0 }; /* successes, failures and canonical ids */
+	long long took = (long long)((now - transfer->started) * 1000);
+
+	loopback->requests++;
+	transfer->result = CURLE_OK;
+	transfer->parsed.first_byte = (long)took;
+	metrics_time (STAGE_ROUND_TRIP, took);
+
+	if (loopback_random (&loopback->seed) < profile->fail) {
+		transfer->result = CURLE_COULDNT_CONNECT;
+		return;
+	}
+	if (loopback_random (&loopback->seed) < profile->down) {
+		transfer->parsed.status = 503;
+		transfer->parsed.retry_after = profile->retry_after;
+		return;
+	}
+
+	/* The results are written first, the counters need them */
+	results = string_buffer_create_in (transfer->arena, 100);
+	if (results == NULL) {
+		transfer->result = CURLE_OUT_OF_MEMORY;
+		return;
+	}
+	if (ids == NULL || end == NULL) {
+		loopback_result (loopback, results, "", 0, counts); /* A notification key */
+	} else {
+		char *start = strchr(ids + 18, '"');
+		char *stop;
+
+		while (start != NULL && start < end && (stop = strchr(start + 1, '"')) != NULL) {
+			if (counts[0] + counts[1] > 0) {
+				string_buffer_append_char (results, ',');
+			}
+			loopback_result (loopback, results, start + 1, stop - start - 1, counts);
+			start = strchr(stop + 1, '"');
+		}
+	}
+
+	transfer->parsed.status = 200;
+	string_buffer_append_format (transfer->response, "{\"multicast_id\":%lu,\"success\":%d,\"failure\":%d,"
+	                             "\"canonical_ids\":%d,\"results\":[%s]}", loopback->requests, counts[0], counts[1],
+	                             counts[2], string_buffer_get_string (results));
+	(void) gcm_response_feed (&transfer->parsed, transfer->response->data, transfer->response->length);
+}
+
+/*
+ * Sets up the loopback, with the profile in the url
+ * @param sender the pointer to the Sender object
+ * @return 0 on success, -1 if out of memory or the profile is not valid
+ */
+static int
+loopback_start(Sender *sender)
+{
+	Loopback *loopback = (Loopback *)calloc(1, sizeof(Loopback));
+
+	if (loopback == NULL) {
+		return -1;
+	}
+	loopback->settings = strdup(sender->url + strlen(LOOPBACK_SCHEME));
+	if (loopback->settings == NULL || loopback_parse (&loopback->profile, loopback->settings, &loopback->seed) == -1) {
+		free(loopback->settings);
+		free(loopback);
+		return -1;
+	}
+	sender->transport_data = loopback;
+
+	return 0;
+}
+
+/*
+ * Queues a request, to be answered after its latency
+ * @param sender the pointer to the Sender object
+ * @param transfer the transfer to send, with its message filled in
+ * @return 0
+ */
+static int
+loopback_submit(Sender *sender, struct SenderTransfer *transfer)
+{
+	Loopback *loopback = (Loopback *)sender->transport_data;
+	LoopbackProfile *profile = &loopback->profile;
+	struct SenderTransfer **position = &loopback->pending;
+	int latency = profile->latency;
+
+	if (profile->jitter > 0) {
+		latency += rand_r(&loopback->seed) % (profile->jitter + 1);
+	}
+	if (profile->slow > 0 && loopback_random (&loopback->seed) < profile->slow) {
+		latency += profile->slow_latency;
+	}
+	transfer->due = transfer->started + latency;
+
+	/* In the order they are due, the ones due at the same time in the order they came */
+	while (*position != NULL && (*position)->due <= transfer->due) {
+		position = &(*position)->next;
+	}
+	transfer->next = *position;
+	*position = transfer;
+
+	return 0;
+}
+
+/*
+ * Answers the requests that are due
+ * @param sender the pointer to the Sender object
+ * @return a list of transfers (linked by next, in the order they were due), or NULL
+ */
+static struct SenderTransfer *
+loopback_done(Sender *sender)
+{
+	Loopback *loopback = (Loopback *)sender->transport_data;
+	struct SenderTransfer *done = loopback->pending;
+	struct SenderTransfer *last = NULL;
+	struct SenderTransfer *transfer;
+	double now = rate_limiter_clock ();
+
+	for (transfer = loopback->pending; transfer != NULL && transfer->due <= now; transfer = transfer->next) {
+		loopback_answer (loopback, transfer, now);
+		last = transfer;
+	}
+	if (last == NULL) {
+		return NULL;
+	}
+	loopback->pending = last->next;
+	last->next = NULL;
+
+	return done;
+}
+
+/*
+ * Waits until the next request is due, or fd becomes readable
+ * @param sender the pointer to the Sender object
+ * @param fd an extra file descriptor to wait for, or -1 for none
+ * @param timeout the longest time to wait, in milliseconds
+ * @return 1 if fd is readable, 0 otherwise
+ */
+static int
+loopback_wait(Sender *sender, int fd, int timeout)
+{
+	Loopback *loopback = (Loopback *)sender->transport_data;
+	struct pollfd extra;
+
+	if (loopback->pending != NULL) {
+		double left = loopback->pending->due - rate_limiter_clock ();
+		if (left < timeout) {
+			timeout = left > 0 ? (int)left + 1 : 0;
+		}
+	}
+
+	extra.fd = fd;
+	extra.events = POLLIN;
+	extra.revents = 0;
+	if (poll(&extra, fd != -1 ? 1 : 0, timeout) <= 0) {
+		return 0;
+	}
+
+	return (extra.revents & POLLIN) != 0;
+}
+
+/*
+ * Frees the loopback, the requests that were not answered are dropped
+ * @param sender the pointer to the Sender object
+ */
+static void
+loopback_stop(Sender *sender)
+{
+	Loopback *loopback = (Loopback *)sender->transport_data;
+
+	free(loopback->settings);
+	free(loopback);
+}
+
+const SenderTransport loopback_transport = {
+	"loopback", loopback_start, loopback_submit, loopback_done, loopback_wait, loopback_stop
+};
@@ -0,0 +1,67 @@
+/*
+ * The Loopback is the transport of the Sender that never leaves the process:
+ * it answers every request in memory, the way the push service would, after a
+ * simulated latency. It takes its profile from the url, e.g.
+ * loopback:latency=20,jitter=10,unavailable=0.01,token.dead=NotRegistered
+ * with comma separated settings:
+ *   latency=ms        how long every request takes (0)
+ *   jitter=ms         up to this much longer, at random (0)
+ *   slow=share:ms     this share of the requests take ms longer (none)
+ *   fail=share        the share of the requests that fail as a network error
+ *   down=share        the share of the requests answered 503
+ *   retry_after=s     the Retry-After of a 503, 0 for none (1)
+ *   unavailable=share the share of the ids that fail with Unavailable
+ *   not_registered=share, canonical=share: and with NotRegistered, or get a
+ *                     canonical id
+ *   token.text=Error  every id that contains text gets this error (e.g.
+ *                     NotRegistered, InvalidRegistration), or a canonical id
+ *                     for canonical
+ *   seed=n            the seed of the random draws (1), the same seed and the
+ *                     same messages give the same answers
+ * With no network, no sockets and no latency, the whole pipeline can be
+ * load tested, and profiled, at millions of messages.
+ */
+
+#ifndef _LOOPBACK_H_
+#define _LOOPBACK_H_
+
+#include "sender.h"
+
+#define LOOPBACK_SCHEME "loopback:"
+#define LOOPBACK_MAX_RULES 16
+
+/* The answer to the ids that contain a text */
+typedef struct {
+	char *text;
+	char *error; /* or NULL for a canonical id */
+} LoopbackRule;
+
+typedef struct {
+	int latency; /* milliseconds */
+	int jitter;
+	double slow; /* the share of the slow requests */
+	int slow_latency; /* and how much longer they take */
+	double fail;
+	double down;
+	int retry_after; /* seconds */
+	double unavailable;
+	double not_registered;
+	double canonical;
+	LoopbackRule rules[LOOPBACK_MAX_RULES];
+	int rule_count;
+} LoopbackProfile;
+
+typedef struct {
+	LoopbackProfile profile;
+	char *settings; /* our copy of the profile, the rules point in it */
+	unsigned int seed;
+	struct SenderTransfer *pending; /* the requests not answered yet, by when they are due */
+	unsigned long requests; /* for the statistics */
+} Loopback;
+
+int
+loopback_parse(LoopbackProfile *profile, char *settings, unsigned int *seed);
+
+extern const SenderTransport loopback_transport;
+
+#endif
@@ -0,0 +1,551 @@
+#include "metrics.h"
+#include "stringbuffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* What one thread counted */
+typedef struct {
+	int shared; /* set for the shard of the threads without their own, it takes atomic additions */
+	unsigned long counters[METRIC_COUNTERS];
+	unsigned long sums[METRIC_STAGES]; /* of the latencies, in microseconds */
+	unsigned long buckets[METRIC_STAGES][METRICS_BUCKETS];
+} MetricsShard;
+
+static const struct {
+	char *name;
+	char *help;
+} counter_names[METRIC_COUNTERS] = {
+	{ "pushr_messages_picked_up_total", "Messages taken off a queue." },
+	{ "pushr_messages_sent_total", "Messages done, and sent." },
+	{ "pushr_messages_errored_total", "Messages done, and failed." },
+	{ "pushr_messages_retried_total", "Messages sent again." },
+	{ "pushr_tokens_succeeded_total", "Registration ids the push service accepted a message for." },
+	{ "pushr_tokens_failed_total", "Registration ids the push service did not accept a message for." }
+};
+
+static char *stage_names[METRIC_STAGES] = { "pickup", "build", "round_trip", "write_back" };
+static char *gauge_names[METRIC_GAUGES] = { "files", "mysql" };
+
+/* The quantiles of every stage, besides the histogram */
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static MetricsShard *shards[METRICS_MAX_SHARDS];
+static int shard_count = 0;
+static MetricsShard shared_shard = { .shared = 1 };
+static __thread MetricsShard *local_shard = NULL;
+
+static long gauges[METRIC_GAUGES];
+static int gauges_set[METRIC_GAUGES]; /* a gauge is only exported once it was set */
+
+/*
+ * Returns the time on the monotonic clock
+ * @return the time in microseconds
+ */
+long long
+metrics_clock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Returns the shard of the calling thread, created the first time. Once
+ * METRICS_MAX_SHARDS threads have theirs, the next ones share one.
+ * @return the pointer to the shard
+ */
+static MetricsShard *
+metrics_shard()
+{
+	MetricsShard *shard;
+	int index;
+
+	if (local_shard != NULL) {
+		return local_shard;
+	}
+
+	shard = (MetricsShard *)calloc(1, sizeof(MetricsShard));
+	index = shard != NULL ? __atomic_fetch_add(&shard_count, 1, __ATOMIC_RELAXED) : METRICS_MAX_SHARDS;
+	if (index < METRICS_MAX_SHARDS) {
+		/* Lives as long as the process, the readers may be looking at it */
+		__atomic_store_n(&shards[index], shard, __ATOMIC_RELEASE);
+		local_shard = shard;
+	} else {
+		free(shard);
+		local_shard = &shared_shard;
+	}
+
+	return local_shard;
+}
+
+/*
+ * Adds to a value of a shard. Only its own thread writes to a shard, so a
+ * plain load and store do, unless the shard is shared.
+ * @param shard the shard
+ * @param value the value
+ * @param count what to add
+ */
+static void
+metrics_add(MetricsShard *shard, unsigned long *value, unsigned long count)
+{
+	if (shard->shared) {
+		__atomic_fetch_add(value, count, __ATOMIC_RELAXED);
+	} else {
+		__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + count, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Finds the histogram bucket of a latency: one for every microsecond up to
+ * 2 * METRICS_SUB_BUCKETS, then METRICS_SUB_BUCKETS for every power of two
+ * @param micros the latency, in microseconds
+ * @return the index of the bucket
+ */
+static int
+metrics_bucket(unsigned long long micros)
+{
+	int shift;
+
+	if (micros < 2 * METRICS_SUB_BUCKETS) {
+		return (int)micros;
+	}
+	if (micros >> METRICS_MAX_BITS) {
+		micros = (1ULL << METRICS_MAX_BITS) - 1;
+	}
+
+	shift = 63 - __builtin_clzll(micros) - METRICS_SUB_BITS;
+	return (shift + 1) * METRICS_SUB_BUCKETS + (int)(micros >> shift) - METRICS_SUB_BUCKETS;
+}
+
+/*
+ * Returns the highest latency of a histogram bucket
+ * @param bucket the index of the bucket
+ * @return the latency, in microseconds
+ */
+static unsigned long long
+metrics_bucket_top(int bucket)
+{
+	int shift;
+
+	if (bucket < 2 * METRICS_SUB_BUCKETS) {
+		return bucket;
+	}
+
+	shift = bucket / METRICS_SUB_BUCKETS - 1;
+	return ((unsigned long long)(bucket % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+/*
+ * Counts, in the calling thread's shard
+ * @param counter the counter, one of the METRIC_* counters
+ * @param count what to add
+ */
+void
+metrics_count(int counter, unsigned long count)
+{
+	MetricsShard *shard = metrics_shard ();
+
+	metrics_add (shard, &shard->counters[counter], count);
+}
+
+/*
+ * Records the latency of a stage, in the calling thread's shard
+ * @param stage the stage, one of the STAGE_* stages
+ * @param micros the latency, in microseconds
+ */
+void
+metrics_time(int stage, long long micros)
+{
+	MetricsShard *shard = metrics_shard ();
+
+	if (micros < 0) {
+		micros = 0;
+	}
+	metrics_add (shard, &shard->buckets[stage][metrics_bucket (micros)], 1);
+	metrics_add (shard, &shard->sums[stage], (unsigned long)micros);
+}
+
+/*
+ * Sets a gauge
+ * @param gauge the gauge, one of the GAUGE_* gauges
+ * @param value the value
+ */
+void
+metrics_gauge(int gauge, long value)
+{
+	__atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+	__atomic_store_n(&gauges_set[gauge], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Adds to a gauge
+ * @param gauge the gauge, one of the GAUGE_* gauges
+ * @param delta what to add, or subtract
+ */
+void
+metrics_gauge_add(int gauge, long delta)
+{
+	__atomic_fetch_add(&gauges[gauge], delta, __ATOMIC_RELAXED);
+}
+
+/*
+ * Adds up the shards of all the threads
+ * @param total where to add them up
+ */
+static void
+metrics_collect(MetricsShard *total)
+{
+	int count = __atomic_load_n(&shard_count, __ATOMIC_RELAXED);
+	int i;
+
+	memset(total, 0, sizeof(MetricsShard));
+	for (i = 0; i <= count && i <= METRICS_MAX_SHARDS; i++) {
+		MetricsShard *shard = i < count && i < METRICS_MAX_SHARDS ? __atomic_load_n(&shards[i], __ATOMIC_ACQUIRE)
+		                      : &shared_shard;
+		int stage;
+		int j;
+
+		if (shard == NULL) {
+			continue; /* Not published yet */
+		}
+		for (j = 0; j < METRIC_COUNTERS; j++) {
+			total->counters[j] += __atomic_load_n(&shard->counters[j], __ATOMIC_RELAXED);
+		}
+		for (stage = 0; stage < METRIC_STAGES; stage++) {
+			total->sums[stage] += __atomic_load_n(&shard->sums[stage], __ATOMIC_RELAXED);
+			for (j = 0; j < METRICS_BUCKETS; j++) {
+				total->buckets[stage][j] += __atomic_load_n(&shard->buckets[stage][j], __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+/*
+ * Returns a counter, added up over all the threads
+ * @param counter the counter, one of the METRIC_* counters
+ * @return its value
+ */
+unsigned long
+metrics_counter(int counter)
+{
+	int count = __atomic_load_n(&shard_count, __ATOMIC_RELAXED);
+	unsigned long total = __atomic_load_n(&shared_shard.counters[counter], __ATOMIC_RELAXED);
+	int i;
+
+	for (i = 0; i < count && i < METRICS_MAX_SHARDS; i++) {
+		MetricsShard *shard = __atomic_load_n(&shards[i], __ATOMIC_ACQUIRE);
+		if (shard != NULL) {
+			total += __atomic_load_n(&shard->counters[counter], __ATOMIC_RELAXED);
+		}
+	}
+
+	return total;
+}
+
+/*
+ * Writes the metrics in the Prometheus text format. The histograms have a
+ * bucket for every power of two microseconds, the quantiles are exported as
+ * gauges, from the full resolution of the histograms.
+ * @param buffer the StringBuffer to write them in
+ */
+void
+metrics_render(StringBuffer *buffer)
+{
+	MetricsShard *total = (MetricsShard *)malloc(sizeof(MetricsShard));
+	unsigned long counts[METRIC_STAGES];
+	int stage;
+	int i;
+
+	if (total == NULL) {
+		return;
+	}
+	metrics_collect (total);
+
+	for (i = 0; i < METRIC_COUNTERS; i++) {
+		string_buffer_append_format (buffer, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", counter_names[i].name,
+		                             counter_names[i].help, counter_names[i].name, counter_names[i].name,
+		                             total->counters[i]);
+	}
+
+	string_buffer_append (buffer, "# HELP pushr_queue_depth Messages waiting in a queue.\n"
+	                      "# TYPE pushr_queue_depth gauge\n");
+	for (i = 0; i < METRIC_GAUGES; i++) {
+		long value = __atomic_load_n(&gauges[i], __ATOMIC_RELAXED);
+
+		if (__atomic_load_n(&gauges_set[i], __ATOMIC_RELAXED)) {
+			string_buffer_append_format (buffer, "pushr_queue_depth{queue=\"%s\"} %ld\n", gauge_names[i],
+			                             value > 0 ? value : 0);
+		}
+	}
+
+	string_buffer_append (buffer, "# HELP pushr_stage_seconds How long the stages of a message take.\n"
+	                      "# TYPE pushr_stage_seconds histogram\n");
+	for (stage = 0; stage < METRIC_STAGES; stage++) {
+		int bits = METRICS_SUB_BITS;
+
+		counts[stage] = 0;
+		for (i = 0; i < METRICS_BUCKETS; i++) {
+			if (bits < METRICS_MAX_BITS && i == metrics_bucket (1ULL << bits)) {
+				/* All the latencies below 2^bits microseconds: up to the top of the
+				 * bucket before, as le is inclusive */
+				string_buffer_append_format (buffer, "pushr_stage_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %lu\n",
+				                             stage_names[stage], (double)metrics_bucket_top (i - 1) / 1000000, 
+				                             counts[stage]);
+				bits++;
+			}
+			counts[stage] += total->buckets[stage][i];
+		}
+		string_buffer_append_format (buffer, "pushr_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n"
+		                             "pushr_stage_seconds_sum{stage=\"%s\"} %g\n"
+		                             "pushr_stage_seconds_count{stage=\"%s\"} %lu\n", stage_names[stage], counts[stage],
+		                             stage_names[stage], (double)total->sums[stage] / 1000000, stage_names[stage],
+		                             counts[stage]);
+	}
+
+	string_buffer_append (buffer, "# HELP pushr_stage_quantile_seconds The quantiles of how long the stages take.\n"
+	                      "# TYPE pushr_stage_quantile_seconds gauge\n");
+	for (stage = 0; stage < METRIC_STAGES; stage++) {
+		unsigned long seen = 0;
+		unsigned int quantile = 0;
+
+		for (i = 0; counts[stage] > 0 && i < METRICS_BUCKETS && quantile < sizeof(quantiles) / sizeof(quantiles[0]);
+		     i++) {
+			seen += total->buckets[stage][i];
+			while (quantile < sizeof(quantiles) / sizeof(quantiles[0]) && seen >= quantiles[quantile] * counts[stage]) {
+				string_buffer_append_format (buffer, "pushr_stage_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %g\n",
+				                             stage_names[stage], quantiles[quantile],
+				                             (double)metrics_bucket_top (i) / 1000000);
+				quantile++;
+			}
+		}
+	}
+
+	free(total);
+}
+
+/*
+ * Writes the metrics to a file, through a temporary file, so a reader never
+ * sees half of them
+ * @param path the path of the file
+ * @param buffer a StringBuffer to write them in
+ */
+static void
+metrics_write_file(char *path, StringBuffer *buffer)
+{
+	char temporary[4096];
+	ssize_t written = -1;
+	int file;
+
+	snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+	string_buffer_recycle (buffer);
+	metrics_render (buffer);
+
+	file = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (file == -1) {
+		return;
+	}
+	written = write(file, buffer->data, buffer->length);
+	close(file);
+	if (written == (ssize_t)buffer->length) {
+		(void) rename(temporary, path);
+	} else {
+		(void) unlink(temporary);
+	}
+}
+
+/*
+ * Sends all of a response to a client
+ * @param client the socket
+ * @param data the data
+ * @param length its length
+ * @return 0 on success, -1 on error
+ */
+static int
+metrics_send(int client, char *data, size_t length)
+{
+	while (length > 0) {
+		ssize_t sent = send(client, data, length, MSG_NOSIGNAL);
+		if (sent <= 0) {
+			return -1;
+		}
+		data += sent;
+		length -= sent;
+	}
+
+	return 0;
+}
+
+/*
+ * Answers a client of the metrics endpoint: GET /metrics (or /) gets the
+ * metrics, anything else a 404. One request per connection.
+ * @param listener the listening socket
+ * @param buffer a StringBuffer to write the metrics in
+ */
+static void
+metrics_serve(int listener, StringBuffer *buffer)
+{
+	struct timeval timeout = { 1, 0 }; /* a client that says nothing doesn't hold us up */
+	char request[1024];
+	size_t length = 0;
+	ssize_t got;
+	char header[200];
+	int client = accept(listener, NULL, NULL);
+
+	if (client == -1) {
+		return;
+	}
+	(void) setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	(void) setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	/* The request line and the headers, we only look at the first */
+	while (length < sizeof(request) - 1 && (got = recv(client, request + length, sizeof(request) - 1 - length, 0)) > 0) {
+		length += got;
+		request[length] = '\0';
+		if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+			break;
+		}
+	}
+	request[length] = '\0';
+
+	string_buffer_recycle (buffer);
+	if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+		metrics_render (buffer);
+		snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		         "Content-Length: %u\r\nConnection: close\r\n\r\n", buffer->length);
+	} else {
+		string_buffer_append (buffer, "Not found\n");
+		snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n"
+		         "Content-Length: %u\r\nConnection: close\r\n\r\n", buffer->length);
+	}
+	if (metrics_send (client, header, strlen(header)) == 0) {
+		(void) metrics_send (client, buffer->data, buffer->length);
+	}
+	close(client);
+}
+
+/*
+ * The exporter thread: serves the metrics, or writes them every interval,
+ * until it is stopped. The file is written one last time then.
+ * @param data the pointer to the MetricsExporter
+ */
+static void *
+metrics_exporter_run(void *data)
+{
+	MetricsExporter *exporter = (MetricsExporter *)data;
+	StringBuffer *buffer = string_buffer_create (16384);
+	struct pollfd fds[2];
+
+	if (buffer == NULL) {
+		return NULL;
+	}
+
+	for (;;) {
+		fds[0].fd = exporter->wake;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = exporter->listener; /* ignored when it is -1 */
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		if (poll(fds, 2, exporter->listener == -1 ? exporter->interval : -1) == -1) {
+			continue; /* Interrupted */
+		}
+		if (fds[0].revents & POLLIN) {
+			break;
+		}
+		if (exporter->listener == -1) {
+			metrics_write_file (exporter->path, buffer);
+		} else if (fds[1].revents & POLLIN) {
+			metrics_serve (exporter->listener, buffer);
+		}
+	}
+
+	if (exporter->listener == -1) {
+		metrics_write_file (exporter->path, buffer);
+	}
+	string_buffer_free (buffer);
+	return NULL;
+}
+
+/*
+ * Starts the thread that exports the metrics
+ * @param address the address to serve them on, e.g. "127.0.0.1"
+ * @param port the port to serve them on, or 0 to write them to a file instead
+ * @param path the file to write them to
+ * @param interval how often to write the file, in milliseconds
+ * @return a pointer to the MetricsExporter, or NULL on error (errno is set)
+ */
+MetricsExporter *
+metrics_exporter_start(char *address, int port, char *path, int interval)
+{
+	MetricsExporter *exporter = (MetricsExporter *)calloc(1, sizeof(MetricsExporter));
+	struct sockaddr_in where;
+	int on = 1;
+
+	if (exporter == NULL) {
+		return NULL;
+	}
+	exporter->listener = -1;
+	exporter->path = path;
+	exporter->interval = interval > 0 ? interval : 1000;
+	exporter->wake = eventfd(0, EFD_CLOEXEC);
+	if (exporter->wake == -1) {
+		free(exporter);
+		return NULL;
+	}
+
+	if (port > 0) {
+		memset(&where, 0, sizeof(where));
+		where.sin_family = AF_INET;
+		where.sin_port = htons(port);
+		exporter->listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (exporter->listener == -1 || inet_pton(AF_INET, address, &where.sin_addr) != 1
+		    || setsockopt(exporter->listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+		    || bind(exporter->listener, (struct sockaddr *)&where, sizeof(where)) == -1
+		    || listen(exporter->listener, 16) == -1) {
+			metrics_exporter_stop (exporter);
+			return NULL;
+		}
+	}
+
+	if (pthread_create(&exporter->thread, NULL, metrics_exporter_run, exporter) != 0) {
+		metrics_exporter_stop (exporter);
+		return NULL;
+	}
+	exporter->running = 1;
+
+	return exporter;
+}
+
+/*
+ * Stops the exporter thread, and frees the MetricsExporter
+ * @param exporter the pointer to the MetricsExporter object
+ */
+void
+metrics_exporter_stop(MetricsExporter *exporter)
+{
+	uint64_t one = 1;
+
+	if (exporter->running) {
+		(void) write(exporter->wake, &one, sizeof(one));
+		pthread_join(exporter->thread, NULL);
+	}
+	if (exporter->listener != -1) {
+		close(exporter->listener);
+	}
+	close(exporter->wake);
+	free(exporter);
+}
@@ -0,0 +1,83 @@
+/*
+ * The metrics of pushr: counters of the messages and registration ids, gauges
+ * of the queue depths, and latency histograms of every stage a message goes
+ * through. Every thread counts in its own shard, with plain stores, so
+ * counting costs no lock and no contended cache line; the shards are only
+ * added up when the metrics are read. The histograms are HDR-style: buckets
+ * that double in width every METRICS_SUB_BUCKETS buckets, so every latency
+ * from a microsecond to an hour is kept within about 6%.
+ * A MetricsExporter thread serves them in the Prometheus text format over
+ * HTTP, or writes them to a file every interval.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <pthread.h>
+
+#include "stringbuffer.h"
+
+/* The counters */
+#define METRIC_PICKED_UP 0 /* messages taken off a queue */
+#define METRIC_SENT 1 /* messages done, sent */
+#define METRIC_ERRORED 2 /* messages done, failed */
+#define METRIC_RETRIED 3 /* messages sent again */
+#define METRIC_TOKENS_SUCCEEDED 4 /* registration ids the push service accepted */
+#define METRIC_TOKENS_FAILED 5 /* and the ones it did not */
+#define METRIC_COUNTERS 6
+
+/* The stages, each with a histogram */
+#define STAGE_PICKUP 0 /* reading a message off its queue */
+#define STAGE_BUILD 1 /* building the request JSON */
+#define STAGE_ROUND_TRIP 2 /* the HTTP request to the push service */
+#define STAGE_WRITE_BACK 3 /* writing the outcome back to the queue */
+#define METRIC_STAGES 4
+
+/* The gauges */
+#define GAUGE_FILE_QUEUE 0 /* files in the queue directory */
+#define GAUGE_MYSQL_QUEUE 1 /* rows of the MySQL table not yet sent */
+#define METRIC_GAUGES 2
+
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS 32 /* the longest latency, in microseconds, is 2^32 - 1 (71 minutes) */
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+#define METRICS_MAX_SHARDS 64 /* threads with their own shard, the others share one */
+
+typedef struct {
+	pthread_t thread;
+	int listener; /* the socket to serve on, or -1 to write the file */
+	char *path; /* the file to write */
+	int interval; /* how often to write it, in milliseconds */
+	int wake; /* an eventfd that stops the thread */
+	int running; /* set once the thread started */
+} MetricsExporter;
+
+long long
+metrics_clock();
+
+void
+metrics_count(int counter, unsigned long count);
+
+void
+metrics_time(int stage, long long micros);
+
+void
+metrics_gauge(int gauge, long value);
+
+void
+metrics_gauge_add(int gauge, long delta);
+
+unsigned long
+metrics_counter(int counter);
+
+void
+metrics_render(StringBuffer *buffer);
+
+MetricsExporter *
+metrics_exporter_start(char *address, int port, char *path, int interval);
+
+void
+metrics_exporter_stop(MetricsExporter *exporter);
+
+#endif
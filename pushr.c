@@ -3,6 +3,17 @@
 #include "stringbuffer.h"
 #include "stringlist.h"
 #include "singleton.h"
+#include "sender.h"
+#include "watcher.h"
+#include "gcmresponse.h"
+#include "tokenstore.h"
+#include "coalescer.h"
+#include "logqueue.h"
+#include "queuedir.h"
+#include "filering.h"
+#include "responsearchive.h"
+#include "timingwheel.h"
+#include "circuitbreaker.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,17 +22,413 @@
 #include <sys/wait.h>
 #include <string.h>
 #include <mysql/mysql.h>
-#include <dirent.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+
+/* Cleared by the signal handler to stop the daemon */
+static volatile sig_atomic_t keep_running = 1;
+
+/* Set while the daemon runs: its loop sends the messages again, the batches
+ * don't wait for them */
+static int in_daemon = 0;
+
+/* What we know about the registration ids, or NULL when not used */
+static TokenStore *token_store = NULL;
+
+/* Packs the messages with the same payload into shared requests */
+static Coalescer *coalescer = NULL;
+
+/* The memory of the messages, one arena each */
+static ArenaPool message_arenas;
+
+/* The queue, sent and error directories, kept open once they are used */
+static QueueDir *queue_dir = NULL;
+static QueueDir *sent_dir = NULL;
+static QueueDir *error_dir = NULL;
+
+/* Batches the I/O of the files, or NULL to make the calls one at a time */
+static FileRing *file_ring = NULL;
+
+/* Files found in the queue, to be read together */
+static struct {
+	int shard;
+	char name[NAME_MAX + 1];
+} found_files[IO_URING_BATCH];
+static int found_file_count = 0;
+
+/* Messages of files that are done, to be moved together */
+static MessageId *done_files[IO_URING_BATCH];
+static int done_file_count = 0;
+
+/* Where the responses of the files are kept, or NULL to write them next to the files */
+static ResponseArchive *response_archive = NULL;
+
+/* The messages that wait to be sent again, and how many were */
+static TimingWheel retry_wheel;
+
+/* The files whose messages are being sent: coalesced, in flight, or waiting
+ * in the retry wheel, in buckets by the hash of their names. They stay in the
+ * queue until they are done, the scans of the queue and the late inotify
+ * events skip them. */
+static MessageId *busy_files[BUSY_FILE_BUCKETS];
+static int busy_file_count = 0;
+
+/* The same for the MySQL messages, in buckets by their ids: the polls of the
+ * rows we hold skip them */
+static MessageId *busy_rows[BUSY_ROW_BUCKETS];
+static int busy_row_count = 0;
+
+/* The outcomes of the MySQL messages, to write back with the next batch. The
+ * messages that are sent again list theirs after their batch was written. */
+static DatabaseResults database_results;
+
+/* Stops the requests while the push service is down. The messages are left
+ * in the queue: files and MySQL rows are read again once it is back, and the
+ * log queue checkpoint stops at the first message left. The files that were
+ * left are listed, in order, in an arena of their own; if one couldn't be,
+ * the whole queue is scanned again instead. */
+static CircuitBreaker breaker;
+static int files_deferred = 0;
+static DeferredFile *deferred_files = NULL;
+static DeferredFile **deferred_tail = &deferred_files;
+static Arena *deferred_arena = NULL;
+static int deferred_rescan = 0;
+static int rows_deferred = 0;
+static unsigned long deferred_messages = 0;
+
+/* The timelines of the messages, see MessageTimeline */
+static long long clock_offset = 0; /* the wall clock minus the monotonic clock, in microseconds */
+static TraceWriter *trace = NULL;
+static unsigned long traced = 0; /* messages done, for the sampling */
+
+/* The fields of a message file, one per line after the registration ids */
+static const struct {
+	char *name;
+	char *open; /* what goes between the name and the value */
+	char *close; /* what goes after the value */
+} file_fields[] = {
+	{ FIELD_NOTIFICATION_KEY, ": \"", "\"" }, /* String */
+	{ FIELD_DATA, " : ", "" }, /* JSON Object */
+	{ FIELD_COLLAPSE_KEY, " : \"", "\"" }, /* String */
+	{ FIELD_DELAY_WHILE_IDLE, " : ", "" }, /* Boolean */
+	{ FIELD_TTL, " : ", "" }, /* Number */
+	{ FIELD_RESTRICTED_PACKAGE, " : \"", "\"" }, /* String */
+	{ FIELD_DRY_RUN, " : ", "" } /* Boolean */
+};
+
+/*
+ * Returns the time on the monotonic clock
+ * @return the time in milliseconds
+ */
+static long long
+monotonic_time()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Counts a message that was taken off its queue
+ * @param took how long it took to read it, in microseconds
+ */
+static void
+picked_up(long long took)
+{
+	metrics_count (METRIC_PICKED_UP, 1);
+	metrics_time (STAGE_PICKUP, took);
+}
+
+/*
+ * Returns the time for the timeline of a message: the monotonic clock, set to
+ * the wall clock of when pushr started
+ * @return the time in microseconds since the epoch
+ */
+static long long
+timeline_clock()
+{
+	return metrics_clock () + clock_offset;
+}
+
+/*
+ * Writes the timeline of a message in JSON, in the message's arena
+ * @param message_data the message data
+ * @return the JSON object, or NULL if out of memory
+ */
+static char *
+timeline_json(MessageId *message_data)
+{
+	MessageTimeline *timeline = &message_data->timeline;
+	StringBuffer *json = string_buffer_create_in (message_data->arena, 120);
+
+	if (json == NULL) {
+		return NULL;
+	}
+	string_buffer_append_format (json, "{\"queued\":%lld,\"picked\":%lld,\"started\":%lld,\"first_byte\":%lld,"
+	                             "\"done\":%lld}", timeline->queued, timeline->picked, timeline->started, 
+	                             timeline->first_byte, timeline->done);
+
+	return string_buffer_get_string (json);
+}
+
+/*
+ * Writes what we learned about the registration ids, if anything
+ */
+static void
+save_tokens()
+{
+	if (token_store != NULL && token_store_flush (token_store) == -1) {
+		output("Couldn't write the token store (%s)", PATH_TOKENS);
+	}
+}
+
+/*
+ * Learns from the results of registration ids which ones are dead, and which
+ * ones were replaced
+ * @param tokens the registration ids
+ * @param results their results, in the same order
+ * @param count the number of registration ids
+ */
+static void
+learn_tokens(char **tokens, GcmResult *results, int count)
+{
+	int i;
+
+	if (token_store == NULL) {
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (results[i].error != NULL && (strcmp(results[i].error, "NotRegistered") == 0 
+		                                 || strcmp(results[i].error, "InvalidRegistration") == 0)) {
+			token_store_dead (token_store, tokens[i]);
+		} else if (results[i].registration_id != NULL) {
+			token_store_canonical (token_store, tokens[i], results[i].registration_id);
+		}
+	}
+}
+
+/*
+ * Adds the response of a file to the archive
+ * @param message_data the message data
+ * @param response the server response for the message
+ * @param length the length of the response
+ * @param success 1 if the message was sent, 0 if it failed
+ */
+static void
+archive_response(MessageId *message_data, char *response, size_t length, int success)
+{
+	if (response_archive_add (response_archive, message_data->file_name, success, message_data->read_time, 
+	                          response, length) == -1) {
+		output("Couldn't write the response of %s to the archive (%s): %s", 
+		       message_data->file_name, PATH_RESPONSE_ARCHIVE, strerror(errno));
+	}
+}
+
+/*
+ * Marks the file of a message that was sent more than once with the number of
+ * attempts, and with its timeline when USE_TRACING is on, in extended
+ * attributes. File systems without them are skipped.
+ * @param dir the descriptor of the directory the file is in
+ * @param message_data the message data
+ */
+static void
+record_attributes(int dir, MessageId *message_data)
+{
+	char value[16];
+	char *timeline;
+	int file;
+
+	if (message_data->attempts < 2 && ! USE_TRACING) {
+		return;
+	}
+
+	file = openat(dir, message_data->file_name, O_RDONLY);
+	if (file == -1) {
+		return;
+	}
+	snprintf(value, sizeof(value), "%d", message_data->attempts);
+	if (message_data->attempts >= 2 && fsetxattr(file, XATTR_ATTEMPTS, value, strlen(value), 0) == -1 
+	    && errno != ENOTSUP) {
+		output("Couldn't record the attempts of %s: %s", message_data->file_name, strerror(errno));
+	}
+	timeline = USE_TRACING ? timeline_json (message_data) : NULL;
+	if (timeline != NULL && fsetxattr(file, XATTR_TIMELINE, timeline, strlen(timeline), 0) == -1 && errno != ENOTSUP) {
+		output("Couldn't record the timeline of %s: %s", message_data->file_name, strerror(errno));
+	}
+	close(file);
+}
+
+/*
+ * Moves the files of the messages that are done to the sent or the error
+ * directory, and writes their responses next to them, with a batch of calls
+ * for all of them. The messages are freed.
+ */
+static void
+move_files()
+{
+	int renamed[IO_URING_BATCH];
+	int files[IO_URING_BATCH];
+	char *names[IO_URING_BATCH];
+	int count = done_file_count;
+	long long took = metrics_clock (); /* to write them all back */
+	int i;
+
+	if (count == 0) {
+		return;
+	}
+	done_file_count = 0;
+	metrics_gauge_add (GAUGE_FILE_QUEUE, -count);
+
+	/* Move them, and create their response files */
+	for (i = 0; i < count; i++) {
+		MessageId *message_data = done_files[i];
+		QueueDir *target = message_data->success ? sent_dir : error_dir;
+		int target_fd = queue_dir_fd (target, queue_dir_shard (target, message_data->file_name));
+		StringBuffer *res_file = string_buffer_create_in (message_data->arena, 100);
+
+		names[i] = NULL;
+		files[i] = -ENOMEM;
+		if (res_file != NULL) {
+			string_buffer_append (res_file, message_data->file_name);
+			string_buffer_append (res_file, ".response");
+			names[i] = string_buffer_get_string (res_file);
+		}
+
+		file_ring_renameat (file_ring, queue_dir_fd (queue_dir, message_data->shard), message_data->file_name,
+		                    target_fd, message_data->file_name, &renamed[i]);
+		if (response_archive == NULL && names[i] != NULL) {
+			file_ring_openat (file_ring, target_fd, names[i], O_WRONLY | O_CREAT | O_TRUNC, 
+			                  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, &files[i]);
+		}
+	}
+	if (file_ring_run (file_ring) == -1) {
+		output("Error moving the files: %s", strerror(errno));
+	}
+
+	/* Write the responses, and close the files */
+	for (i = 0; i < count; i++) {
+		MessageId *message_data = done_files[i];
+		QueueDir *target = message_data->success ? sent_dir : error_dir;
+
+		if (renamed[i] < 0) {
+			output("Couldn't move file %s to its new location (%s): %s", 
+			       message_data->file_name, target->path, strerror(-renamed[i]));
+		} else {
+			record_attributes (queue_dir_fd (target, queue_dir_shard (target, message_data->file_name)), message_data);
+		}
+		if (response_archive != NULL) {
+			archive_response (message_data, message_data->response, message_data->response_length, 
+			                  message_data->success);
+			continue;
+		}
+		if (files[i] < 0) {
+			output("Couldn't write response file (%s.response in %s).", message_data->file_name, target->path);
+			continue;
+		}
+		file_ring_write (file_ring, files[i], message_data->response, message_data->response_length, NULL);
+		file_ring_link (file_ring);
+		file_ring_close (file_ring, files[i], NULL);
+	}
+	if (file_ring_run (file_ring) == -1) {
+		output("Error writing the response files: %s", strerror(errno));
+	}
+
+	/* The messages are done, release all of their resources */
+	took = metrics_clock () - took;
+	for (i = 0; i < count; i++) {
+		metrics_time (STAGE_WRITE_BACK, took);
+		arena_pool_give (&message_arenas, done_files[i]->arena);
+	}
+}
+
+/*
+ * Sends the messages that wait to be coalesced, and waits for all the
+ * requests to be done, and for the messages to be sent again, if they are.
+ * In the daemon, the messages that are sent again are left to its loop.
+ * @param sender the pointer to the Sender object
+ */
+static void
+flush_messages(Sender *sender)
+{
+	coalescer_flush (coalescer);
+	sender_flush (sender);
+	while (! in_daemon && retry_wheel.count > 0) {
+		(void) sender_poll (sender, -1, (int)timing_wheel_next (&retry_wheel, monotonic_time ()));
+		if (retry_messages () > 0) {
+			coalescer_flush (coalescer);
+			sender_flush (sender);
+		}
+	}
+	move_files ();
+}
+
+/*
+ * Opens the queue, sent and error directories, unless they are open
+ * @return 0 on success, -1 on error
+ */
+static int
+open_file_dirs()
+{
+	if (queue_dir == NULL) {
+		queue_dir = queue_dir_open (PATH_MSGS_QUEUE, QUEUE_SHARDS);
+		if (queue_dir == NULL) {
+			output("Error opening message queue directory (%s): %s", PATH_MSGS_QUEUE, strerror(errno));
+			return -1;
+		}
+	}
+	if (sent_dir == NULL) {
+		sent_dir = queue_dir_open (PATH_MSGS_SENT, QUEUE_SHARDS);
+		if (sent_dir == NULL) {
+			output("Error opening sent messages directory (%s): %s", PATH_MSGS_SENT, strerror(errno));
+			return -1;
+		}
+	}
+	if (error_dir == NULL) {
+		error_dir = queue_dir_open (PATH_MSGS_ERROR, QUEUE_SHARDS);
+		if (error_dir == NULL) {
+			output("Error opening failed messages directory (%s): %s", PATH_MSGS_ERROR, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Closes the queue, sent and error directories
+ */
+static void
+close_file_dirs()
+{
+	if (queue_dir != NULL) {
+		queue_dir_close (queue_dir);
+	}
+	if (sent_dir != NULL) {
+		queue_dir_close (sent_dir);
+	}
+	if (error_dir != NULL) {
+		queue_dir_close (error_dir);
+	}
+}
 
 int
 main(int argc, char *argv[], char *env[])
 {
 	pid_t child;
+	int daemon_mode = (argc == 2 && strcmp(argv[1], "daemon") == 0);
+
+	if (USE_RESPONSE_ARCHIVE && argc == 3 && strcmp(argv[1], "response") == 0) {
+		/* Only a look up, no need to fork or lock */
+		return find_response (argv[2]);
+	}
 
 	child = fork(); /* We want the main process to return as soon as possible
 					 * to prevent the invoker [script, other program] to hang.
@@ -39,9 +446,16 @@ main(int argc, char *argv[], char *env[])
 		 * Singleton checking - making sure only one pushr process is running at a time 
 		 */
 		int isLocked = singleton_check ();
-		CURL *curl;
+		Sender *sender;
+		MetricsExporter *exporter = NULL;
+		char *push_url = getenv(ENV_PUSH_URL); /* e.g. a mock of the push service */
+		struct timespec wall_clock; /* for the timelines of the messages */
+		struct curl_slist *headers = NULL; /* customized headers */
+		StringBuffer *authorization; /* the authorization string */
 		
-		sleep(5);
+		if (! daemon_mode) {
+			sleep(5);
+		}
 
 		if (isLocked == 1) {
 			/* The lock is still valid, quit */
@@ -49,42 +463,140 @@ main(int argc, char *argv[], char *env[])
 			exit(EXIT_SUCCESS);
 		} 
 
+        if (push_url == NULL || push_url[0] == '\0') {
+			push_url = PUSH_POST_URL;
+		}
+
         curl_global_init(CURL_GLOBAL_DEFAULT);
+		timing_wheel_init (&retry_wheel, monotonic_time (), RETRY_TICK);
+		circuit_breaker_init (&breaker, push_url, USE_BREAKER ? BREAKER_FAILURES : 0, BREAKER_OPEN_TIME, 
+		                      BREAKER_PROBES);
+		srandom(time(NULL) ^ getpid()); /* for the jitter of the retries */
+		clock_gettime(CLOCK_REALTIME, &wall_clock);
+		clock_offset = (long long)wall_clock.tv_sec * 1000000 + wall_clock.tv_nsec / 1000 - metrics_clock ();
+
+		authorization = string_buffer_create (50);
+		string_buffer_append (authorization, FIELD_AUTHORIZATION);
+		string_buffer_append (authorization, API_KEY);
+		
+        headers = curl_slist_append(headers, REQUEST_CONTENT_TYPE);
+        headers = curl_slist_append(headers, string_buffer_get_string (authorization));
+		string_buffer_free (authorization); /* cURL keeps its own copy */
         
-        curl = curl_easy_init();
-        if (curl) {
-			struct curl_slist *headers = NULL; /* customized headers */
-			StringBuffer *authorization = string_buffer_create (50); /* the authorization string */
+        if (USE_TOKEN_STORE) {
+			token_store = token_store_open (PATH_TOKENS);
+			if (token_store == NULL) {
+				output("Couldn't open the token store. Out of memory?");
+			}
+		}
+
+        if (USE_FILES && USE_RESPONSE_ARCHIVE) {
+			response_archive = response_archive_open (PATH_RESPONSE_ARCHIVE);
+			if (response_archive == NULL) {
+				output("Couldn't open the response archive (%s): %s", PATH_RESPONSE_ARCHIVE, strerror(errno));
+			}
+		}
+		if (USE_FILES && USE_IO_URING) {
+			file_ring = file_ring_create (2 * IO_URING_BATCH);
+			if (file_ring == NULL) {
+				output("io_uring is not available, the files are handled one at a time.");
+			}
+		}
+
+		if (USE_METRICS) {
+			/* Served while running as a daemon, written to a file otherwise */
+			exporter = metrics_exporter_start (METRICS_ADDRESS, daemon_mode ? METRICS_PORT : 0, PATH_METRICS, 
+			                                   METRICS_INTERVAL);
+			if (exporter == NULL) {
+				output("Couldn't export the metrics: %s", strerror(errno));
+			}
+		}
 
-			string_buffer_append (authorization, FIELD_AUTHORIZATION);
-			string_buffer_append (authorization, API_KEY);
-			
-            headers = curl_slist_append(headers, REQUEST_CONTENT_TYPE);
-            headers = curl_slist_append(headers, string_buffer_get_string (authorization));
+		if (USE_TRACING) {
+			trace = trace_open (PATH_TRACE);
+			if (trace == NULL) {
+				output("Couldn't open the trace file (%s): %s", PATH_TRACE, strerror(errno));
+			}
+		}
 
+        sender = sender_create (push_url, headers, MAX_IN_FLIGHT, WORKER_THREADS, handle_response);
+        if (sender) {
+			sender_set_rate (sender, RATE_LIMIT, RATE_BURST, USE_ADAPTIVE_WINDOW ? RATE_MIN_WINDOW : MAX_IN_FLIGHT, 
+			                 RATE_RTT_TOLERANCE);
+			coalescer = coalescer_create (USE_COALESCING ? COALESCE_GROUPS : 0, MAX_REGISTRATION_IDS, 
+			                              dispatch_request, sender);
+		}
+        if (coalescer) {
 			/* Use command-line arguments to decide whether to read the queue 
-			 * from the file system or a MySQL table. Default: file system
+			 * from the file system or a MySQL table, or to keep running and 
+			 * handle both. Default: file system
 			 */
-			if (USE_MYSQL && argc == 2 && strcmp(argv[1], "mysql") == 0) {
+			if (daemon_mode) {
+				output("Running as a daemon.");
+				run_daemon (sender);
+			} else if (USE_MYSQL && argc == 2 && strcmp(argv[1], "mysql") == 0) {
 				/* Use database */
 				output("Using MySQL table.");
-				handle_database_queue (curl, headers);
+				handle_database_queue (sender);
+			} else if (USE_LOG && argc == 2 && strcmp(argv[1], "log") == 0) {
+				/* Use the log queue */
+				output("Using the log queue.");
+				handle_log_queue (sender);
 			} else {
 				if (USE_FILES) {
 					/* Use the file system */
 					output("Using filesystem");
-					handle_file_queue (curl, headers);
+					handle_file_queue (sender);
 				} else {
 					output("Error: Filesystem was requested, but it is not enabled.");
 				}
 			}
                 
-            /* Free the custom headers */
-            curl_slist_free_all(headers);
+            output("Heap allocations by the request arenas: %lu", sender_allocations (sender));
+            output("Messages: %lu, requests: %lu, message arenas: %lu", 
+                   coalescer->messages, coalescer->requests, message_arenas.created);
+            output("Messages sent again: %lu", metrics_counter (METRIC_RETRIED));
+            output("The push service was down %lu times, %lu messages were left in the queue", 
+                   breaker.opens, deferred_messages);
+            output("Rate: %g requests a second at most (0 for no limit), window %d (%d to %d), "
+                   "round trip %.1f ms (shortest %.1f ms)", sender->limiter.rate, (int)sender->limiter.window, 
+                   sender->limiter.min_window, sender->limiter.max_window, sender->limiter.rtt, sender->limiter.min_rtt);
+            output("The window shrank %lu times for 429 or 5xx and failed requests, %lu for slow round trips; "
+                   "requests waited for the rate %lu times", sender->limiter.throttled, sender->limiter.slowed, 
+                   sender->limiter.waits);
+
             /* ... And clean up... */
-            curl_easy_cleanup(curl);
-                
+            coalescer_free (coalescer);
+            sender_free (sender);
+            forget_deferred_files ();
+            arena_pool_free (&message_arenas);
+        } else {
+			output("Couldn't create the sender for %s. Out of memory, or a bad loopback profile?", push_url);
+			if (sender) { /* but not the coalescer */
+				sender_free (sender);
+			}
         }
+
+        if (token_store != NULL) {
+			token_store_close (token_store);
+		}
+		if (file_ring != NULL) {
+			file_ring_free (file_ring);
+		}
+		if (response_archive != NULL) {
+			response_archive_close (response_archive);
+		}
+		close_file_dirs ();
+		if (exporter != NULL) {
+			metrics_exporter_stop (exporter); /* writes the file one last time */
+		}
+		if (trace != NULL) {
+			output("Messages traced: %lu (%lu spans)", (traced + TRACE_SAMPLE - 1) / TRACE_SAMPLE, trace->spans);
+			trace_close (trace);
+		}
+
+        /* Free the custom headers */
+        curl_slist_free_all(headers);
         
         /* And global clean up */
         curl_global_cleanup();
@@ -105,613 +617,2416 @@ main(int argc, char *argv[], char *env[])
 }
 
 /*
- * This function is in charge of handling the data from the server. It is being
- * invoked by the cURL library.
- * @param userp is the pointer to the file descriptor
+ * Reports the counters of a message and gives its verdict
+ * @param successes the registration ids the message was accepted for
+ * @param fails the registration ids it was not
+ * @return 1 if the message was sent, 0 if it failed
  */
-size_t 
-receive_data(void *buffer, size_t size, size_t nmemb, void *userp)
+static int
+message_verdict(int successes, int fails)
+{
+	output("Successes: %d, Fails: %d", successes, fails);
+	metrics_count (METRIC_TOKENS_SUCCEEDED, successes);
+	metrics_count (METRIC_TOKENS_FAILED, fails);
+	/* If there are more successful messages than failed, we mark it as a
+	 * successful job */
+	return fails > successes ? 0 : 1;
+}
+
+/*
+ * Appends a JSON string, escaped
+ * @param buffer the StringBuffer
+ * @param string the string
+ */
+static void
+append_json_string(StringBuffer *buffer, const char *string)
+{
+	size_t span;
+
+	string_buffer_append_char (buffer, '\"');
+	while (*string != '\0') {
+		span = strcspn(string, "\"\\");
+		string_buffer_append_n (buffer, string, span);
+		string += span;
+		if (*string != '\0') {
+			string_buffer_append_char (buffer, '\\');
+			string_buffer_append_char (buffer, *string++);
+		}
+	}
+	string_buffer_append_char (buffer, '\"');
+}
+
+/*
+ * Writes the response of one message that was sent with others, in the form
+ * of the push service's own response
+ * @param buffer the StringBuffer to write it in, or NULL to only give the verdict
+ * @param multicast_id the multicast id of the request
+ * @param results the results of the message's registration ids
+ * @param count the number of results
+ * @return 1 if the message was sent, 0 if it failed
+ */
+static int
+message_response(StringBuffer *buffer, unsigned long long multicast_id, GcmResult *results, int count)
 {
-	size_t real_size = size * nmemb;
-	size_t i; /* for loop */
-	int c; /* character */
-	int insideTag = 0; /* remember if we are inside an HTML tag */
-	StringBuffer *string = string_buffer_create (50); /* hold the response */
-	char *response;
-	int success = 0; /* Did we succeed? */
-	int fails = 0; /* Counters */
 	int successes = 0;
-	
-	MessageId *message_data = (MessageId *)userp;
+	int fails = 0;
+	int canonical_ids = 0;
+	int i;
 
-	for (i = 0; i < real_size; i++) 
-	{
-		c = ((char *)buffer)[i];
-		if (c == '<') {
-			insideTag = 1;
-		} else if (c == '>') {
-			insideTag = 0;
+	for (i = 0; i < count; i++) {
+		if (results[i].message_id != NULL) {
+			successes++;
 		} else {
-			if (insideTag == 0) {
-				/* Actual data */
-				string_buffer_append_char (string, c);
-			}
+			fails++;
+		}
+		if (results[i].registration_id != NULL) {
+			canonical_ids++;
 		}
 	}
+	if (buffer == NULL) {
+		return message_verdict (successes, fails);
+	}
 
-	
-	response = string_buffer_get_string (string);
-	
-	if (strcmp(response, "Error 400 (Bad Request)!!1") == 0)
-	{
-		/* Bad request error */
-		success = 0;
-	} else {
-		/* Analyze response JSON */
-		json_dirty_parse(response, &successes, &fails);
-		output("Successes: %d, Fails: %d", successes, fails);
-		/* If there are more successful messages than failed, we mark it as a
-		 * successful job */
-		if (fails > successes) {
-			success = 0;
+	string_buffer_append_format (buffer, "{\"multicast_id\":%llu,\"success\":%d,\"failure\":%d,"
+	                             "\"canonical_ids\":%d,\"results\":[", multicast_id, successes, fails, canonical_ids);
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			string_buffer_append_char (buffer, ',');
+		}
+		string_buffer_append_char (buffer, '{');
+		if (results[i].registration_id != NULL) {
+			string_buffer_append (buffer, "\"registration_id\":");
+			append_json_string (buffer, results[i].registration_id);
+			string_buffer_append_char (buffer, ',');
+		}
+		if (results[i].message_id != NULL) {
+			string_buffer_append (buffer, "\"message_id\":");
+			append_json_string (buffer, results[i].message_id);
 		} else {
-			success = 1;
+			string_buffer_append (buffer, "\"error\":");
+			append_json_string (buffer, results[i].error != NULL ? results[i].error : "");
+		}
+		string_buffer_append_char (buffer, '}');
+	}
+	string_buffer_append (buffer, "]}");
+
+	return message_verdict (successes, fails);
+}
+
+/*
+ * Keeps a response in the message's arena, until the message is done
+ * @param message_data the message data
+ * @param response the response
+ * @param length the length of the response
+ */
+static void
+keep_response(MessageId *message_data, char *response, size_t length)
+{
+	message_data->response = (char *)arena_alloc (message_data->arena, length + 1);
+	if (message_data->response == NULL) {
+		message_data->response_length = 0;
+		return;
+	}
+	memcpy(message_data->response, response, length);
+	message_data->response[length] = '\0';
+	message_data->response_length = length;
+}
+
+/*
+ * Copies a string of a result to the message's arena
+ * @param message_data the message data
+ * @param string the string, or NULL
+ * @return the copy, or NULL
+ */
+static char *
+keep_string(MessageId *message_data, char *string)
+{
+	return string != NULL ? arena_strdup (message_data->arena, string) : NULL;
+}
+
+/*
+ * Records the results of a part of a message that was split, coalesced
+ * with others, or sent again. When the request failed, every registration id
+ * of the part gets the error given.
+ * @param message_data the message data
+ * @param part the part
+ * @param parsed the parsed response, or NULL if the request failed
+ * @param position where the part's results are in the response
+ * @param response the response of the request
+ * @param length the length of the response
+ * @param error the error of the registration ids when the request failed
+ */
+static void
+record_results(MessageId *message_data, CoalescedPart *part, GcmResponse *parsed, int position, 
+               char *response, size_t length, char *error)
+{
+	int *map = message_data->retry_map; /* where the ids sent again are in the message */
+	int i;
+
+	if (message_data->token_results == NULL && message_data->token_count > 0) {
+		message_data->token_results = (GcmResult *)arena_alloc (message_data->arena, 
+		                                                        message_data->token_count * sizeof(GcmResult));
+		if (message_data->token_results == NULL) {
+			/* Out of memory, the message fails */
+			output("Error allocating memory for the message results");
+			return;
 		}
+		memset(message_data->token_results, 0, message_data->token_count * sizeof(GcmResult));
 	}
 
-	if (message_data->file_desc != -1) {
-		/* We got the data from a file. We need to close it now */
-		close(message_data->file_desc); 
+	if (parsed == NULL) {
+		if (message_data->response == NULL) {
+			keep_response (message_data, response, length);
+		}
+		for (i = 0; i < part->count; i++) {
+			message_data->token_results[map != NULL ? map[part->offset + i] : part->offset + i].error = error;
+		}
+		return;
 	}
-	
-	if (message_data->file_name != NULL) {
-		/* The data came from a file, move it to the appropriate directory and 
-		 * write the server response to a file
-		 */
-		StringBuffer *old_path = string_buffer_create (100);
-		StringBuffer *new_path = string_buffer_create (100);
-		StringBuffer *res_file = string_buffer_create (100);
-		int res_file_desc;
 
-		string_buffer_append (old_path, PATH_MSGS_QUEUE);
-		string_buffer_append_char (old_path, '/');
-		string_buffer_append (old_path, message_data->file_name);
+	if (message_data->answered++ == 0) {
+		message_data->multicast_id = parsed->multicast_id;
+	}
+	for (i = 0; i < part->count; i++) {
+		GcmResult *result = &parsed->results[position + i];
+		GcmResult *own = &message_data->token_results[map != NULL ? map[part->offset + i] : part->offset + i];
+
+		own->message_id = keep_string (message_data, result->message_id);
+		own->registration_id = keep_string (message_data, result->registration_id);
+		own->error = keep_string (message_data, result->error);
+	}
+}
+
+/*
+ * Finds the bucket of a file in the files that are being sent
+ * @param name the name of the file
+ * @return the head of its bucket
+ */
+static MessageId **
+busy_file_bucket(const char *name)
+{
+	unsigned int hash = 2166136261u; /* FNV-1a */
+
+	while (*name != '\0') {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+
+	return &busy_files[hash % BUSY_FILE_BUCKETS];
+}
+
+/*
+ * Tells whether a file in the queue is being sent
+ * @param shard the shard the file is in
+ * @param name the name of the file
+ * @return 1 if it is, 0 if not
+ */
+static int
+is_busy_file(int shard, const char *name)
+{
+	MessageId *message_data;
+
+	if (busy_file_count == 0) {
+		return 0;
+	}
+	for (message_data = *busy_file_bucket (name); message_data != NULL; message_data = message_data->busy_next) {
+		if (message_data->shard == shard && strcmp(message_data->file_name, name) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Adds the file of a message to the files that are being sent, until it is
+ * done or left in the queue
+ * @param message_data the message data
+ */
+static void
+hold_file(MessageId *message_data)
+{
+	MessageId **bucket = busy_file_bucket (message_data->file_name);
+
+	message_data->busy_next = *bucket;
+	*bucket = message_data;
+	busy_file_count++;
+}
+
+/*
+ * Takes the file of a message out of the files that are being sent, if it is
+ * in them
+ * @param message_data the message data
+ */
+static void
+release_file(MessageId *message_data)
+{
+	MessageId **position;
+
+	if (message_data->file_name == NULL || busy_file_count == 0) {
+		return;
+	}
+	for (position = busy_file_bucket (message_data->file_name); *position != NULL; 
+	     position = &(*position)->busy_next) {
+		if (*position == message_data) {
+			*position = message_data->busy_next;
+			busy_file_count--;
+			return;
+		}
+	}
+}
+
+/*
+ * Tells whether a MySQL message is being sent
+ * @param id the Id of the message
+ * @return 1 if it is, 0 if not
+ */
+static int
+is_busy_row(unsigned long id)
+{
+	MessageId *message_data;
+
+	if (busy_row_count == 0) {
+		return 0;
+	}
+	for (message_data = busy_rows[id % BUSY_ROW_BUCKETS]; message_data != NULL; 
+	     message_data = message_data->busy_next) {
+		if (message_data->id == id) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Adds a MySQL message to the ones that are being sent, until it is done or
+ * left in the table
+ * @param message_data the message data
+ */
+static void
+hold_row(MessageId *message_data)
+{
+	MessageId **bucket = &busy_rows[message_data->id % BUSY_ROW_BUCKETS];
+
+	message_data->busy_next = *bucket;
+	*bucket = message_data;
+	busy_row_count++;
+}
+
+/*
+ * Takes a MySQL message out of the ones that are being sent, if it is in them
+ * @param message_data the message data
+ */
+static void
+release_row(MessageId *message_data)
+{
+	MessageId **position;
+
+	if (message_data->results == NULL || busy_row_count == 0) {
+		return;
+	}
+	for (position = &busy_rows[message_data->id % BUSY_ROW_BUCKETS]; *position != NULL; 
+	     position = &(*position)->busy_next) {
+		if (*position == message_data) {
+			*position = message_data->busy_next;
+			busy_row_count--;
+			return;
+		}
+	}
+}
+
+/*
+ * Lists a file that is left in the queue while the push service is down, to
+ * be read again once it is back
+ * @param shard the shard the file is in
+ * @param name the name of the file
+ */
+static void
+defer_file(int shard, const char *name)
+{
+	DeferredFile *file = NULL;
+
+	files_deferred = 1;
+	if (deferred_arena == NULL) {
+		deferred_arena = arena_pool_take (&message_arenas);
+	}
+	if (deferred_arena != NULL) {
+		file = (DeferredFile *)arena_alloc (deferred_arena, sizeof(DeferredFile));
+	}
+	if (file != NULL) {
+		file->name = arena_strdup (deferred_arena, name);
+	}
+	if (file == NULL || file->name == NULL) {
+		/* Scan for it instead */
+		output("Error listing the deferred file %s. Out of memory?", name);
+		deferred_rescan = 1;
+		return;
+	}
+
+	file->shard = shard;
+	file->next = NULL;
+	*deferred_tail = file;
+	deferred_tail = &file->next;
+}
+
+/*
+ * Empties the list of the files left in the queue, e.g. before the queue is
+ * scanned, which finds them again
+ */
+void
+forget_deferred_files()
+{
+	if (deferred_arena != NULL) {
+		arena_pool_give (&message_arenas, deferred_arena);
+	}
+	deferred_arena = NULL;
+	deferred_files = NULL;
+	deferred_tail = &deferred_files;
+	deferred_rescan = 0;
+	files_deferred = 0;
+}
+
+/*
+ * Leaves a message in the queue, as it is, while the push service is down.
+ * The message data is freed.
+ * @param message_data the message data
+ */
+static void
+defer_message(MessageId *message_data)
+{
+	release_file (message_data);
+	release_row (message_data);
+	if (message_data->file_name != NULL) {
+		defer_file (message_data->shard, message_data->file_name); /* It is read again */
+	} else if (message_data->log != NULL) {
+		log_queue_defer (message_data->log, message_data->id);
+	} else {
+		rows_deferred = 1; /* We still hold the row, it is polled again */
+	}
+	deferred_messages++;
+	arena_pool_give (&message_arenas, message_data->arena);
+}
+
+/*
+ * Tells whether the push service asks to send to a registration id again later
+ * @param error the error of the registration id, or NULL
+ * @return 1 if it should be sent again, 0 if not
+ */
+static int
+retryable_error(char *error)
+{
+	return error != NULL && (strcmp(error, "Unavailable") == 0 || strcmp(error, "InternalServerError") == 0);
+}
+
+/*
+ * Puts a message in the retry wheel, if some of its registration ids (or the
+ * whole message, when it has none) failed in a way that may not last, and it
+ * has attempts left. The wait grows exponentially with the attempts, with a
+ * random part (equal jitter), and is at least what Retry-After asked for.
+ * @param message_data the message data, once all of its parts are answered
+ * @return 1 if it is sent again, 0 if it is done
+ */
+static int
+retry_message(MessageId *message_data)
+{
+	long long delay = RETRY_DELAY;
+	int i;
+
+	if (! USE_RETRIES || message_data->attempts >= RETRY_MAX_ATTEMPTS || message_data->rest == NULL) {
+		return 0;
+	}
+
+	if (message_data->token_count == 0) {
+		if (! message_data->unavailable) {
+			return 0;
+		}
+	} else {
+		if (message_data->token_results == NULL) {
+			return 0; /* Sent whole, and done */
+		}
+		if (message_data->retry_map == NULL) {
+			message_data->retry_tokens = (char **)arena_alloc (message_data->arena, 
+			                                                   message_data->token_count * sizeof(char *));
+			message_data->retry_map = (int *)arena_alloc (message_data->arena, message_data->token_count * sizeof(int));
+			if (message_data->retry_tokens == NULL || message_data->retry_map == NULL) {
+				message_data->retry_map = NULL;
+				return 0;
+			}
+		}
+		/* Only the registration ids that failed are sent again */
+		message_data->retry_count = 0;
+		for (i = 0; i < message_data->token_count; i++) {
+			if (retryable_error (message_data->token_results[i].error)) {
+				message_data->retry_tokens[message_data->retry_count] = message_data->tokens[i];
+				message_data->retry_map[message_data->retry_count] = i;
+				message_data->retry_count++;
+			}
+		}
+		if (message_data->retry_count == 0) {
+			return 0;
+		}
+	}
+
+	for (i = 1; i < message_data->attempts && delay < RETRY_MAX_DELAY; i++) {
+		delay *= 2;
+	}
+	if (delay > RETRY_MAX_DELAY) {
+		delay = RETRY_MAX_DELAY;
+	}
+	delay = delay / 2 + random() % (delay / 2 + 1);
+	if (message_data->retry_after * 1000 > delay) {
+		delay = message_data->retry_after * 1000 < RETRY_MAX_DELAY ? message_data->retry_after * 1000 : RETRY_MAX_DELAY;
+	}
+
+	output("Sending a message again in %lld ms (attempt %d, %d registration ids)", 
+	       delay, message_data->attempts + 1, message_data->retry_count);
+	message_data->retry_entry.data = message_data;
+	timing_wheel_add (&retry_wheel, &message_data->retry_entry, monotonic_time () + delay);
+	metrics_count (METRIC_RETRIED, 1);
+
+	return 1;
+}
+
+/*
+ * Finishes a message once all of its parts are answered, unless it is sent
+ * again. The results of its registration ids are merged in one response, and
+ * one verdict. When no part was answered, the message fails with the response
+ * of the first request.
+ * @param message_data the message data
+ */
+static void
+complete_message(MessageId *message_data)
+{
+	StringBuffer *merged;
+	int success;
+
+	if (message_data->deferred) {
+		defer_message (message_data);
+		return;
+	}
+	if (retry_message (message_data)) {
+		return; /* Not done yet */
+	}
+
+	if (message_data->answered == 0) {
+		finish_message (message_data, message_data->response != NULL ? message_data->response : "", 
+		                message_data->response_length, message_data->success);
+		return;
+	}
+
+	/* Out of memory, the message still gets its verdict, with no response */
+	merged = string_buffer_create_in (message_data->arena, 100 + message_data->token_count * 64);
+	success = message_response (merged, message_data->multicast_id, message_data->token_results, 
+	                            message_data->token_count);
+	finish_message (message_data, merged != NULL ? string_buffer_get_string (merged) : "", 
+	                merged != NULL ? merged->length : 0, success);
+}
+
+/*
+ * Leaves the messages of a request in the queue, once all of their parts are
+ * done, because the push service is down
+ * @param parts the parts of the request
+ * @param part_count the number of parts
+ */
+static void
+defer_parts(CoalescedPart *parts, int part_count)
+{
+	int i;
+
+	for (i = 0; i < part_count; i++) {
+		MessageId *message_data = (MessageId *)parts[i].message;
+
+		message_data->deferred = 1;
+		message_data->pending--;
+		if (message_data->pending == 0 && ! message_data->held) {
+			complete_message (message_data);
+		}
+	}
+}
+
+/*
+ * This function is in charge of handling the response from the server, once
+ * the request is done. It is being invoked by the Sender. The response is
+ * handed to every message of the request: a message that was sent whole and
+ * on its own gets it as it is, unless it is sent again. A message that was
+ * coalesced with others, split, or sent again, gets the results of its own
+ * registration ids, once all of its parts are answered. A request that failed
+ * in a way that may not last gives its registration ids an Unavailable error,
+ * as the push service would, so they are sent again. When the push service is
+ * down (see CircuitBreaker), the messages of a failed request are left in the
+ * queue instead.
+ * @param userp is the pointer to the Request
+ * @param buffer is the response body
+ * @param parsed is the response, parsed with the result of every registration
+ * id (NULL when the request was never sent)
+ * @param result is the cURL result code of the request
+ */
+void
+handle_response(void *userp, char *buffer, GcmResponse *parsed, CURLcode result)
+{
+	char *cursor = buffer; /* for the loop */
+	size_t span; /* length of actual data */
+	Request *request = (Request *)userp;
+	Arena *arena = request->arena; /* everything for this request goes here */
+	StringBuffer *string = string_buffer_create_in (arena, strlen(buffer)); /* hold the response */
+	char *response;
+	size_t response_length;
+	int failed = 0; /* Did the whole request fail? */
+	int down; /* Did it fail to reach the push service? */
+	int transient; /* May the failure not last? */
+	int retry; /* Is any of it sent again? */
+	int answered; /* Is there a result for every registration id? */
+	int fails = 0; /* Counters */
+	int successes = 0;
+	int position = 0; /* of the part's registration ids in the request */
+	int i;
+
+	/* Copy the response without any HTML tags, a span at a time */
+	while (string != NULL && *cursor != '\0') 
+	{
+		/* Actual data, up to the next tag */
+		span = strcspn(cursor, "<>");
+		string_buffer_append_n (string, cursor, span);
+		cursor += span;
+		if (*cursor == '<') {
+			/* Skip the tag */
+			cursor = strchr(cursor, '>');
+			if (cursor == NULL) {
+				break;
+			}
+		}
+		if (*cursor == '>') {
+			cursor++;
+		}
+	}
+
+	
+	/* Out of memory, as if it were empty */
+	response = string != NULL ? string_buffer_get_string (string) : "";
+	response_length = string != NULL ? string->length : 0;
+	
+	if (result != CURLE_OK) {
+		/* An error has occured, mark this job as failed */
+		output("cURL Error: %s", curl_easy_strerror(result));
+		failed = 1;
+	} else if (strcmp(response, "Error 400 (Bad Request)!!1") == 0)
+	{
+		/* Bad request error */
+		failed = 1;
+	}
+	answered = ! failed && parsed != NULL && ! parsed->error && parsed->result_count == request->token_count;
+	down = result != CURLE_OK || (parsed != NULL && parsed->status >= 500);
+	if (circuit_breaker_done (&breaker, down, request->probe, monotonic_time ())) {
+		output(breaker.state == CIRCUIT_OPEN ? "The push service (%s) is down, leaving the messages in the queue"
+		       : "The push service (%s) is back", breaker.endpoint);
+	}
+	if (down && breaker.state != CIRCUIT_CLOSED) {
+		defer_parts (request->parts, request->part_count);
+		return;
+	}
+	transient = result != CURLE_OK || (parsed != NULL && (parsed->status >= 500 || parsed->status == 429));
+	retry = USE_RETRIES && transient;
+	for (i = 0; USE_RETRIES && answered && ! retry && i < parsed->result_count; i++) {
+		retry = retryable_error (parsed->results[i].error);
+	}
+
+	for (i = 0; i < request->part_count; i++) {
+		CoalescedPart *part = &request->parts[i];
+		MessageId *message_data = (MessageId *)part->message;
+
+		if (answered) {
+			learn_tokens (part->tokens, parsed->results + position, part->count);
+		}
+		message_data->pending--;
+		if (parsed != NULL && parsed->first_byte > 0) {
+			message_data->timeline.first_byte = request->started + parsed->first_byte;
+		}
+		if (parsed != NULL && parsed->retry_after > message_data->retry_after) {
+			message_data->retry_after = parsed->retry_after;
+		}
+
+		if (request->part_count == 1 && part->count == message_data->token_count 
+		    && (message_data->token_count == 0 || (message_data->attempts == 1 && ! retry))) {
+			/* Sent whole and on its own, the response is the message's */
+			int success = 0;
+			if (! failed) {
+				/* Analyze response JSON, already parsed by the Sender */
+				gcm_response_counts (parsed, &successes, &fails);
+				success = message_verdict (successes, fails);
+			}
+			message_data->unavailable = retry;
+			if (! message_data->held && ! retry) {
+				finish_message (message_data, response, response_length, success);
+				break;
+			}
+			/* Done before send_message let it go, or sent again, keep the response for it */
+			message_data->success = success;
+			keep_response (message_data, response, response_length);
+			if (! message_data->held) {
+				complete_message (message_data);
+			}
+		} else {
+			record_results (message_data, part, answered ? parsed : NULL, position, response, response_length, 
+			                transient ? "Unavailable" : "RequestFailed");
+			if (message_data->pending == 0 && ! message_data->held) {
+				complete_message (message_data);
+			}
+		}
+		position += part->count;
+	}
+	/* All the resources are released with the arena, once we return */
+}
+
+/*
+ * Moves the file of a message from the queue to the sent or the error
+ * directory, in the shard of its name
+ * @param message_data the message data
+ * @param target the directory to move it to
+ * @return the descriptor of the shard it was moved to
+ */
+static int
+move_file(MessageId *message_data, QueueDir *target)
+{
+	int target_fd = queue_dir_fd (target, queue_dir_shard (target, message_data->file_name));
+
+	if (renameat(queue_dir_fd (queue_dir, message_data->shard), message_data->file_name, 
+	             target_fd, message_data->file_name) == -1) {
+		output("Couldn't move file %s to its new location (%s): %s", 
+		       message_data->file_name, target->path, strerror(errno));
+	} else {
+		record_attributes (target_fd, message_data);
+		metrics_gauge_add (GAUGE_FILE_QUEUE, -1);
+	}
+
+	return target_fd;
+}
+
+/*
+ * Writes the timeline of one message in TRACE_SAMPLE as trace spans, on a
+ * track of its own: how long it was queued, how long it waited to be sent,
+ * and how long it was sent for, until the first byte of the (last) response
+ * and until its outcome was known
+ * @param message_data the message data
+ * @param success 1 if the message was sent, 0 if it failed
+ */
+static void
+trace_message(MessageId *message_data, int success)
+{
+	MessageTimeline *timeline = &message_data->timeline;
+	StringBuffer *args;
+	char *text;
+
+	if (trace == NULL || traced++ % TRACE_SAMPLE != 0) {
+		return;
+	}
+
+	args = string_buffer_create_in (message_data->arena, 100);
+	if (args == NULL) {
+		return;
+	}
+	string_buffer_append (args, "\"message\":");
+	if (message_data->file_name != NULL) {
+		append_json_string (args, message_data->file_name);
+	} else {
+		string_buffer_append_format (args, "\"%s %lu\"", message_data->log != NULL ? "log" : "mysql", message_data->id);
+	}
+	string_buffer_append_format (args, ",\"attempts\":%d,\"sent\":%d", message_data->attempts, success);
+	text = string_buffer_get_string (args);
+
+	trace_span (trace, "queued", timeline->queued, timeline->picked, traced, text);
+	trace_span (trace, "waiting", timeline->picked, timeline->started, traced, text);
+	trace_span (trace, "sending", timeline->started, timeline->done, traced, text);
+	trace_span (trace, "first_byte", timeline->started, timeline->first_byte, traced, text);
+}
+
+/*
+ * Writes the outcome of a message: a file is moved to the sent or the error
+ * directory, next to a file with the response, a log record's outcome is
+ * listed for the results segment, and a MySQL row is listed for the batch's
+ * write back. The message data is freed.
+ * @param message_data the message data
+ * @param response the server response for the message
+ * @param length the length of the response
+ * @param success 1 if the message was sent, 0 if it failed
+ */
+void
+finish_message(MessageId *message_data, char *response, size_t length, int success)
+{
+	Arena *arena = message_data->arena; /* everything for this message goes here */
+	long long started = metrics_clock ();
+
+	metrics_count (success ? METRIC_SENT : METRIC_ERRORED, 1);
+	release_file (message_data);
+	release_row (message_data);
+	message_data->timeline.done = timeline_clock ();
+	trace_message (message_data, success);
+	if (message_data->file_name != NULL && file_ring != NULL) {
+		/* The file is moved with the next batch, the message is kept until then */
+		if (response != message_data->response) {
+			keep_response (message_data, response, length);
+		}
+		message_data->success = success;
+		done_files[done_file_count++] = message_data;
+		if (done_file_count == IO_URING_BATCH) {
+			move_files ();
+		}
+		return;
+	} else if (message_data->file_name != NULL) {
+		/* The data came from a file, move it to the appropriate directory and 
+		 * write the server response to a file
+		 */
+		QueueDir *target = success ? sent_dir : error_dir;
+		int target_fd = move_file (message_data, target);
+		StringBuffer *res_file;
+		int res_file_desc;
+
+		if (response_archive != NULL) {
+			archive_response (message_data, response, length, success);
+			metrics_time (STAGE_WRITE_BACK, metrics_clock () - started);
+			arena_pool_give (&message_arenas, arena);
+			return;
+		}
+
+		res_file = string_buffer_create_in (arena, 100);
+		res_file_desc = -1;
+		if (res_file != NULL) {
+			string_buffer_append (res_file, message_data->file_name);
+			string_buffer_append (res_file, ".response");
+
+			/* Write the server response to a file
+			 * Create the file and give the user and group read and write and only read permission to others
+			 */
+			res_file_desc = openat(target_fd, string_buffer_get_string (res_file), O_WRONLY | O_CREAT | O_TRUNC, 
+			                       S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+		}
+		if (res_file_desc != -1) {
+			/* write data to file */
+			write(res_file_desc, response, length);
+			close(res_file_desc);
+		} else {
+			output("Couldn't write response file (%s.response in %s).", message_data->file_name, target->path);
+		}
+		metrics_time (STAGE_WRITE_BACK, metrics_clock () - started);
+	} else if (message_data->log != NULL) {
+		/* The data came from the log queue, list it for the results segment */
+		log_queue_result (message_data->log, message_data->id, success, response, length);
+	} else {
+		/* Data came from database, list it for the batch's write back.
+		 * The result outlives this message, so it is kept in the batch's arena.
+		 * The response is bound as it is to the update, no escaping needed.
+		 */
+		DatabaseResults *results = message_data->results;
+		struct DatabaseResult *item;
+
+		item = (struct DatabaseResult *)arena_alloc (results->arena, sizeof(struct DatabaseResult));
+		if (item == NULL) {
+			/* Error allocating memory, the message stays in the queue */
+			output("Error allocating memory for the message result");
+			arena_pool_give (&message_arenas, arena);
+			return;
+		}
+
+		item->id = message_data->id;
+		item->sent = success;
+		item->error = ! success;
+		item->attempts = message_data->attempts;
+		item->timeline = "";
+		item->timeline_length = 0;
+		if (USE_TRACING) {
+			char *timeline = timeline_json (message_data);
+			item->timeline = timeline != NULL ? arena_strdup (results->arena, timeline) : NULL;
+			item->timeline_length = item->timeline != NULL ? strlen(item->timeline) : 0;
+			if (item->timeline == NULL) {
+				item->timeline = "";
+			}
+		}
+		item->length = length;
+		item->response = (char *)arena_alloc (results->arena, length + 1);
+		if (item->response == NULL) {
+			/* Error allocation memory, use an empty string */
+			item->response = "";
+			item->length = 0;
+		} else {
+			memcpy(item->response, response, length);
+			item->response[length] = '\0';
+		}
+		item->next = NULL;
+		if (results->last == NULL) {
+			results->first = item;
+		} else {
+			results->last->next = item;
+		}
+		results->last = item;
+		results->count++;
+	}
+
+	/* The message is done, release all of its resources */
+	arena_pool_give (&message_arenas, arena);
+}
+
+/*
+ * Sends the message of a file that was read, or moves the file to the error
+ * directory if it couldn't be read
+ * @param message_data the message data
+ * @param message the StringBuffer the message was built in, empty on error. 
+ * It is recycled when done.
+ */
+static void
+send_file(MessageId *message_data, StringBuffer *message)
+{
+	if (message->length > 0) {
+		/* The message data is freed once it is done, the file is ours till then */
+		hold_file (message_data);
+		send_message (string_buffer_get_string (message), message_data);
+	} else {
+		/* Error parsing message, move to error directory */
+		metrics_count (METRIC_ERRORED, 1);
+		move_file (message_data, error_dir);
+		arena_pool_give (&message_arenas, message_data->arena);
+	}
+	string_buffer_recycle (message);
+}
+
+/*
+ * Sends the files that were found in the queue, with a batch of calls to
+ * open them and get their sizes, and one to read and close them
+ * @param message a StringBuffer to build the messages in
+ */
+static void
+read_files(StringBuffer *message)
+{
+	struct {
+		MessageId *message_data;
+		int file;
+		int found; /* the result of statx */
+		struct statx info;
+		char *data;
+		int got;
+	} files[IO_URING_BATCH];
+	int count = found_file_count;
+	long long took = metrics_clock (); /* to read them all */
+	int i;
+
+	if (count == 0) {
+		return;
+	}
+	found_file_count = 0;
+
+	/* Open them, and find their sizes */
+	for (i = 0; i < count; i++) {
+		int dir = queue_dir_fd (queue_dir, found_files[i].shard);
+		Arena *arena = arena_pool_take (&message_arenas); /* memory for this message */
+
+		files[i].message_data = arena != NULL ? create_message_data (arena) : NULL;
+		if (files[i].message_data == NULL) {
+			output("Error creating message data construct. Out of memeory?");
+			if (arena != NULL) {
+				arena_pool_give (&message_arenas, arena);
+			}
+			continue;
+		}
+		files[i].message_data->shard = found_files[i].shard;
+		files[i].message_data->read_time = time(NULL);
+		files[i].message_data->file_name = arena_strdup (arena, found_files[i].name);
+		if (files[i].message_data->file_name == NULL) {
+			output("Error creating part of the message data construct. Out of memory?");
+			arena_pool_give (&message_arenas, arena);
+			files[i].message_data = NULL;
+			continue;
+		}
+
+		file_ring_openat (file_ring, dir, files[i].message_data->file_name, O_RDONLY, 0, &files[i].file);
+		file_ring_statx (file_ring, dir, files[i].message_data->file_name, &files[i].info, &files[i].found);
+	}
+	if (file_ring_run (file_ring) == -1) {
+		output("Error opening the files: %s", strerror(errno));
+	}
+
+	/* Read them at once, in the messages' memory, and close them */
+	for (i = 0; i < count; i++) {
+		MessageId *message_data = files[i].message_data;
+
+		if (message_data == NULL) {
+			continue;
+		}
+		if (files[i].file < 0) {
+			if (files[i].file == -ENOENT) {
+				/* A file that is gone was already handled, no need to report it */
+				metrics_gauge_add (GAUGE_FILE_QUEUE, -1);
+			} else {
+				output("Error opening file: %s (in %s)", message_data->file_name, queue_dir->path);
+			}
+			arena_pool_give (&message_arenas, message_data->arena);
+			files[i].message_data = NULL;
+			continue;
+		}
+
+		files[i].data = NULL;
+		files[i].got = -1;
+		if (files[i].found == 0) {
+			files[i].data = (char *)arena_alloc (message_data->arena, files[i].info.stx_size + 1);
+		}
+		if (files[i].data != NULL) {
+			file_ring_read (file_ring, files[i].file, files[i].data, files[i].info.stx_size, &files[i].got);
+			file_ring_link (file_ring);
+		}
+		file_ring_close (file_ring, files[i].file, NULL);
+	}
+	if (file_ring_run (file_ring) == -1) {
+		output("Error reading the files: %s", strerror(errno));
+	}
+	took = metrics_clock () - took;
+
+	for (i = 0; i < count; i++) {
+		if (files[i].message_data == NULL) {
+			continue;
+		}
+		if (files[i].got >= 0) {
+			picked_up (took);
+			files[i].message_data->timeline.queued = (long long)files[i].info.stx_mtime.tv_sec * 1000000 
+			                                         + files[i].info.stx_mtime.tv_nsec / 1000;
+			build_message_from_data (files[i].data, files[i].got, message, files[i].message_data);
+		} else {
+			output("Error reading file");
+		}
+		send_file (files[i].message_data, message);
+	}
+}
+
+/*
+ * Sends a file found in the queue directory, see queue_dir_scan. With
+ * io_uring, it is sent with the next batch. While the push service is down,
+ * it is left in the queue. A file that is being sent already (e.g. waiting in
+ * the retry wheel) is skipped.
+ * @param context the StringBuffer to build the message in
+ * @param shard the shard the file is in
+ * @param name the name of the file
+ */
+static void
+queue_file(void *context, int shard, char *name)
+{
+	if (strlen(name) > NAME_MAX) {
+		return; /* Can't be a file name */
+	}
+	if (is_busy_file (shard, name)) {
+		return; /* Found again, it is ours until it is done, and counted */
+	}
+	metrics_gauge_add (GAUGE_FILE_QUEUE, 1);
+	if (! circuit_breaker_ready (&breaker, monotonic_time ())) {
+		/* The push service is down, leave it for later */
+		defer_file (shard, name);
+		return;
+	}
+	if (file_ring == NULL) {
+		handle_file (shard, name, (StringBuffer *)context);
+		return;
+	}
+
+	found_files[found_file_count].shard = shard;
+	strcpy(found_files[found_file_count].name, name);
+	if (++found_file_count == IO_URING_BATCH) {
+		read_files ((StringBuffer *)context);
+	}
+}
+
+/*
+ * Reads the files that were left in the queue while the push service was down
+ * again, and only them: the others in the queue are being sent, or were
+ * found already. If some of them couldn't be listed, the whole queue is
+ * scanned instead.
+ * @param sender the pointer to the Sender object
+ * @param message a StringBuffer to build the messages in
+ */
+static void
+queue_deferred_files(Sender *sender, StringBuffer *message)
+{
+	DeferredFile *file = deferred_files;
+	Arena *arena = deferred_arena;
+	int rescan = deferred_rescan;
+
+	/* Files left again from here on go in a new list */
+	deferred_arena = NULL;
+	forget_deferred_files ();
+
+	if (rescan) {
+		handle_file_queue (sender);
+	} else {
+		for (; file != NULL; file = file->next) {
+			metrics_gauge_add (GAUGE_FILE_QUEUE, -1); /* counted again by queue_file */
+			queue_file (message, file->shard, file->name);
+		}
+		read_files (message);
+		coalescer_flush (coalescer);
+	}
+	if (arena != NULL) {
+		arena_pool_give (&message_arenas, arena);
+	}
+}
+
+/*
+ * Signal handler, asks the daemon to stop
+ */
+static void
+stop_daemon(int signal_number)
+{
+	(void) signal_number;
+	keep_running = 0;
+}
+
+/*
+ * Runs pushr as a daemon. The messages already in the queue are sent first,
+ * then every new message is sent as soon as it is queued: files are picked up
+ * when inotify reports them, the MySQL table is polled every 
+ * DAEMON_MYSQL_INTERVAL milliseconds over a connection that is kept open, and
+ * the log queue every DAEMON_LOG_INTERVAL milliseconds.
+ * Runs until SIGTERM or SIGINT.
+ * @param sender the pointer to the Sender object
+ */
+void
+run_daemon(Sender *sender)
+{
+	Watcher *watcher = NULL;
+	Database *database = NULL;
+	LogQueue *log = NULL;
+	StringBuffer *message = string_buffer_create (250);
+	char *file_name;
+	int index;
+	long long next_poll = 0; /* when to poll the MySQL table */
+	long long next_log = 0; /* when to poll the log queue */
+	long long next_sync = 0; /* when to sync the response archive */
+
+	signal(SIGTERM, stop_daemon);
+	signal(SIGINT, stop_daemon);
+	in_daemon = 1;
+
+	if (USE_FILES && open_file_dirs () == 0) {
+		/* Start watching before the scan, so no file is missed in between.
+		 * The directory is watch 0, and its shards follow in order.
+		 */
+		watcher = watcher_create (queue_dir->path);
+		for (index = 0; watcher != NULL && index < queue_dir->shard_count; index++) {
+			StringBuffer *path = string_buffer_create (100);
+			char name[3];
+
+			string_buffer_append (path, queue_dir->path);
+			string_buffer_append_char (path, '/');
+			string_buffer_append (path, queue_dir_shard_name (index, name));
+			if (watcher_add (watcher, string_buffer_get_string (path)) == -1) {
+				watcher_free (watcher);
+				watcher = NULL;
+			}
+			string_buffer_free (path);
+		}
+		if (watcher == NULL) {
+			output("Error watching message queue directory: %s", strerror(errno));
+		}
+		handle_file_queue (sender);
+	}
+
+	if (USE_LOG) {
+		log = log_queue_open (PATH_LOG_QUEUE, LOG_ARCHIVE ? PATH_LOG_ARCHIVE : NULL);
+		if (log == NULL) {
+			output("Error opening the log queue directory (%s)", PATH_LOG_QUEUE);
+		}
+	}
+
+	if (! USE_MYSQL && watcher == NULL && log == NULL) {
+		output("Error: Nothing to watch.");
+		string_buffer_free (message);
+		in_daemon = 0;
+		return;
+	}
+
+	while (keep_running) {
+		int timeout = 1000; /* Check for the signal at least once a second */
+
+		if (USE_MYSQL) {
+			long long left = next_poll - monotonic_time ();
+			timeout = left < 0 ? 0 : (left < timeout ? left : timeout);
+		}
+		if (log != NULL) {
+			long long left = next_log - monotonic_time ();
+			timeout = left < 0 ? 0 : (left < timeout ? left : timeout);
+		}
+		if (retry_wheel.count > 0) {
+			long long left = timing_wheel_next (&retry_wheel, monotonic_time ());
+			timeout = left < timeout ? left : timeout;
+		}
+		if (files_deferred && watcher != NULL) {
+			long long left = circuit_breaker_wait (&breaker, monotonic_time ());
+			timeout = left >= 0 && left < timeout ? left : timeout;
+		}
+
+		if (sender_poll (sender, watcher != NULL ? watcher->fd : -1, timeout)) {
+			/* New files in the queue */
+			while ((file_name = watcher_next (watcher, &index)) != NULL) {
+				queue_file (message, index - 1, file_name);
+			}
+			read_files (message);
+			if (watcher->overflow) {
+				/* Events were lost, look for the files ourselves. The files
+				 * that were read are still in the queue until they are done:
+				 * send them and wait for them first, so the scan doesn't
+				 * find them again */
+				watcher->overflow = 0;
+				coalescer_flush (coalescer);
+				sender_flush (sender);
+				handle_file_queue (sender);
+			}
+			/* Don't hold them back, the files that came together are coalesced */
+			coalescer_flush (coalescer);
+		}
+
+		/* Send the messages that are due again */
+		if (retry_messages () > 0) {
+			coalescer_flush (coalescer);
+		}
+
+		/* Files were left in the queue while the push service was down, 
+		 * read them again once it may be back */
+		if (files_deferred && watcher != NULL && circuit_breaker_ready (&breaker, monotonic_time ())) {
+			queue_deferred_files (sender, message);
+		}
+
+		if (USE_MYSQL && monotonic_time () >= next_poll) {
+			if (database == NULL) {
+				database = database_connect ();
+			}
+			if (database != NULL && poll_database_queue (sender, database) == -1) {
+				/* Something is wrong with the connection, reconnect next time */
+				database_close (database);
+				database = NULL;
+			}
+			next_poll = monotonic_time () + DAEMON_MYSQL_INTERVAL;
+		}
+
+		if (log != NULL && monotonic_time () >= next_log) {
+			(void) poll_log_queue (sender, log);
+			next_log = monotonic_time () + DAEMON_LOG_INTERVAL;
+		}
+
+		/* Move the files of the messages that were done */
+		move_files ();
+		if (response_archive != NULL && monotonic_time () >= next_sync) {
+			if (response_archive_sync (response_archive) == -1) {
+				output("Couldn't sync the response archive (%s): %s", PATH_RESPONSE_ARCHIVE, strerror(errno));
+			}
+			next_sync = monotonic_time () + ARCHIVE_SYNC_INTERVAL;
+		}
+
+		/* Keep what we learned about the registration ids */
+		save_tokens ();
+		if (trace != NULL && trace_flush (trace) == -1) {
+			output("Couldn't write the trace (%s): %s", PATH_TRACE, strerror(errno));
+		}
+	}
+
+	output("Stopping...");
+	in_daemon = 0;
+	flush_messages (sender);
+
+	if (watcher != NULL) {
+		watcher_free (watcher);
+	}
+	if (database != NULL) {
+		/* The outcomes of the messages that were sent again */
+		if (db_write_results (database, &database_results) != 0) {
+			output("Couldn't write the results of the last MySQL messages");
+		}
+		database_close (database);
+	}
+	if (log != NULL) {
+		log_queue_close (log);
+	}
+	string_buffer_free (message);
+}
+
+/*
+ * Prints the record of a file in the response archive: the last one, if the
+ * file was sent more than once
+ * @param name the name of the file
+ * @return EXIT_SUCCESS if it was found, EXIT_FAILURE if it wasn't
+ */
+int
+find_response(char *name)
+{
+	StringBuffer *record = string_buffer_create (1024);
+	int found;
+
+	if (record == NULL) {
+		output("Out of memory?");
+		return EXIT_FAILURE;
+	}
+
+	found = response_archive_find (PATH_RESPONSE_ARCHIVE, name, record);
+	if (found == 1) {
+		fwrite(string_buffer_get_string (record), 1, record->length, stdout);
+	} else if (found == 0) {
+		output("No response for %s in the archive", name);
+	} else {
+		output("Error reading the response archive (%s): %s", PATH_RESPONSE_ARCHIVE, strerror(errno));
+	}
+
+	string_buffer_free (record);
+	return found == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Outputs messages.
+ * Since pushr is intended as a service of sorts, all output is directed to the
+ * stderr.
+ * @param message the message to output
+ */
+void
+output(char* format,...) 
+{
+	va_list args;
+	fprintf(stderr, "pushr: ");
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+}
+
+/*
+ * Creates the data of a message, in the message's arena
+ * @param arena the memory of the message, taken from the message arenas
+ * @return a pointer to the MessageId object, or NULL on error
+ */
+MessageId *
+create_message_data(Arena *arena)
+{
+	MessageId *message_data = (MessageId *)arena_alloc (arena, sizeof(MessageId));
+
+	if (message_data != NULL) {
+		memset(message_data, 0, sizeof(MessageId));
+		message_data->arena = arena;
+		message_data->timeline.picked = timeline_clock ();
+	}
+
+	return message_data;
+}
+
+/*
+ * Reads the registration ids of a message ("1", "2", "222") into its data. Ids
+ * that are known to be dead are left out, and ids that were replaced are
+ * swapped for their canonical ids.
+ * @param ids the registration ids, as given in the queue
+ * @param length the length of the ids (they need not be null-terminated)
+ * @param message_data the message data
+ */
+void
+parse_registration_ids(char *ids, size_t length, MessageId *message_data)
+{
+	char *end = ids + length;
+	char *start;
+	char *stop;
+
+	while (ids < end && (start = memchr(ids, '"', end - ids)) != NULL) {
+		size_t token_length;
+		char *token;
+
+		start++;
+		stop = memchr(start, '"', end - start);
+		if (stop == NULL) {
+			break; /* Not closed */
+		}
+		ids = stop + 1;
+
+		token_length = stop - start;
+		token = start;
+		if (token_store != NULL) {
+			token = token_store_resolve (token_store, start, stop - start, &token_length);
+			if (token == NULL) {
+				message_data->dropped++;
+				continue;
+			}
+		}
+
+		if (message_data->token_count == message_data->token_space) {
+			/* Grow the list, the old one stays in the arena */
+			int space = message_data->token_space > 0 ? message_data->token_space * 2 : 8;
+			char **tokens = (char **)arena_alloc (message_data->arena, space * sizeof(char *));
+			if (tokens == NULL) {
+				return;
+			}
+			if (message_data->token_count > 0) {
+				memcpy(tokens, message_data->tokens, message_data->token_count * sizeof(char *));
+			}
+			message_data->tokens = tokens;
+			message_data->token_space = space;
+		}
+
+		message_data->tokens[message_data->token_count] = (char *)arena_alloc (message_data->arena, token_length + 1);
+		if (message_data->tokens[message_data->token_count] == NULL) {
+			return;
+		}
+		memcpy(message_data->tokens[message_data->token_count], token, token_length);
+		message_data->tokens[message_data->token_count][token_length] = '\0';
+		message_data->token_count++;
+	}
+}
+
+/*
+ * Hands registration ids of a message to the Coalescer
+ * @param data the message data
+ * @param rest the fields that follow the registration ids
+ * @param tokens the registration ids
+ * @param count the number of registration ids
+ */
+static void
+queue_message(MessageId *data, char *rest, char **tokens, int count)
+{
+	/* Its parts may be done before coalescer_add returns, hold it till then */
+	data->held = 1;
+	data->pending += coalescer_add (coalescer, rest, tokens, count, (void *)data);
+	data->held = 0;
+	if (data->pending == 0) {
+		complete_message (data);
+	}
+}
+
+/*
+ * Hands the message to the Coalescer, that sends it, on its own or with
+ * other messages with the same payload. The response is handled by 
+ * handle_response when the request is done.
+ * @param message the message JSON, without the registration ids: the fields
+ * that follow them (each with its leading comma) and the closing brace
+ * @param data the message data, freed by finish_message
+ */
+void
+send_message(char *message, MessageId *data) 
+{
+	if (data->token_count == 0 && data->dropped > 0) {
+		/* Every registration id is known to be dead, there is no one to send
+		 * to. Answer for the push service */
+		StringBuffer *body = string_buffer_create_in (data->arena, 100);
+
+		if (body == NULL) {
+			finish_message (data, "", 0, message_verdict (0, data->dropped));
+			return;
+		}
+		string_buffer_append_format (body, "{\"multicast_id\":0,\"success\":0,\"failure\":%d,"
+		                             "\"canonical_ids\":0,\"results\":[]}", data->dropped);
+		finish_message (data, string_buffer_get_string (body), body->length, message_verdict (0, data->dropped));
+		return;
+	}
+
+	/* Keep the message, in case it is sent again */
+	if (USE_RETRIES) {
+		data->rest = arena_strdup (data->arena, message);
+	}
+	data->attempts = 1;
+	queue_message (data, message, data->tokens, data->token_count);
+}
+
+/*
+ * Sends the messages that are due to be sent again, with the registration ids
+ * that failed
+ * @return the number of messages sent
+ */
+int
+retry_messages()
+{
+	TimingWheelEntry *entry = timing_wheel_advance (&retry_wheel, monotonic_time ());
+	int count = 0;
+
+	while (entry != NULL) {
+		TimingWheelEntry *next = entry->next;
+		MessageId *data = (MessageId *)entry->data;
+
+		data->attempts++;
+		data->retry_after = 0;
+		data->unavailable = 0;
+		queue_message (data, data->rest, data->retry_tokens, data->retry_count);
+		count++;
+		entry = next;
+	}
+
+	return count;
+}
+
+/*
+ * Sends a request for one or more messages, called by the Coalescer. The
+ * request is kept in the Sender's arena, until it is done.
+ * @param context the pointer to the Sender object
+ * @param rest the fields that follow the registration ids
+ * @param parts the messages, in the order of their registration ids
+ * @param part_count the number of messages
+ * @param token_count the number of registration ids
+ */
+void
+dispatch_request(void *context, char *rest, CoalescedPart *parts, int part_count, int token_count)
+{
+	Sender *sender = (Sender *)context;
+	Arena *arena;
+	Request *request;
+	StringBuffer *body;
+	int probe;
+	int i;
+	int j;
+
+	if (! circuit_breaker_allow (&breaker, monotonic_time (), &probe)) {
+		/* The push service is down */
+		defer_parts (parts, part_count);
+		return;
+	}
+
+	arena = sender_arena (sender); /* memory for this request */
+	request = (Request *)arena_alloc (arena, sizeof(Request));
+	body = string_buffer_create_in (arena, strlen(rest) + 64 * token_count + 50);
+	if (request != NULL) {
+		request->parts = (CoalescedPart *)arena_alloc (arena, part_count * sizeof(CoalescedPart));
+	}
+	if (request == NULL || request->parts == NULL || body == NULL) {
+		output("Error creating the request. Out of memory?");
+		if (probe) {
+			/* It never probed, don't leave the breaker waiting for it */
+			(void) circuit_breaker_done (&breaker, 1, probe, monotonic_time ());
+		}
+		for (i = 0; i < part_count; i++) {
+			finish_message ((MessageId *)parts[i].message, "", 0, 0);
+		}
+		return;
+	}
+	request->arena = arena;
+	request->part_count = part_count;
+	request->token_count = token_count;
+	request->probe = probe;
+	memcpy(request->parts, parts, part_count * sizeof(CoalescedPart));
+
+	/* The registration ids of all the messages, then the rest of the message */
+	string_buffer_append_char (body, '{');
+	string_buffer_append (body, FIELD_REGISTRATION_IDS);
+	string_buffer_append (body, " : [");
+	for (i = 0; i < part_count; i++) {
+		for (j = 0; j < parts[i].count; j++) {
+			if (i > 0 || j > 0) {
+				string_buffer_append (body, ", ");
+			}
+			string_buffer_append_char (body, '\"');
+			string_buffer_append (body, parts[i].tokens[j]);
+			string_buffer_append_char (body, '\"');
+		}
+	}
+	string_buffer_append_char (body, ']');
+	string_buffer_append (body, rest);
+
+	request->started = timeline_clock ();
+	for (i = 0; i < part_count; i++) {
+		MessageTimeline *timeline = &((MessageId *)parts[i].message)->timeline;
+		if (timeline->started == 0) {
+			timeline->started = request->started;
+		}
+	}
+
+	if (! sender_submit (sender, string_buffer_get_string (body), (void *)request)) {
+		output("Error submitting message. Out of memory?");
+		/* We are calling the handle_response function to handle this
+		 * as well, so we can mark this job as failed */
+		handle_response ((void *)request, "", NULL, CURLE_OUT_OF_MEMORY);
+	}
+}
+
+/*
+ * Sends all the messages in the queue directory (and its shards)
+ * @param sender the pointer to the Sender object
+ */
+void
+handle_file_queue(Sender *sender)
+{
+	StringBuffer *message;
+
+	if (open_file_dirs () == -1) {
+		return;
+	}
+
+	/* Move the files that are done first, so they aren't found again. The
+	 * files that were left in the queue are found again too. */
+	move_files ();
+	forget_deferred_files ();
+
+	message = string_buffer_create (250);
+	/* Counted again: the files being sent, which the scan skips, and the rest by the scan */
+	metrics_gauge (GAUGE_FILE_QUEUE, busy_file_count);
+	if (queue_dir_scan (queue_dir, queue_file, message) == -1) {
+		output("Error reading message queue directory: %s", strerror(errno));
+	}
+	read_files (message);
+
+	/* Send what waits to be coalesced, and wait for the last requests */
+	flush_messages (sender);
+	save_tokens ();
+
+	string_buffer_free (message);
+}
+
+/*
+ * Sends a single message from the queue directory
+ * @param shard the shard of the queue directory the file is in, or -1
+ * @param file_name the name of the file
+ * @param message a StringBuffer to build the message in. It is recycled when done.
+ */
+void
+handle_file(int shard, char *file_name, StringBuffer *message)
+{
+	int file_desc = -1;
+	MessageId *message_data;
+	Arena *arena;
+
+	file_desc = openat(queue_dir_fd (queue_dir, shard), file_name, O_RDONLY);
+	if (file_desc == -1) {
+		if (errno == ENOENT) {
+			/* A file that is gone was already handled, no need to report it */
+			metrics_gauge_add (GAUGE_FILE_QUEUE, -1);
+		} else {
+			output("Error opening file: %s (in %s)", file_name, queue_dir->path);
+		}
+		return;
+	}
+
+	arena = arena_pool_take (&message_arenas); /* memory for this message */
+	if (arena == NULL) {
+		output("Error creating the message arena. Out of memory?");
+		close(file_desc);
+		return;
+	}
+	
+	message_data = create_message_data (arena);
+	if (message_data == NULL) {
+		output("Error creating message data construct. Out of memeory?");
+		close(file_desc);
+		arena_pool_give (&message_arenas, arena);
+		return;
+	}
+
+	message_data->shard = shard;
+	message_data->read_time = time(NULL);
+	message_data->file_name = arena_strdup (arena, file_name);
+	if (message_data->file_name == NULL) {
+		
+		output("Error creating part of the message data construct. Out of memory?");
+		close(file_desc);
+		arena_pool_give (&message_arenas, arena);
+		return;
+	}
+
+	build_message_from_file (file_desc, message, message_data);
+	close(file_desc); /* All read, the file is only moved from now on */
+
+	send_file (message_data, message);
+}
+
+/*
+ * Builds a message from a queue file. The file is read at once.
+ * @param file the file descriptor
+ * @param buffer the StringBuffer to build the message in: the fields that
+ * follow the registration ids, and the closing brace. Left empty on error.
+ * @param message_data the message data, gets the registration ids
+ */
+void
+build_message_from_file(int file, StringBuffer *buffer, MessageId *message_data)
+{
+	struct stat info;
+	char *data;
+	size_t size;
+	size_t done = 0;
+	ssize_t got = 0;
+	long long started = metrics_clock ();
+
+	if (fstat(file, &info) == -1) {
+		output("Error reading file");
+		return;
+	}
+	message_data->timeline.queued = (long long)info.st_mtim.tv_sec * 1000000 + info.st_mtim.tv_nsec / 1000;
+
+	/* The whole file, in the message's memory */
+	size = info.st_size;
+	data = (char *)arena_alloc (message_data->arena, size + 1);
+	if (data == NULL) {
+		output("Error allocating memory for the file. Out of memory?");
+		return;
+	}
+	while (done < size && (got = read(file, data + done, size - done)) > 0) {
+		done += got;
+	}
+	if (got == -1) {
+		output("Error reading file");
+		return;
+	}
+	picked_up (metrics_clock () - started);
+
+	build_message_from_data (data, done, buffer, message_data);
+}
+
+/*
+ * Builds a message in the format of a queue file. There is a field on every
+ * line: the registration ids, then the fields in file_fields. Every field is
+ * copied as it is, from its line.
+ * @param data the message
+ * @param length the length of the message (it need not be null-terminated)
+ * @param buffer the StringBuffer to build the message in: the fields that
+ * follow the registration ids, and the closing brace
+ * @param message_data the message data, gets the registration ids
+ */
+void
+build_message_from_data(char *data, size_t length, StringBuffer *buffer, MessageId *message_data)
+{
+	char *end = data + length;
+	char *line;
+	char *line_end;
+	unsigned int field;
+	long long started = metrics_clock ();
+
+	/* Build the message JSON, the registration ids are added when it is sent */
+	
+	/* Registration ids (String Array) */
+	line_end = memchr(data, '\n', end - data);
+	parse_registration_ids (data, (line_end != NULL ? line_end : end) - data, message_data);
+
+	/* The other fields, as long as there are more lines */
+	for (field = 0; line_end != NULL && field < sizeof(file_fields) / sizeof(file_fields[0]); field++) {
+		line = line_end + 1;
+		line_end = memchr(line, '\n', end - line);
+
+		string_buffer_append_char (buffer, ','); /* Field separation */
+		string_buffer_append (buffer, file_fields[field].name);
+		string_buffer_append (buffer, file_fields[field].open);
+		string_buffer_append_n (buffer, line, (line_end != NULL ? line_end : end) - line);
+		string_buffer_append (buffer, file_fields[field].close);
+	}
+	
+	string_buffer_append_char (buffer, '}');
+	metrics_time (STAGE_BUILD, metrics_clock () - started);
+}
+
+/*
+ * Sends all the messages in the log queue
+ * @param sender the pointer to the Sender object
+ */
+void
+handle_log_queue(Sender *sender)
+{
+	LogQueue *log = log_queue_open (PATH_LOG_QUEUE, LOG_ARCHIVE ? PATH_LOG_ARCHIVE : NULL);
+
+	if (log == NULL) {
+		output("Error opening the log queue directory (%s)", PATH_LOG_QUEUE);
+		return;
+	}
+
+	(void) poll_log_queue (sender, log);
+	log_queue_close (log);
+}
+
+/*
+ * Sends the messages appended to the log queue since the last time, and
+ * writes their outcomes to the results segments. The log is read a batch at 
+ * a time, and the checkpoint moves past a batch once it is done.
+ * @param sender the pointer to the Sender object
+ * @param log the pointer to the LogQueue object
+ * @return the number of messages handled, or -1 on error
+ */
+int
+poll_log_queue(Sender *sender, LogQueue *log)
+{
+	StringBuffer *message;
+	unsigned long skipped = log->skipped;
+	int total = 0;
+	int records;
+	long long started; /* when the records were read, or written back */
+
+	if (! circuit_breaker_ready (&breaker, monotonic_time ())) {
+		return 0; /* The push service is down, the messages wait in the log */
+	}
+
+	message = string_buffer_create (250);
+	started = metrics_clock ();
+	while ((records = log_queue_read (log)) > 0) {
+		long long took = metrics_clock () - started;
+		int handed = 0; /* records handed out, for the write back */
+		off_t offset = log->offset; /* where the batch starts */
+		unsigned long position;
+		size_t length;
+		char *record;
+
+		while (circuit_breaker_ready (&breaker, monotonic_time ()) 
+		       && (record = log_queue_next (log, &length, &position)) != NULL) {
+			Arena *arena = arena_pool_take (&message_arenas); /* memory for this message */
+			MessageId *message_data = arena != NULL ? create_message_data (arena) : NULL;
+			total++;
+			if (message_data == NULL) {
+				output("Error creating message data construct. Out of memeory?");
+				if (arena != NULL) {
+					arena_pool_give (&message_arenas, arena);
+				}
+				log_queue_defer (log, position); /* It is read again */
+				continue;
+			}
+			message_data->id = position;
+			message_data->log = log;
+			picked_up (took);
+			handed++;
+
+			build_message_from_data (record, length, message, message_data);
+			/* The message data is freed once it is done */
+			send_message (string_buffer_get_string (message), message_data);
+			string_buffer_recycle (message);
+		}
+
+		/* Wait for the last requests. In the daemon, the outcomes of the messages
+		 * that are sent again are written with a later batch, the checkpoint
+		 * stops at the first of them */
+		flush_messages (sender);
+		save_tokens ();
+		started = metrics_clock ();
+		if (log_queue_commit (log) == -1) {
+			output("Couldn't write the log queue results or checkpoint (%s)", PATH_LOG_QUEUE);
+		}
+		took = metrics_clock () - started;
+		if (handed == 0 && log->offset == offset) {
+			break; /* None could be handed out, try again later */
+		}
+		while (handed-- > 0) {
+			metrics_time (STAGE_WRITE_BACK, took);
+		}
+		started = metrics_clock ();
+		if (! circuit_breaker_ready (&breaker, monotonic_time ())) {
+			break; /* The push service is down, the rest waits in the log */
+		}
+	}
+
+	if (records == -1) {
+		output("Error reading the log queue: %s", strerror(errno));
+		total = -1;
+	}
+	if (log->skipped > skipped) {
+		output("Skipped %lu bytes of corrupt records in the log queue", log->skipped - skipped);
+	}
+
+	string_buffer_free (message);
+	return total;
+}
+
+/*
+ * Sends all the messages in the MySQL table
+ * @param sender the pointer to the Sender object
+ */
+void
+handle_database_queue(Sender *sender)
+{
+	/* Open database */
+	Database *database = database_connect ();
+
+	if (database != NULL) {
+		(void) poll_database_queue (sender, database);
+
+		/* Close database connection */
+		database_close (database);
+	}
+}
+
+/*
+ * Prepares a statement on the connection
+ * @param conn the MySQL connection
+ * @param sql the statement, with ? for the parameters
+ * @return the prepared statement, or NULL on error
+ */
+static MYSQL_STMT *
+database_prepare(MYSQL *conn, char *sql)
+{
+	MYSQL_STMT *statement = mysql_stmt_init(conn);
+
+	if (statement == NULL) {
+		output("Database statement error: %s", mysql_error(conn));
+		return NULL;
+	}
+
+	if (mysql_stmt_prepare(statement, sql, strlen(sql))) {
+		output("Database statement error: %s", mysql_stmt_error(statement));
+		mysql_stmt_close(statement);
+		return NULL;
+	}
+
+	return statement;
+}
+
+/*
+ * Binds a parameter (or a result column) of a statement
+ * @param param the parameter or column
+ * @param type the MySQL type of the value
+ * @param buffer where the value is
+ * @param length the length of the value (for strings), or NULL
+ */
+static void
+db_bind(MYSQL_BIND *param, enum enum_field_types type, void *buffer, unsigned long *length)
+{
+	memset(param, 0, sizeof(MYSQL_BIND));
+	param->buffer_type = type;
+	param->buffer = buffer;
+	param->length = length;
+	param->is_unsigned = type == MYSQL_TYPE_LONGLONG;
+}
+
+/*
+ * Connects to the MySQL server and prepares the statements we use, so they are
+ * parsed only once and their data travels in the binary protocol.
+ * @return a pointer to the Database object, or NULL on error
+ */
+Database *
+database_connect()
+{
+	MYSQL *conn = mysql_init(NULL);
+	Database *database;
+	StringBuffer *sql;
+	char host[32]; /* leaves room in the owner for the pid and the time */
+	int column;
+	int row;
+
+	if (! mysql_real_connect(conn, MYSQL_SERVER, MYSQL_USER, MYSQL_PASSWORD, MYSQL_SCHEMA, 0, NULL, 0)) {
+		output("Database connection error: %s", mysql_error(conn));
+		mysql_close(conn);
+		return NULL;
+	}
+
+	mysql_set_character_set(conn, "utf8mb4");
+
+	database = (Database *)calloc(1, sizeof(Database));
+	if (database == NULL) {
+		output("Error creating database construct. Out of memeory?");
+		mysql_close(conn);
+		return NULL;
+	}
+	database->connection = conn;
+
+	/* Our name in the LeaseOwner column, unique among the instances */
+	if (gethostname(host, sizeof(host)) != 0 && errno != ENAMETOOLONG) {
+		strcpy(host, "localhost");
+	}
+	host[sizeof(host) - 1] = '\0';
+	snprintf(database->owner, sizeof(database->owner), "%s:%d:%lx", host, (int)getpid(), (unsigned long)time(NULL));
+	database->owner_length = strlen(database->owner);
+
+	/* The claim. Rows another instance is claiming right now are locked, and
+	 * skipped instead of waited for. So are rows with a lease that is still on */
+	database->claim = database_prepare (conn, "SELECT Id FROM PushrMessages WHERE IsSent = 0 AND IsError = 0 "
+	                                    "AND (LeaseExpiry IS NULL OR LeaseExpiry < NOW()) "
+	                                    "ORDER BY Id LIMIT ? FOR UPDATE SKIP LOCKED");
+	if (database->claim == NULL) {
+		database_close (database);
+		return NULL;
+	}
+	database->claim_limit = DB_CLAIM_BATCH;
+	db_bind (&database->claim_param, MYSQL_TYPE_LONGLONG, &database->claim_limit, NULL);
+	db_bind (&database->claim_column, MYSQL_TYPE_LONGLONG, &database->id, NULL);
+	if (mysql_stmt_bind_param(database->claim, &database->claim_param) 
+	    || mysql_stmt_bind_result(database->claim, &database->claim_column)) {
+		output("Database statement error: %s", mysql_stmt_error(database->claim));
+		database_close (database);
+		return NULL;
+	}
+
+	/* The depth of the queue, for the metrics (see database_depth) */
+	if (USE_METRICS) {
+		database->depth = database_prepare (conn, "SELECT COUNT(*) FROM PushrMessages WHERE IsSent = 0 AND IsError = 0");
+		if (database->depth == NULL) {
+			database_close (database);
+			return NULL;
+		}
+		db_bind (&database->depth_column, MYSQL_TYPE_LONGLONG, &database->depth_count, NULL);
+		if (mysql_stmt_bind_result(database->depth, &database->depth_column)) {
+			output("Database statement error: %s", mysql_stmt_error(database->depth));
+			database_close (database);
+			return NULL;
+		}
+	}
+
+	/* The lease, for all the claimed rows (see database_claim) */
+	sql = string_buffer_create (DB_CLAIM_BATCH * 2 + 100);
+	if (sql == NULL) {
+		database_close (database);
+		return NULL;
+	}
+	string_buffer_append (sql, "UPDATE PushrMessages SET LeaseOwner = ?, LeaseExpiry = NOW() + INTERVAL ? SECOND "
+	                      "WHERE Id IN (?");
+	for (row = 1; row < DB_CLAIM_BATCH; row++) {
+		string_buffer_append (sql, ",?");
+	}
+	string_buffer_append_char (sql, ')');
+
+	database->lease = database_prepare (conn, string_buffer_get_string (sql));
+	string_buffer_free (sql);
+	database->lease_params = (MYSQL_BIND *)calloc(DB_CLAIM_BATCH + 2, sizeof(MYSQL_BIND));
+	if (database->lease == NULL || database->lease_params == NULL) {
+		database_close (database);
+		return NULL;
+	}
+	database->lease_time = DB_LEASE_TIME;
+	db_bind (&database->lease_params[0], MYSQL_TYPE_STRING, database->owner, &database->owner_length);
+	db_bind (&database->lease_params[1], MYSQL_TYPE_LONGLONG, &database->lease_time, NULL);
+
+	/* The queue poll, for the messages we hold. The Id is fetched as a number
+	 * and the other columns as text, straight into buffers that are kept for
+	 * the next rows */
+	database->poll = database_prepare (conn, "SELECT Id, RegistrationIds, NotificationKey, Data, CollapseKey, "
+	                                   "DelayWhileIdle, TimeToLive, PackageName, DryRun, " DB_QUEUED_COLUMN " FROM PushrMessages "
+	                                   "WHERE LeaseOwner = ? AND LeaseExpiry > NOW() AND IsSent = 0 AND IsError = 0 "
+	                                   "ORDER BY Id");
+	if (database->poll == NULL) {
+		database_close (database);
+		return NULL;
+	}
+	db_bind (&database->poll_param, MYSQL_TYPE_STRING, database->owner, &database->owner_length);
 
-		if (success) {
-			string_buffer_append (new_path, PATH_MSGS_SENT);
-			string_buffer_append (res_file, PATH_MSGS_SENT);
-		} else {
-			string_buffer_append (new_path, PATH_MSGS_ERROR);
-			string_buffer_append (res_file, PATH_MSGS_ERROR);
+	database->columns[0].buffer_type = MYSQL_TYPE_LONGLONG;
+	database->columns[0].buffer = &database->id;
+	database->columns[0].is_unsigned = 1;
+	database->columns[0].is_null = &database->nulls[0];
+	for (column = 1; column < DB_COLUMNS; column++) {
+		database->values[column] = string_buffer_create (250);
+		if (database->values[column] == NULL) {
+			database_close (database);
+			return NULL;
 		}
-		string_buffer_append_char (new_path, '/');
-		string_buffer_append (new_path, message_data->file_name);
-		string_buffer_append_char (res_file, '/');
-		string_buffer_append (res_file, message_data->file_name);
-		string_buffer_append (res_file, ".response");
+		database->columns[column].buffer_type = MYSQL_TYPE_STRING;
+		database->columns[column].buffer = database->values[column]->data;
+		database->columns[column].buffer_length = database->values[column]->space + 1;
+		database->columns[column].length = &database->lengths[column];
+		database->columns[column].is_null = &database->nulls[column];
+	}
+	if (mysql_stmt_bind_param(database->poll, &database->poll_param) 
+	    || mysql_stmt_bind_result(database->poll, database->columns)) {
+		output("Database statement error: %s", mysql_stmt_error(database->poll));
+		database_close (database);
+		return NULL;
+	}
 
-		if (rename(string_buffer_get_string (old_path), string_buffer_get_string (new_path)) == -1) {
-			output("Couldn't move file %s to its new location(%s)", 
-			       string_buffer_get_string (old_path), string_buffer_get_string (new_path));
+	/* The write back. Every row has its own WHEN in each CASE, and its Id in
+	 * the list (see db_write_results) */
+	sql = string_buffer_create (DB_UPDATE_BATCH * 65);
+	if (sql == NULL) {
+		database_close (database);
+		return NULL;
+	}
+	string_buffer_append (sql, "UPDATE PushrMessages SET IsSent = CASE Id");
+	for (row = 0; row < DB_UPDATE_BATCH; row++) {
+		string_buffer_append (sql, " WHEN ? THEN ?");
+	}
+	string_buffer_append (sql, " END, IsError = CASE Id");
+	for (row = 0; row < DB_UPDATE_BATCH; row++) {
+		string_buffer_append (sql, " WHEN ? THEN ?");
+	}
+	string_buffer_append (sql, " END, ServerResponse = CASE Id");
+	for (row = 0; row < DB_UPDATE_BATCH; row++) {
+		string_buffer_append (sql, " WHEN ? THEN ?");
+	}
+	string_buffer_append (sql, " END, Attempts = CASE Id");
+	for (row = 0; row < DB_UPDATE_BATCH; row++) {
+		string_buffer_append (sql, " WHEN ? THEN ?");
+	}
+	if (USE_TRACING) {
+		string_buffer_append (sql, " END, Timeline = CASE Id");
+		for (row = 0; row < DB_UPDATE_BATCH; row++) {
+			string_buffer_append (sql, " WHEN ? THEN ?");
 		}
+	}
+	string_buffer_append (sql, " END, Timestamp = NOW() WHERE Id IN (?");
+	for (row = 1; row < DB_UPDATE_BATCH; row++) {
+		string_buffer_append (sql, ",?");
+	}
+	string_buffer_append (sql, ") AND LeaseOwner = ?");
 
-		/* Write the server response to a file
-		 * Create the file and give the user and group read and write and only read permission to others
-		 */
-		res_file_desc = creat(string_buffer_get_string (res_file), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
-		if (res_file_desc != -1) {
-			/* write data to file */
-			write(res_file_desc, response, strlen(response));
-			close(res_file_desc);
-		} else {
-			output("Couldn't write response file (%s).", string_buffer_get_string (res_file));
-		}
-		
-		
-		/* Free resources */
-		string_buffer_free (old_path);
-		string_buffer_free (new_path);
-		string_buffer_free (res_file);
-		/* Free the file name resource */
-		free(message_data->file_name);
-	} else {
-		/* Data came from database, update it now.
-		 * The connction pointer comes from the message_data structure. We are
-		 * already connected and we shouldn't close the connection.
-		 */
-		char *isSent = success ? "1" : "0";
-		char *isError = success ? "0" : "1";
-		char *update_query = NULL;
-		char *escaped_response = (char *)malloc(strlen(response) * 2 + 1);
-		char id_string[22]; /* Used to convert the message id from long to string */
-		
-		if (escaped_response == NULL) {
-			/* Error allocation memory, use an empty string */
-			escaped_response = "";
-		} else {
-			(void) mysql_real_escape_string(message_data->mysql_connection, escaped_response, response, strlen(response));
-		}
-
-		/* The query creation function takes only strings as arguments. We first
-		 * convert the id from long to string and then we create the query string */
-		sprintf(id_string, "%ld", message_data->id);
-		update_query = db_create_query("UPDATE PushrMessages SET IsSent = %s, "
-		                               "IsError = %s, Timestamp = NOW(), ServerResponse = '%s' "
-		                               "WHERE Id = %s",
-		                               4, isSent, isError, escaped_response, id_string);
-
-		if (update_query != NULL) {
-			string_list_push (list, update_query);
-			/* Since the list copies the data, we need to free the source as it
-			 * is no longer needed */
-			free(update_query);
-			if (strlen(escaped_response) > 0) {
-				/* Not an empty string, we need to free it */
-				free(escaped_response);
-			}
-		} else {
-			/* Error allocating memory to the update query */
-			output("Error allocating memory for update query");
-		}
+	database->update = database_prepare (conn, string_buffer_get_string (sql));
+	string_buffer_free (sql);
+	database->params = (MYSQL_BIND *)calloc(DB_UPDATE_BATCH * (2 * DB_UPDATE_CASES + 1) + 1, sizeof(MYSQL_BIND));
+	if (database->update == NULL || database->params == NULL) {
+		database_close (database);
+		return NULL;
 	}
-	
-	free(message_data); /* And free the resources */
-	string_buffer_free (string);
-	return real_size; /* Return the number of chars handled. */
+
+	return database;
 }
 
 /*
- * This function is in charge of producing the data to be sent to the server.
- * It is being used by the cURL library which supplies the parameters.
- * As per the settings, userp is a pointer to the string to be sent.
- * @return the number of chars written
+ * Closes the MySQL connection and releases the statements
+ * @param database the pointer to the Database object
  */
-size_t
-send_data(char *bufptr, size_t size, size_t nitems, void *userp)
+void
+database_close(Database *database)
 {
-	size_t real_size = size * nitems;
-	char *message = (char *)userp;
-	size_t i; /* for the loop */
-	size_t message_length = strlen(message);
-	static size_t written = 0; /* counter for the message */
-	
+	int column;
 
-	for (i = 0; i < real_size; i++)
-	{
-		if (written < message_length) 
-		{
-			bufptr[i] = message[written];
-			written++;
-		} 
-		else
-		{
-			break;
+	if (database->claim != NULL) {
+		mysql_stmt_close(database->claim);
+	}
+	if (database->depth != NULL) {
+		mysql_stmt_close(database->depth);
+	}
+	if (database->lease != NULL) {
+		mysql_stmt_close(database->lease);
+	}
+	if (database->poll != NULL) {
+		mysql_stmt_close(database->poll);
+	}
+	if (database->update != NULL) {
+		mysql_stmt_close(database->update);
+	}
+	for (column = 1; column < DB_COLUMNS; column++) {
+		if (database->values[column] != NULL) {
+			string_buffer_free (database->values[column]);
 		}
 	}
-
-	
-	return i; /* Return the number of characters written */
+	free(database->lease_params);
+	free(database->params);
+	mysql_close(database->connection);
+	free(database);
 }
 
 /*
- * Outputs messages.
- * Since pushr is intended as a service of sorts, all output is directed to the
- * stderr.
- * @param message the message to output
+ * Fetches the next row of the queue poll. A column that does not fit in its
+ * buffer is fetched again, after the buffer grows (the buffer is kept).
+ * @param database the pointer to the Database object
+ * @param row where to point to the text of each column (NULL for a NULL value).
+ * The Id is in the id field of the Database object.
+ * @return 0 for a row, MYSQL_NO_DATA after the last one, 1 on error
  */
-void
-output(char* format,...) 
-{
-	va_list args;
-	fprintf(stderr, "pushr: ");
-	va_start(args, format);
-	vfprintf(stderr, format, args);
-	va_end(args);
-	fprintf(stderr, "\n");
-}
-
-void
-send_message(CURL *curl, struct curl_slist *headers, char *message, MessageId *data) 
+static int
+database_fetch(Database *database, char **row)
 {
-	CURLcode response;
-	
-	/* Set the requested url to the one of the push service */
-    curl_easy_setopt(curl, CURLOPT_URL, PUSH_POST_URL);
-    /* Allow following redirections */
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    /* Set our receive_data function to handle the data sent FROM the server */
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, receive_data); 
-	/* Send the file description to the data receiver function */
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)data);
-    /* Set our send_data function to handle the data sent TO the server */
-    curl_easy_setopt(curl, CURLOPT_READFUNCTION, send_data);
-	/* Send the message to the writer function */
-	curl_easy_setopt(curl, CURLOPT_READDATA, message);
-    /* Set the request to be HTTP POST */
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
-	/* Set content length based on the message's length */
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strlen(message));
-    /* Set the request heasers as per Google's requirments */
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-	
-	/* For debugging purposes: */
-	curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-                
-    /* Perform the request */
-    response = curl_easy_perform(curl);
-    if (response != CURLE_OK) {
-		/* An error has occured */
-        output("cURL Error: %s", curl_easy_strerror(response));
-		/* We are calling the receive_data function to handle this response
-		 * as well, so we can mark this job as failed */
-		receive_data(NULL, 0, 0, (void *)data);
-    }
-}
+	int status = mysql_stmt_fetch(database->poll);
+	int rebind = 0;
+	int column;
 
-void
-handle_file_queue(CURL *curl, struct curl_slist *headers)
-{
-	DIR *d = opendir(PATH_MSGS_QUEUE);
-	struct dirent *entry;
-	StringBuffer *message = string_buffer_create (250);
-	StringBuffer *full_path = string_buffer_create (100);
-	
-	if (d == NULL) 
-	{
-		output("Error opening message queue directory");
-		return;
+	if (status != 0 && status != MYSQL_DATA_TRUNCATED) {
+		return status;
 	}
 
-	while ((entry = readdir(d)) != NULL)
-	{
-		/* Handle file */
-		int file_desc = -1;
-		MessageId *message_data;
-		
-		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-			continue; /* Not actual files... */
-		}
-
-		string_buffer_append (full_path, PATH_MSGS_QUEUE);
-		string_buffer_append_char (full_path, '/');
-		string_buffer_append (full_path, entry->d_name);
-		if ((file_desc = open(string_buffer_get_string (full_path), O_RDONLY)) == -1) {
-			output("Error opening file: %s", string_buffer_get_string (full_path));
-			string_buffer_recycle (full_path);
-			continue;
-		}
-		string_buffer_recycle (full_path);
-		
-		message_data = (MessageId *)malloc(sizeof(MessageId));
-		if (message_data == NULL) {
-			output("Error creating message data construct. Out of memeory?");
-			continue;
-		}
+	row[0] = NULL;
+	for (column = 1; column < DB_COLUMNS; column++) {
+		StringBuffer *value = database->values[column];
+		MYSQL_BIND *bind = &database->columns[column];
+		unsigned long length = database->lengths[column];
 
-		message_data->file_desc = file_desc;
-		message_data->file_name = (char *)malloc(strlen(entry->d_name) + 1);
-		if (message_data->file_name == NULL) {
-			
-			output("Error creating part of the message data construct. Out of memory?");
-			free(message_data);
+		if (database->nulls[column]) {
+			row[column] = NULL;
 			continue;
 		}
-		(void) strcpy(message_data->file_name, entry->d_name); /* strcpy takes care of null-terminating the string */
-
-		build_message_from_file (file_desc, message);
 
-		if (message->length > 0) {
-			send_message (curl, headers, string_buffer_get_string (message), message_data);
-		} else {
-			/* Error parsing message, move to error directory */
-			StringBuffer *old_path = string_buffer_create (100);
-			StringBuffer *new_path = string_buffer_create (100);
-
-			string_buffer_append (old_path, PATH_MSGS_QUEUE);
-			string_buffer_append (old_path, message_data->file_name);
-			string_buffer_append (new_path, PATH_MSGS_ERROR);
-			string_buffer_append (new_path, message_data->file_name);
-
-			if (rename(string_buffer_get_string (old_path), string_buffer_get_string (new_path)) == -1)
-			{
-				output("Couldn't move file %s to its new location(%s)", 
-			   	 string_buffer_get_string (old_path), string_buffer_get_string (new_path));
+		if (length > value->space) {
+			string_buffer_recycle (value);
+			if (! string_buffer_reserve (value, length)) {
+				return 1;
 			}
-
-			string_buffer_free (old_path);
-			string_buffer_free (new_path);
+			bind->buffer = value->data;
+			bind->buffer_length = value->space + 1;
+			if (mysql_stmt_fetch_column(database->poll, bind, column, 0)) {
+				return 1;
+			}
+			rebind = 1;
 		}
-		string_buffer_recycle (message);
+		value->data[length] = '\0';
+		value->length = length;
+		row[column] = value->data;
 	}
-	
-	closedir(d);
 
-	string_buffer_free (message);
-	string_buffer_free (full_path);
+	/* The next rows go to the new buffers */
+	if (rebind && mysql_stmt_bind_result(database->poll, database->columns)) {
+		return 1;
+	}
+
+	return 0;
 }
 
-void
-build_message_from_file(int file, StringBuffer *buffer)
+/*
+ * Counts the messages of the table that are not sent yet, for the metrics
+ * @param database the pointer to the Database object
+ */
+static void
+database_depth(Database *database)
 {
-	FILE *message = fdopen(file, "r");
-	int in; /* character input */
-	int has_more_characters = 0; /* a flag to designate that we broke the loop */
-	
-	if (message == NULL) {
-		output("Error opening file");
+	if (database->depth == NULL || mysql_stmt_execute(database->depth)) {
 		return;
 	}
+	if (mysql_stmt_fetch(database->depth) == 0) {
+		metrics_gauge (GAUGE_MYSQL_QUEUE, (long)database->depth_count);
+	}
+	mysql_stmt_free_result(database->depth);
+}
 
-	/* Build the message JSON */
-	string_buffer_append_char (buffer, '{');
-	
-	/* Registration ids (String Array) */
-	string_buffer_append (buffer, FIELD_REGISTRATION_IDS);
-	string_buffer_append (buffer, " : [");
-	while ((in = fgetc(message)) != EOF) {
-		/* Detect when the line ends */
-		if (in == '\n') {
-			/* No more data for this field, break and set flag */
-			has_more_characters = 1;
-			break;
-		} else {
-			/* Append character to the message buffer */
-			string_buffer_append_char (buffer, in);
-		}
+/*
+ * Claims the next messages of the table for us. The rows are picked and locked
+ * in a short transaction (skipping the ones other instances are locking), and
+ * leased to us for DB_LEASE_TIME seconds. The lease keeps the other instances
+ * away while we send them, and runs out if we never write back.
+ * @param database the pointer to the Database object
+ * @return the number of messages claimed, or -1 on error
+ */
+static int
+database_claim(Database *database)
+{
+	MYSQL_BIND *params = database->lease_params;
+	int count = 0;
+	int status;
+	int row;
+
+	if (mysql_query(database->connection, "START TRANSACTION")) {
+		output("Database claim error: %s", mysql_error(database->connection));
+		return -1;
 	}
-	string_buffer_append_char (buffer, ']');
 
-	/* Notification key (String) */
-	if (has_more_characters) {
-		string_buffer_append_char (buffer, ','); /* Field separation */
-		string_buffer_append (buffer, FIELD_NOTIFICATION_KEY);
-		string_buffer_append (buffer, ": \"");
-		has_more_characters = 0; /* Reset flag */
-		while ((in = fgetc(message)) != EOF) {
-			/* Detect when the line ends */
-			if (in == '\n') {
-				/* No more data for this field, break and set flag */
-				has_more_characters = 1;
-				break;
-			} else {
-				/* Append character to the message buffer */
-				string_buffer_append_char (buffer, in);
-			}
-		}
-		string_buffer_append_char (buffer, '\"');
+	if (mysql_stmt_execute(database->claim)) {
+		output("Database claim error: %s", mysql_stmt_error(database->claim));
+		(void) mysql_rollback(database->connection);
+		return -1;
 	}
-	
-	/* Data (JSON Object) */
-	if (has_more_characters) {
-		string_buffer_append_char (buffer, ','); /* Field separation */
-		string_buffer_append (buffer, FIELD_DATA);
-		string_buffer_append (buffer, " : ");
-		has_more_characters = 0; /* Reset flag */
-		while ((in = fgetc(message)) != EOF) {
-			/* Detect when the line ends */
-			if (in == '\n') {
-				/* No more data for this field, break and set flag */
-				has_more_characters = 1;
-				break;
-			} else {
-				/* Append character to the message buffer */
-				string_buffer_append_char (buffer, in);
-			}
-		}
+	while ((status = mysql_stmt_fetch(database->claim)) == 0 && count < DB_CLAIM_BATCH) {
+		database->claimed[count] = database->id;
+		count++;
 	}
-	
-	/* Collapse key (String) */
-	if (has_more_characters) {
-		string_buffer_append_char (buffer, ','); /* Field separation */
-		string_buffer_append (buffer, FIELD_COLLAPSE_KEY);
-		string_buffer_append (buffer, " : \"");
-		has_more_characters = 0; /* Reset flag */
-		while ((in = fgetc(message)) != EOF) {
-			/* Detect when the line ends */
-			if (in == '\n') {
-				/* No more data for this field, break and set flag */
-				has_more_characters = 1;
-				break;
-			} else {
-				/* Append character to the message buffer */
-				string_buffer_append_char (buffer, in);
-			}
-		}
-		string_buffer_append_char (buffer, '\"');
+	if (status != 0 && status != MYSQL_NO_DATA) {
+		output("Database claim error: %s", mysql_stmt_error(database->claim));
+		count = -1;
 	}
-	
-	/* Idle delay (Boolean) */
-	if (has_more_characters) {
-		string_buffer_append_char (buffer, ','); /* Field separation */
-		string_buffer_append (buffer, FIELD_DELAY_WHILE_IDLE);
-		string_buffer_append (buffer, " : ");
-		has_more_characters = 0; /* Reset flag */
-		while ((in = fgetc(message)) != EOF) {
-			/* Detect when the line ends */
-			if (in == '\n') {
-				/* No more data for this field, break and set flag */
-				has_more_characters = 1;
-				break;
-			} else {
-				/* Append character to the message buffer */
-				string_buffer_append_char (buffer, in);
-			}
+	mysql_stmt_free_result(database->claim);
+
+	if (count > 0) {
+		/* When fewer were claimed, the last id fills the remaining places */
+		for (row = 0; row < DB_CLAIM_BATCH; row++) {
+			db_bind (&params[2 + row], MYSQL_TYPE_LONGLONG, &database->claimed[row < count ? row : count - 1], NULL);
 		}
-	}
-	
-	/* Time to live (Number) */
-	if (has_more_characters) {
-		string_buffer_append_char (buffer, ','); /* Field separation */
-		string_buffer_append (buffer, FIELD_TTL);
-		string_buffer_append (buffer, " : ");
-		has_more_characters = 0; /* Reset flag */
-		while ((in = fgetc(message)) != EOF) {
-			/* Detect when the line ends */
-			if (in == '\n') {
-				/* No more data for this field, break and set flag */
-				has_more_characters = 1;
-				break;
-			} else {
-				/* Append character to the message buffer */
-				string_buffer_append_char (buffer, in);
-			}
+		if (mysql_stmt_bind_param(database->lease, params) || mysql_stmt_execute(database->lease)) {
+			output("Database claim error: %s", mysql_stmt_error(database->lease));
+			count = -1;
 		}
 	}
-	
-	/* Package name (String) */
-	if (has_more_characters) {
-		string_buffer_append_char (buffer, ','); /* Field separation */
-		string_buffer_append (buffer, FIELD_RESTRICTED_PACKAGE);
-		string_buffer_append (buffer, " : \"");
-		has_more_characters = 0; /* Reset flag */
-		while ((in = fgetc(message)) != EOF) {
-			/* Detect when the line ends */
-			if (in == '\n') {
-				/* No more data for this field, break and set flag */
-				has_more_characters = 1;
-				break;
-			} else {
-				/* Append character to the message buffer */
-				string_buffer_append_char (buffer, in);
-			}
-		}
-		string_buffer_append_char (buffer, '\"');
+
+	if (count >= 0 && mysql_commit(database->connection)) {
+		output("Database claim error: %s", mysql_error(database->connection));
+		count = -1;
 	}
-	
-	/* Dry run (Boolean) */
-	if (has_more_characters) {
-		string_buffer_append_char (buffer, ','); /* Field separation */
-		string_buffer_append (buffer, FIELD_DRY_RUN);
-		string_buffer_append (buffer, " : ");
-		has_more_characters = 0; /* Reset flag */
-		while ((in = fgetc(message)) != EOF) {
-			/* Detect when the line ends */
-			if (in == '\n') {
-				/* No more data for this field, break and set flag */
-				has_more_characters = 1;
-				break;
-			} else {
-				/* Append character to the message buffer */
-				string_buffer_append_char (buffer, in);
-			}
-		}
+	if (count < 0) {
+		(void) mysql_rollback(database->connection);
 	}
-	
-	string_buffer_append_char (buffer, '}');
-	
-	/* The file will be closed after we send the message to the server */
+
+	return count;
 }
 
-void
-handle_database_queue(CURL *curl, struct curl_slist *headers)
+/*
+ * Sends the messages in the MySQL table, and writes back the results. The
+ * messages are claimed a batch at a time, so other instances can work on the
+ * table at the same time.
+ * @param sender the pointer to the Sender object
+ * @param database the pointer to the Database object
+ * @return the number of messages handled, or -1 on a database error
+ */
+int
+poll_database_queue(Sender *sender, Database *database)
 {
-	MYSQL *conn;
-	MYSQL_RES* results;
-	MYSQL_ROW row;
+	char *row[DB_COLUMNS]; /* the text of a row, as build_message_from_row reads it */
+	MYSQL_ROW fields = row;
 	StringBuffer *message = string_buffer_create (250);
-	char *update_command = NULL; /* For list iteration */
+	DatabaseResults *updates = &database_results; /* the outcomes of a batch, to write back */
+	int status; /* of the fetch */
 	int result_count = 1; /* Used in a loop */
+	int total = 0; /* All the messages handled */
+	long long took; /* to claim and select a batch */
 
-	/* Create StringList (to hold update commands) */
-	list = string_list_create ();
-	
-	/* Open database */
-	conn = mysql_init(NULL);
-
-	if (! mysql_real_connect(conn, MYSQL_SERVER, MYSQL_USER, MYSQL_PASSWORD, MYSQL_SCHEMA, 0, NULL, CLIENT_MULTI_STATEMENTS)) {
-		output("Database connection error: %s", mysql_error(conn));
-		return;
+	if (updates->arena == NULL) {
+		updates->arena = arena_create (0);
 	}
 
-	mysql_set_server_option(conn, MYSQL_OPTION_MULTI_STATEMENTS_ON);
-
-	mysql_set_character_set(conn, "utf8mb4");
-
 	/*
-	 * To catch messages and send them without significant delay, keep quering the 
-	 * server, till zero messages are returned. Then we can quit.
+	 * To catch messages and send them without significant delay, keep claiming
+	 * messages, till there are none left. Then we can quit.
 	 */
-	while (result_count > 0) {
-		/* Query messages tables for messages not sent and not marked as errors */
-		if (mysql_query(conn, "SELECT Id, RegistrationIds, NotificationKey, Data, CollapseKey, DelayWhileIdle, "
-			            "TimeToLive, PackageName, DryRun FROM PushrMessages WHERE IsSent = 0 AND IsError = 0")) {
+	if (USE_METRICS) {
+		database_depth (database);
+	}
+
+	while (result_count > 0 && circuit_breaker_ready (&breaker, monotonic_time ())) {
+		took = metrics_clock ();
+		result_count = database_claim (database);
+		if (result_count == -1) {
+			total = -1;
+			break;
+		} else if (result_count == 0 && ! rows_deferred) {
+			break; /* Nothing left for us */
+		}
+		rows_deferred = 0; /* The rows we hold are all polled again */
+
+		/* Query messages tables for the messages we claimed */
+		if (mysql_stmt_execute(database->poll)) {
 			/* Error */
-			output("Database query error: %s", mysql_error(conn));
-			/*mysql_close(conn);
-			return;*/
+			output("Database query error: %s", mysql_stmt_error(database->poll));
+			total = -1;
 			break;
 		}
+		took = metrics_clock () - took;
 
-		results = mysql_use_result(conn);
 		result_count = 0; /* Reset counter for each query */
 
-		if (results == NULL) {
-			output("Command returned null.");
-			mysql_free_result(results);
-			/*mysql_close(conn);
-			return;*/
-			break;
-		}
+		while ((status = database_fetch (database, row)) == 0) {
+			Arena *arena;
+			MessageId *message_data;
 
-		if (mysql_num_fields(results) == 0) {
-			output("No results for command.");
-			mysql_free_result(results);
-			/*mysql_close(conn);
-			return;*/
-			break;
-		}
+			if (is_busy_row (database->id)) {
+				continue; /* Still being sent, from an earlier batch */
+			}
+			arena = arena_pool_take (&message_arenas); /* memory for this message */
+			message_data = arena != NULL ? create_message_data (arena) : NULL;
+			result_count++;
+			if (message_data == NULL) {
+				output("Error creating message data construct. Out of memeory?");
+				if (arena != NULL) {
+					arena_pool_give (&message_arenas, arena);
+				}
+				continue;
+			}
+			message_data->id = database->id;
+			message_data->results = updates;
+			if (row[9] != NULL) {
+				message_data->timeline.queued = (long long)(strtod(row[9], NULL) * 1000000);
+			}
+			picked_up (took);
 
-		while ((row = mysql_fetch_row(results)) != NULL) {
-			build_message_from_row (&row, message);
+			build_message_from_row (&fields, message, message_data);
 			if (message->length > 0) {
-				MessageId *message_data = (MessageId *)malloc(sizeof(MessageId));
-				if (message_data == NULL) {
-					output("Error creating message data construct. Out of memeory?");
-					continue;
-				}
-				message_data->id = strtol(row[0], NULL, 10);
-				message_data->mysql_connection = conn;
-				message_data->file_name = NULL; /* It is not a file */
-				send_message (curl, headers, string_buffer_get_string (message), message_data);
-				string_buffer_recycle (message);
+				/* The message data is freed once it is done, the row is ours till then */
+				hold_row (message_data);
+				send_message (string_buffer_get_string (message), message_data);
+			} else {
+				arena_pool_give (&message_arenas, arena);
 			}
-			result_count++;
+			string_buffer_recycle (message);
 		}
-	
+		total += result_count;
+
+		if (status != MYSQL_NO_DATA) {
+			output("Database fetch error: %s", mysql_stmt_error(database->poll));
+		}
+
 		/* Free result resource */
-		mysql_free_result(results);
+		mysql_stmt_free_result(database->poll);
+
+		/* Wait for the last requests. In the daemon, the results of the messages
+		 * that are sent again are written with a later batch */
+		flush_messages (sender);
+
+		/* Now write the results back to the database */
+		save_tokens ();
+		if (db_write_results (database, updates) != 0 || status != MYSQL_NO_DATA) {
+			total = -1;
+			break;
+		}
+	}
+
+	/* The messages that were sent again since the last batch */
+	if (total != -1 && db_write_results (database, updates) != 0) {
+		total = -1;
+	}
+
+	string_buffer_free (message);
 
-		/* Now use the update command list to update the database */
-		update_command = string_list_get_next (list);
-		while (update_command != NULL) {
-			if (mysql_query(conn, update_command)) {
-				/* Error */
-				output("Database update query error: %s (%s)", mysql_error(conn), update_command);
+	return total;
+}
+
+/*
+ * Writes the results of a batch back to the PushrMessages table, in a single
+ * transaction. The prepared update takes DB_UPDATE_BATCH results at a time.
+ * When fewer are left, the last one fills the remaining places: it just
+ * matches its own row again.
+ * The results are released once written, even on error: those messages are
+ * still unsent in the table and will be picked up again.
+ * @param database the pointer to the Database object
+ * @param results the results of the batch
+ * @return 0 on success, -1 on error
+ */
+int
+db_write_results(Database *database, DatabaseResults *results)
+{
+	MYSQL_BIND *params = database->params;
+	struct DatabaseResult *first = results->first; /* first of the statement */
+	struct DatabaseResult *item; /* For list iteration */
+	int rows; /* rows in the statement */
+	int error = 0;
+	long long took = metrics_clock ();
+
+	if (results->count == 0) {
+		return 0; /* Nothing to write */
+	}
+
+	if (mysql_query(database->connection, "START TRANSACTION")) {
+		output("Database update query error: %s", mysql_error(database->connection));
+		error = -1;
+	}
+
+	while (first != NULL && error == 0) {
+		/* The parameters are in the order of the statement: the pairs of each
+		 * CASE, then the list of ids */
+		item = first;
+		for (rows = 0; rows < DB_UPDATE_BATCH; rows++) {
+			db_bind (&params[2 * rows], MYSQL_TYPE_LONGLONG, &item->id, NULL);
+			db_bind (&params[2 * rows + 1], MYSQL_TYPE_TINY, &item->sent, NULL);
+			db_bind (&params[2 * (DB_UPDATE_BATCH + rows)], MYSQL_TYPE_LONGLONG, &item->id, NULL);
+			db_bind (&params[2 * (DB_UPDATE_BATCH + rows) + 1], MYSQL_TYPE_TINY, &item->error, NULL);
+			db_bind (&params[2 * (2 * DB_UPDATE_BATCH + rows)], MYSQL_TYPE_LONGLONG, &item->id, NULL);
+			db_bind (&params[2 * (2 * DB_UPDATE_BATCH + rows) + 1], MYSQL_TYPE_STRING, item->response, &item->length);
+			db_bind (&params[2 * (3 * DB_UPDATE_BATCH + rows)], MYSQL_TYPE_LONGLONG, &item->id, NULL);
+			db_bind (&params[2 * (3 * DB_UPDATE_BATCH + rows) + 1], MYSQL_TYPE_LONG, &item->attempts, NULL);
+			if (USE_TRACING) {
+				db_bind (&params[2 * (4 * DB_UPDATE_BATCH + rows)], MYSQL_TYPE_LONGLONG, &item->id, NULL);
+				db_bind (&params[2 * (4 * DB_UPDATE_BATCH + rows) + 1], MYSQL_TYPE_STRING, item->timeline, 
+				         &item->timeline_length);
+			}
+			db_bind (&params[2 * DB_UPDATE_CASES * DB_UPDATE_BATCH + rows], MYSQL_TYPE_LONGLONG, &item->id, NULL);
+			if (rows + 1 < DB_UPDATE_BATCH && item->next != NULL) {
+				item = item->next;
 			}
-			update_command = string_list_get_next (list);
 		}
-		/* Recycle the list for the next potential loop */
-		string_list_recycle (list);
+		first = item->next;
+		/* Only if we still hold the message */
+		db_bind (&params[(2 * DB_UPDATE_CASES + 1) * DB_UPDATE_BATCH], MYSQL_TYPE_STRING, database->owner, 
+		         &database->owner_length);
+
+		if (mysql_stmt_bind_param(database->update, params) || mysql_stmt_execute(database->update)) {
+			output("Database update query error: %s", mysql_stmt_error(database->update));
+			error = -1;
+		}
+	}
+
+	if (error == 0 && mysql_commit(database->connection)) {
+		output("Database update query error: %s", mysql_error(database->connection));
+		error = -1;
+	}
+	if (error != 0) {
+		(void) mysql_rollback(database->connection);
+	}
+
+	took = metrics_clock () - took;
+	for (rows = 0; rows < results->count; rows++) {
+		metrics_time (STAGE_WRITE_BACK, took);
 	}
-	
-	/* Close database connection */
-	mysql_close(conn);
 
-	/* Free the StringList */
-	string_list_free (list);
+	/* Release the results for the next batch */
+	arena_reset (results->arena);
+	results->first = NULL;
+	results->last = NULL;
+	results->count = 0;
+
+	return error;
 }
 
 void
-build_message_from_row(MYSQL_ROW *row, StringBuffer *buffer)
+build_message_from_row(MYSQL_ROW *row, StringBuffer *buffer, MessageId *message_data)
 {
-	/* Build the message JSON */
-	string_buffer_append_char (buffer, '{');
+	long long started = metrics_clock ();
+
+	/* Build the message JSON, the registration ids are added when it is sent */
 	
 	/* Registration ids (String Array) */
-	string_buffer_append (buffer, FIELD_REGISTRATION_IDS);
-	string_buffer_append (buffer, " : [");
-	string_buffer_append (buffer, (*row)[1]);
-	string_buffer_append_char (buffer, ']');
+	if ((*row)[1] != NULL) {
+		parse_registration_ids ((*row)[1], strlen((*row)[1]), message_data);
+	}
 
 	/* Notification key (String) */
 	if ((*row)[2] != NULL) {
@@ -783,19 +3098,21 @@ build_message_from_row(MYSQL_ROW *row, StringBuffer *buffer)
 	}
 	
 	string_buffer_append_char (buffer, '}');
+	metrics_time (STAGE_BUILD, metrics_clock () - started);
 }
 
 /*
  * Helper function to dynamically create the query string.
- * Don't forget to free the string when you are done.
+ * Don't forget to free the string when you are done, if it is not in an arena.
  * Important: Parameters can be only strings (for now) !!!
+ * @param arena the Arena to allocate the query from, or NULL to use malloc
  * @param template the printf-style template
  * @param count the number of arguments to follow
  * @param ... the arguments for the template
  * @return a pointer to a malloc'd string containing the query
  */
 char *
-db_create_query(char *template, int count, ...) {
+db_create_query(Arena *arena, char *template, int count, ...) {
 	va_list args, args2;
 	int length;
 	char *query = NULL;
@@ -811,7 +3128,7 @@ db_create_query(char *template, int count, ...) {
 	}
 	va_end(args);
 
-	query = (char *) malloc(length + 1);
+	query = arena != NULL ? (char *) arena_alloc (arena, length + 1) : (char *) malloc(length + 1);
 	if (query == NULL) {
 		/* Error - not enough memory? */
 		output("Creating query error - not enough memory");
@@ -826,7 +3143,8 @@ db_create_query(char *template, int count, ...) {
 }
 
 /* Dirty JSON parse function. The server returns a JSON. We need to parse it to
- * determine how many successes we had vs. how many fails.
+ * determine how many successes we had vs. how many fails. The responses we send
+ * are parsed as they arrive (see gcmresponse.h), this is for a whole string.
  * @param json_string the JSON string to parse
  * @param successes pointer to an int that will hold the nunber of successful sends
  * @param fails pointer to an int that will hold the number of fails sends.
@@ -834,32 +3152,20 @@ db_create_query(char *template, int count, ...) {
 void
 json_dirty_parse(char *json_string, int *successes, int *fails)
 {
-	const char *success_field = "\"success\":";
-	const char *failure_field = ",\"failure\":";
+	Arena *arena = arena_create (0);
+	GcmResponse response;
 
-	char *pos = strstr(json_string, success_field);
-	
-	if (pos == NULL) {
-		/* The success was not found in the JSON string.
-		 * We don't know how to handle this, so set it as an error */
+	if (arena == NULL) {
+		/* We can't tell, so set it as an error */
 		*successes = 0;
 		*fails = 1;
-	} else {
-		/* Advance the cursor to the start of the number. */
-		pos += strlen(success_field);
-		*successes = atoi(pos);
+		return;
 	}
 
-	pos = strstr(json_string, failure_field);
-	
-	if (pos == NULL) {
-		/* The field is missing. This is not the JSON string we are used to so
-		 * we'll mark it as an error */
-		*successes = 0;
-		*fails = 1;
-	} else {
-		/* Advance the cursor to the start of the number */
-		pos += strlen(failure_field);
-		*fails = atoi(pos);
-	}
+	gcm_response_init (&response, arena);
+	(void) gcm_response_feed (&response, json_string, strlen(json_string));
+	(void) gcm_response_finish (&response);
+	gcm_response_counts (&response, successes, fails);
+
+	arena_free (arena);
 }
@@ -12,55 +12,239 @@
 #define FIELD_AUTHORIZATION "Authorization: key="
 
 #define PUSH_POST_URL "https://android.googleapis.com/gcm/send"
+#define ENV_PUSH_URL "PUSHR_URL" /* the environment variable that overrides PUSH_POST_URL */
 #define REQUEST_CONTENT_TYPE "Content-Type:application/json"
 
 #include <curl/curl.h>
 #include <mysql/mysql.h>
 #include <stdarg.h>
+#include <stdbool.h>
 
+#include "settings.h"
 #include "stringbuffer.h"
 #include "stringlist.h"
+#include "sender.h"
+#include "arena.h"
+#include "gcmresponse.h"
+#include "coalescer.h"
+#include "logqueue.h"
+#include "queuedir.h"
+#include "responsearchive.h"
+#include "timingwheel.h"
+#include "circuitbreaker.h"
+#include "metrics.h"
+#include "trace.h"
+
+/* MySQL 8 replaced my_bool with bool */
+#if defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 80000 && ! defined(MARIADB_BASE_VERSION)
+typedef bool my_bool;
+#endif
+
+#define DB_COLUMNS 10 /* the columns of a message row */
+#define DB_UPDATE_CASES (USE_TRACING ? 5 : 4) /* the columns the update writes, each with a CASE */
+
+/* When a message was queued, with USE_TRACING */
+#if USE_TRACING
+#define DB_QUEUED_COLUMN "UNIX_TIMESTAMP(CreatedAt)"
+#else
+#define DB_QUEUED_COLUMN "NULL"
+#endif
+
+#define DB_OWNER_LENGTH 63 /* the longest LeaseOwner */
 
+#define RETRY_TICK 100 /* how precise the retry times are, in milliseconds */
+#define BUSY_FILE_BUCKETS 4096 /* of the files that are being sent, see busy_files */
+#define BUSY_ROW_BUCKETS 1024 /* of the MySQL messages that are being sent, see busy_rows */
+#define XATTR_ATTEMPTS "user.pushr.attempts" /* the attempts of a file that was sent again */
+#define XATTR_TIMELINE "user.pushr.timeline" /* the timeline of a file, with USE_TRACING */
+
+/* The MySQL connection and its prepared statements */
+typedef struct {
+	MYSQL *connection;
+	char owner[DB_OWNER_LENGTH + 1]; /* who we are in the LeaseOwner column */
+	unsigned long owner_length;
+	MYSQL_STMT *claim; /* locks up to DB_CLAIM_BATCH unclaimed messages */
+	MYSQL_BIND claim_param;
+	MYSQL_BIND claim_column;
+	unsigned long long claim_limit;
+	unsigned long long claimed[DB_CLAIM_BATCH]; /* the ids of the messages */
+	MYSQL_STMT *depth; /* counts the messages not sent yet, for the metrics */
+	MYSQL_BIND depth_column;
+	unsigned long long depth_count;
+	MYSQL_STMT *lease; /* marks them as ours for DB_LEASE_TIME seconds */
+	MYSQL_BIND *lease_params;
+	unsigned long long lease_time;
+	MYSQL_STMT *poll; /* selects the messages we hold */
+	MYSQL_BIND poll_param;
+	MYSQL_BIND columns[DB_COLUMNS]; /* where the rows are fetched into */
+	StringBuffer *values[DB_COLUMNS]; /* the text of each column */
+	unsigned long lengths[DB_COLUMNS];
+	my_bool nulls[DB_COLUMNS];
+	unsigned long long id; /* the Id column, fetched as a number */
+	MYSQL_STMT *update; /* writes back DB_UPDATE_BATCH results at a time */
+	MYSQL_BIND *params; /* the parameters of the update */
+} Database;
+
+/* The outcome of a message from the MySQL table, waiting to be written back.
+ * The fields are bound as they are to the update statement. */
+struct DatabaseResult {
+	unsigned long long id;
+	signed char sent;
+	signed char error;
+	char *response; /* the server response */
+	unsigned long length; /* and its length */
+	int attempts; /* how many times it was sent */
+	char *timeline; /* the timeline, in JSON, with USE_TRACING */
+	unsigned long timeline_length;
+	struct DatabaseResult *next;
+};
+
+/* The outcomes of a batch of MySQL messages, written back together */
 typedef struct {
-	int file_desc;
+	Arena *arena; /* holds the results, reset after they are written */
+	struct DatabaseResult *first;
+	struct DatabaseResult *last;
+	int count;
+} DatabaseResults;
+
+/* The timeline of a message, in microseconds since the epoch (0 when not
+ * known). Apart from when it was queued, the times are taken from the
+ * monotonic clock, set to the wall clock of when pushr started, so they
+ * never go back. */
+typedef struct {
+	long long queued; /* the modification time of the file, or the CreatedAt column */
+	long long picked; /* when it was taken off the queue */
+	long long started; /* when its first request started */
+	long long first_byte; /* when the first byte of the last response came */
+	long long done; /* when its outcome was known */
+} MessageTimeline;
+
+/* A file left in the queue while the push service was down */
+typedef struct DeferredFile {
+	struct DeferredFile *next;
+	int shard; /* the shard of the queue directory it is in, or -1 */
+	char *name;
+} DeferredFile;
+
+typedef struct MessageId {
+	Arena *arena; /* the memory of this message, taken from a pool */
 	char *file_name;
-	unsigned long id;
-	MYSQL *mysql_connection;
+	int shard; /* the shard of the queue directory the file is in, or -1 */
+	time_t read_time; /* when the file was read */
+	unsigned long id; /* the MySQL Id, or the offset of the log record */
+	DatabaseResults *results; /* where to list the MySQL outcome */
+	LogQueue *log; /* the log queue it came from, if it did */
+	char **tokens; /* the registration ids it is sent to, in the order of the results */
+	int token_count;
+	int token_space;
+	int dropped; /* registration ids left out, they are known to be dead */
+	int pending; /* parts sent, and not yet answered */
+	int held; /* set while it is handed to the Coalescer, it is not done before */
+	int answered; /* parts the push service answered */
+	unsigned long long multicast_id; /* of the first answered part */
+	GcmResult *token_results; /* the result of every registration id, as the parts are answered */
+	char *response; /* the response when it was sent whole, or of the first part that failed */
+	size_t response_length;
+	int success; /* the verdict when it was sent whole */
+	char *rest; /* the fields that follow the registration ids, to send it again */
+	int attempts; /* how many times it was sent */
+	char **retry_tokens; /* the registration ids sent again, and where they are in tokens */
+	int *retry_map;
+	int retry_count;
+	long retry_after; /* the longest Retry-After of the last attempt, in seconds */
+	int unavailable; /* set when the last attempt failed in a way that may not last */
+	TimingWheelEntry retry_entry; /* in the retry wheel, while it waits to be sent again */
+	struct MessageId *busy_next; /* in the files or rows that are being sent, see busy_files */
+	int deferred; /* set when the push service is down, it is left in the queue */
+	MessageTimeline timeline;
 } MessageId;
 
+/* A request to the push service, for one message, several coalesced ones, or
+ * a part of a split one */
+typedef struct {
+	Arena *arena; /* the memory of this request, see sender_arena */
+	CoalescedPart *parts; /* the messages, in the order of their registration ids */
+	int part_count;
+	int token_count;
+	int probe; /* the generation of the breaker when it probes the push service, or 0, see CircuitBreaker */
+	long long started; /* when it was submitted, see MessageTimeline */
+} Request;
+
 void
 output(char* format, ...);
 
+int
+find_response(char *name);
+
+MessageId *
+create_message_data(Arena *arena);
+
+void
+parse_registration_ids(char *ids, size_t length, MessageId *message_data);
+
+void
+send_message(char *message, MessageId *message_data);
+
+int
+retry_messages();
+
+void
+dispatch_request(void *context, char *rest, CoalescedPart *parts, int part_count, int token_count);
+
+void
+finish_message(MessageId *message_data, char *response, size_t length, int success);
+
+void
+handle_response(void *userp, char *buffer, GcmResponse *parsed, CURLcode result);
+
+void
+run_daemon(Sender *sender);
+
+void
+handle_file_queue(Sender *sender);
+
 void
-send_message(CURL *curl, struct curl_slist *headers, char *message, MessageId *message_data);
+forget_deferred_files();
 
-size_t 
-receive_data(void *buffer, size_t size, size_t nmemb, void *userp); 
+void
+handle_file(int shard, char *file_name, StringBuffer *message);
 
-size_t
-send_data(char *bufptr, size_t size, size_t nitems, void *userp); 
+void
+build_message_from_file(int file, StringBuffer *buffer, MessageId *message_data);
 
 void
-handle_file_queue(CURL *curl, struct curl_slist *headers);
+build_message_from_data(char *data, size_t length, StringBuffer *buffer, MessageId *message_data);
 
 void
-build_message_from_file(int file, StringBuffer *buffer);
+handle_log_queue(Sender *sender);
+
+int
+poll_log_queue(Sender *sender, LogQueue *log);
 
 void
-handle_database_queue(CURL *curl, struct curl_slist *headers);
+handle_database_queue(Sender *sender);
+
+Database *
+database_connect();
 
 void
-build_message_from_row(MYSQL_ROW *row, StringBuffer *buffer);
+database_close(Database *database);
+
+int
+poll_database_queue(Sender *sender, Database *database);
+
+void
+build_message_from_row(MYSQL_ROW *row, StringBuffer *buffer, MessageId *message_data);
+
+int
+db_write_results(Database *database, DatabaseResults *results);
 
 /* DB Helper function */
 char *
-db_create_query(char *template, int count, ...);
+db_create_query(Arena *arena, char *template, int count, ...);
 
 /* Dirty JSON parse function */
 void
 json_dirty_parse(char *json_string, int *successes, int *fails);
 
-/* Global variables : */
-StringList *list = NULL; /* StringList to hold MySQL update commands */
-
 #endif
@@ -0,0 +1,232 @@
+#include "queuedir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/* A directory entry, as getdents64 returns it */
+struct queue_dir_entry {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+ * Opens a directory, and its shards. Missing shards are created.
+ * @param path the directory
+ * @param shard_count how many shards it is split in (up to
+ * QUEUE_DIR_MAX_SHARDS), or 0
+ * @return a pointer to the QueueDir, or NULL on error (check errno)
+ */
+QueueDir *
+queue_dir_open(char *path, int shard_count)
+{
+	QueueDir *dir = (QueueDir *)calloc(1, sizeof(QueueDir));
+	int i;
+
+	if (dir == NULL) {
+		return NULL;
+	}
+	if (shard_count > QUEUE_DIR_MAX_SHARDS) {
+		shard_count = QUEUE_DIR_MAX_SHARDS;
+	}
+
+	dir->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir->path = strdup(path);
+	if (dir->fd == -1 || dir->path == NULL) {
+		queue_dir_close (dir);
+		return NULL;
+	}
+
+	if (shard_count > 0) {
+		dir->shards = (int *)malloc(shard_count * sizeof(int));
+		if (dir->shards == NULL) {
+			queue_dir_close (dir);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < shard_count; i++) {
+		char name[3];
+
+		queue_dir_shard_name (i, name);
+		if (mkdirat(dir->fd, name, 0775) == -1 && errno != EEXIST) {
+			queue_dir_close (dir);
+			return NULL;
+		}
+		dir->shards[i] = openat(dir->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir->shards[i] == -1) {
+			queue_dir_close (dir);
+			return NULL;
+		}
+		dir->shard_count++;
+	}
+
+	return dir;
+}
+
+/*
+ * Returns the descriptor of a shard, to open or move files relative to
+ * @param dir the pointer to the QueueDir object
+ * @param shard the shard, or -1 for the directory itself
+ * @return the descriptor
+ */
+int
+queue_dir_fd(QueueDir *dir, int shard)
+{
+	return shard < 0 ? dir->fd : dir->shards[shard];
+}
+
+/*
+ * Returns the shard a file belongs in
+ * @param dir the pointer to the QueueDir object
+ * @param name the name of the file
+ * @return the shard, or -1 when the directory is not split
+ */
+int
+queue_dir_shard(QueueDir *dir, const char *name)
+{
+	unsigned int hash = 2166136261u; /* FNV-1a */
+
+	if (dir->shard_count == 0) {
+		return -1;
+	}
+
+	while (*name != '\0') {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash % dir->shard_count;
+}
+
+/*
+ * Writes the name of a shard's subdirectory
+ * @param shard the shard
+ * @param name where to write it, room for 3 characters
+ * @return name
+ */
+char *
+queue_dir_shard_name(int shard, char *name)
+{
+	snprintf(name, 3, "%02x", shard);
+	return name;
+}
+
+/*
+ * Checks whether an entry is a directory
+ * @param fd the directory it is in
+ * @param entry the entry
+ * @return 1 if it is a directory, 0 if it is not
+ */
+static int
+queue_dir_is_dir(int fd, struct queue_dir_entry *entry)
+{
+	struct stat info;
+
+	if (entry->d_type != DT_UNKNOWN) {
+		return entry->d_type == DT_DIR;
+	}
+
+	/* The file system doesn't say */
+	return fstatat(fd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(info.st_mode);
+}
+
+/*
+ * Hands every file in a directory to the handler. Subdirectories (the shards)
+ * are skipped.
+ * @param fd the directory
+ * @param shard the shard, for the handler
+ * @param buffer where to read the entries, QUEUE_DIR_SCAN_BUFFER long
+ * @param handler the function to call for every file
+ * @param context passed to handler
+ * @return 0 on success, -1 on error
+ */
+static int
+queue_dir_scan_fd(int fd, int shard, char *buffer, QueueDirHandler handler, void *context)
+{
+	long length;
+
+	/* The descriptor is kept open, start from the top */
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		return -1;
+	}
+
+	while ((length = syscall(SYS_getdents64, fd, buffer, QUEUE_DIR_SCAN_BUFFER)) > 0) {
+		long offset = 0;
+
+		while (offset < length) {
+			struct queue_dir_entry *entry = (struct queue_dir_entry *)(buffer + offset);
+			offset += entry->d_reclen;
+
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+				continue; /* Not actual files... */
+			}
+			if (queue_dir_is_dir (fd, entry)) {
+				continue;
+			}
+			handler(context, shard, entry->d_name);
+		}
+	}
+
+	return length == 0 ? 0 : -1;
+}
+
+/*
+ * Hands every file in the directory and its shards to the handler. The
+ * handler may move the file away.
+ * @param dir the pointer to the QueueDir object
+ * @param handler the function to call for every file
+ * @param context passed to handler
+ * @return 0 on success, -1 if a directory couldn't be read
+ */
+int
+queue_dir_scan(QueueDir *dir, QueueDirHandler handler, void *context)
+{
+	char *buffer = (char *)malloc(QUEUE_DIR_SCAN_BUFFER);
+	int status;
+	int i;
+
+	if (buffer == NULL) {
+		return -1;
+	}
+
+	/* Files that were queued without a shard first */
+	status = queue_dir_scan_fd (dir->fd, -1, buffer, handler, context);
+	for (i = 0; i < dir->shard_count; i++) {
+		if (queue_dir_scan_fd (dir->shards[i], i, buffer, handler, context) == -1) {
+			status = -1;
+		}
+	}
+
+	free(buffer);
+	return status;
+}
+
+/*
+ * Closes the directory and its shards
+ * @param dir the pointer to the QueueDir object
+ */
+void
+queue_dir_close(QueueDir *dir)
+{
+	int i;
+
+	for (i = 0; i < dir->shard_count; i++) {
+		close(dir->shards[i]);
+	}
+	if (dir->fd != -1) {
+		close(dir->fd);
+	}
+	free(dir->shards);
+	free(dir->path);
+	free(dir);
+}
@@ -0,0 +1,47 @@
+/*
+ * A QueueDir is a directory of message files (the queue, sent or error
+ * directory), that can be split in shards: subdirectories named 00, 01, ...
+ * in two hex digits. A file belongs in the shard of the FNV-1a hash of its
+ * name, modulo the number of shards. The directory and its shards are kept
+ * open, and files are opened and moved relative to them, so their paths are
+ * never looked up again.
+ */
+
+#ifndef _QUEUEDIR_H_
+#define _QUEUEDIR_H_
+
+/* Two hex digits name the shards */
+#define QUEUE_DIR_MAX_SHARDS 256
+
+/* Directory entries are read in chunks of this size */
+#define QUEUE_DIR_SCAN_BUFFER (256 * 1024)
+
+typedef struct {
+	char *path;
+	int fd; /* the directory itself */
+	int *shards; /* the descriptors of the shards */
+	int shard_count; /* 0 when it is not split */
+} QueueDir;
+
+/* Handles a file found in a scan. shard is -1 for the directory itself. */
+typedef void (*QueueDirHandler)(void *context, int shard, char *name);
+
+QueueDir *
+queue_dir_open(char *path, int shard_count);
+
+int
+queue_dir_fd(QueueDir *dir, int shard);
+
+int
+queue_dir_shard(QueueDir *dir, const char *name);
+
+char *
+queue_dir_shard_name(int shard, char *name);
+
+int
+queue_dir_scan(QueueDir *dir, QueueDirHandler handler, void *context);
+
+void
+queue_dir_close(QueueDir *dir);
+
+#endif
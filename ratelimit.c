@@ -0,0 +1,161 @@
+#include "ratelimit.h"
+
+#include <string.h>
+#include <time.h>
+
+/* How much of a new round trip time goes into the smoothed one */
+#define RATE_RTT_GAIN 0.125
+
+/* How fast the lowest round trip time drifts up to the current one */
+#define RATE_MIN_RTT_DRIFT (1.0 / 1024)
+
+/*
+ * Returns the time on the monotonic clock
+ * @return the time in milliseconds, with fractions
+ */
+double
+rate_limiter_clock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+/*
+ * Initializes a RateLimiter. The window starts at its smallest, and doubles
+ * every round trip until it first has to shrink.
+ * @param limiter the pointer to the RateLimiter object
+ * @param rate the most requests to start every second, 0 for no ceiling
+ * @param burst the most requests to start at once, when there was a pause
+ * @param min_window the fewest requests to let run at the same time
+ * @param max_window the most requests to let run at the same time. When it
+ * is min_window, the window is fixed.
+ * @param tolerance how many times the lowest round trip time is still healthy
+ */
+void
+rate_limiter_init(RateLimiter *limiter, double rate, double burst, int min_window, int max_window, double tolerance)
+{
+	memset(limiter, 0, sizeof(RateLimiter));
+	limiter->rate = rate > 0 ? rate : 0;
+	limiter->burst = burst >= 1 ? burst : 1;
+	limiter->tokens = limiter->burst;
+	limiter->refilled = rate_limiter_clock ();
+	limiter->min_window = min_window >= 1 ? min_window : 1;
+	limiter->max_window = max_window >= limiter->min_window ? max_window : limiter->min_window;
+	limiter->window = limiter->min_window;
+	limiter->tolerance = tolerance > 1 ? tolerance : 1;
+}
+
+/*
+ * Tells how long the next request has to wait
+ * @param limiter the pointer to the RateLimiter object
+ * @param in_flight the requests running now
+ * @return 0 if it can start now, the milliseconds to wait for a token, or -1
+ * if the window is full and it has to wait for a request to be done
+ */
+int
+rate_limiter_delay(RateLimiter *limiter, int in_flight)
+{
+	double now;
+
+	if (in_flight >= (int)limiter->window) {
+		return -1;
+	}
+	if (limiter->rate == 0) {
+		return 0;
+	}
+
+	now = rate_limiter_clock ();
+	limiter->tokens += (now - limiter->refilled) * limiter->rate / 1000;
+	if (limiter->tokens > limiter->burst) {
+		limiter->tokens = limiter->burst;
+	}
+	limiter->refilled = now;
+	if (limiter->tokens >= 1) {
+		return 0;
+	}
+
+	limiter->waits++;
+	return (int)((1 - limiter->tokens) * 1000 / limiter->rate) + 1;
+}
+
+/*
+ * Takes a token for a request that starts, see rate_limiter_delay
+ * @param limiter the pointer to the RateLimiter object
+ */
+void
+rate_limiter_start(RateLimiter *limiter)
+{
+	if (limiter->rate > 0) {
+		limiter->tokens--;
+	}
+}
+
+/*
+ * Shrinks the window, unless it already did in the last round trip
+ * @param limiter the pointer to the RateLimiter object
+ * @param factor what to multiply it by
+ * @param now the time
+ * @return 1 if it shrank, 0 if not
+ */
+static int
+rate_limiter_decrease(RateLimiter *limiter, double factor, double now)
+{
+	if (now - limiter->decreased < limiter->rtt) {
+		return 0;
+	}
+
+	limiter->decreased = now;
+	limiter->window *= factor;
+	if (limiter->window < limiter->min_window) {
+		limiter->window = limiter->min_window;
+	}
+
+	return 1;
+}
+
+/*
+ * Adapts the window to a request that is done
+ * @param limiter the pointer to the RateLimiter object
+ * @param started when the request started, see rate_limiter_clock
+ * @param congested 1 if the service pushed back or the request failed, 0 if
+ * it was answered
+ */
+void
+rate_limiter_done(RateLimiter *limiter, double started, int congested)
+{
+	double now = rate_limiter_clock ();
+	double rtt = now - started;
+
+	if (congested) {
+		/* Multiplicative decrease. A failure says nothing of the round trip */
+		limiter->throttled += rate_limiter_decrease (limiter, 0.5, now);
+		return;
+	}
+
+	if (limiter->rtt == 0) {
+		limiter->rtt = rtt;
+		limiter->min_rtt = rtt;
+	} else {
+		limiter->rtt += (rtt - limiter->rtt) * RATE_RTT_GAIN;
+		if (rtt < limiter->min_rtt) {
+			limiter->min_rtt = rtt;
+		} else {
+			limiter->min_rtt += (rtt - limiter->min_rtt) * RATE_MIN_RTT_DRIFT;
+		}
+	}
+
+	if (limiter->rtt > limiter->min_rtt * limiter->tolerance) {
+		/* The gradient: as much slower as the round trips got, but never below half */
+		double gradient = limiter->min_rtt * limiter->tolerance / limiter->rtt;
+		limiter->slowed += rate_limiter_decrease (limiter, gradient > 0.5 ? gradient : 0.5, now);
+		return;
+	}
+
+	/* Slow start (one for every response) until it first shrinks, then
+	 * additive increase (about one for a window of responses) */
+	limiter->window += limiter->decreased == 0 ? 1 : 1 / limiter->window;
+	if (limiter->window > limiter->max_window) {
+		limiter->window = limiter->max_window;
+	}
+}
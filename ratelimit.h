@@ -0,0 +1,53 @@
+/*
+ * The RateLimiter paces the requests to the push service, so it doesn't
+ * throttle us. A token bucket puts a hard ceiling on the requests started
+ * every second, and lets bursts through. The window, the number of requests
+ * that may be running at the same time, adapts (AIMD): it grows by about one
+ * every round trip while the responses come back healthy (it doubles, until
+ * it first shrinks), is halved when the service pushes back (429, 5xx, or a
+ * failed request), and shrinks with the ratio of the lowest round trip time
+ * to the current one when that grows beyond a tolerance (the requests queue
+ * up somewhere). It shrinks at most once every round trip.
+ */
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+typedef struct {
+	/* The token bucket */
+	double rate; /* requests a second, 0 for no ceiling */
+	double burst; /* the most tokens it holds */
+	double tokens;
+	double refilled; /* when, in milliseconds */
+
+	/* The window */
+	double window; /* fractional, it grows a bit with every response */
+	int min_window;
+	int max_window;
+	double tolerance; /* how much slower than the lowest round trip time is healthy */
+	double rtt; /* the round trip time, smoothed, in milliseconds */
+	double min_rtt; /* the lowest one, drifting slowly towards the current one */
+	double decreased; /* when the window last shrank */
+
+	/* For the statistics */
+	unsigned long throttled; /* times the service pushed back */
+	unsigned long slowed; /* times the round trips grew too long */
+	unsigned long waits; /* times a request waited for a token */
+} RateLimiter;
+
+double
+rate_limiter_clock();
+
+void
+rate_limiter_init(RateLimiter *limiter, double rate, double burst, int min_window, int max_window, double tolerance);
+
+int
+rate_limiter_delay(RateLimiter *limiter, int in_flight);
+
+void
+rate_limiter_start(RateLimiter *limiter);
+
+void
+rate_limiter_done(RateLimiter *limiter, double started, int congested);
+
+#endif
@@ -0,0 +1,614 @@
+#include "responsearchive.h"
+#include "settings.h"
+#include "stringbuffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+/* The longest header of a block, and the longest line of an index */
+#define ARCHIVE_MAX_HEADER 48
+#define ARCHIVE_MAX_LINE (4 * 21 + 2 * ARCHIVE_BLOOM_BYTES + 1)
+
+/*
+ * Builds the path of a segment file
+ * @param name the StringBuffer to build it in
+ * @param directory the directory
+ * @param segment the number of the segment
+ * @param suffix .archive or .index
+ * @return the path
+ */
+static char *
+response_archive_path(StringBuffer *name, char *directory, unsigned long long segment, char *suffix)
+{
+	string_buffer_recycle (name);
+	string_buffer_append_format (name, "%s/%016llx%s", directory, segment, suffix);
+
+	return string_buffer_get_string (name);
+}
+
+/*
+ * Looks for the newest segment in a directory, older than a given one
+ * @param path the directory
+ * @param below the segments to look at are older than this one
+ * @param found will hold the number of the segment
+ * @return 1 if a segment was found, 0 if there is none, -1 on error
+ */
+static int
+response_archive_scan(char *path, unsigned long long below, unsigned long long *found)
+{
+	DIR *d = opendir(path);
+	struct dirent *entry;
+	int result = 0;
+
+	if (d == NULL) {
+		return -1;
+	}
+
+	while ((entry = readdir(d)) != NULL) {
+		unsigned long long number;
+		char *end;
+
+		if (strlen(entry->d_name) != 24 || strcmp(entry->d_name + 16, ".archive") != 0) {
+			continue; /* Not a segment */
+		}
+		number = strtoull(entry->d_name, &end, 16);
+		if (end != entry->d_name + 16 || number >= below) {
+			continue;
+		}
+		if (result == 0 || number > *found) {
+			*found = number;
+			result = 1;
+		}
+	}
+	closedir(d);
+
+	return result;
+}
+
+/*
+ * Finds the bits of a name in the bloom filter of a block (FNV-1a, 64 bits,
+ * the halves make the positions)
+ * @param name the name
+ * @param positions will hold the bits
+ */
+static void
+response_archive_bits(const char *name, unsigned int positions[ARCHIVE_BLOOM_HASHES])
+{
+	unsigned long long hash = 14695981039346656037ull;
+	unsigned int low;
+	unsigned int high;
+	int i;
+
+	while (*name != '\0') {
+		hash ^= (unsigned char)*name++;
+		hash *= 1099511628211ull;
+	}
+
+	low = (unsigned int)hash;
+	high = (unsigned int)(hash >> 32) | 1;
+	for (i = 0; i < ARCHIVE_BLOOM_HASHES; i++) {
+		positions[i] = (low + i * high) % (ARCHIVE_BLOOM_BYTES * 8);
+	}
+}
+
+/*
+ * Opens the current segment and its index, for appending. A block that was
+ * written without its index line (pushr stopped in between) is cut off, as
+ * is a partial index line.
+ * @param archive the pointer to the ResponseArchive object
+ * @return 0 on success, -1 on error
+ */
+static int
+response_archive_start(ResponseArchive *archive)
+{
+	char tail[2 * ARCHIVE_MAX_LINE + 1];
+	off_t index_size;
+	off_t from;
+	ssize_t got;
+	long long offset = 0;
+	long long length = 0;
+	char *line_end;
+
+	archive->file = open(response_archive_path (archive->name, archive->path, archive->segment, ".archive"),
+	                     O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (archive->file == -1) {
+		return -1;
+	}
+	archive->index = open(response_archive_path (archive->name, archive->path, archive->segment, ".index"),
+	                      O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (archive->index == -1) {
+		return -1;
+	}
+
+	/* The last whole line of the index tells where the last block ends */
+	index_size = lseek(archive->index, 0, SEEK_END);
+	if (index_size == -1) {
+		return -1;
+	}
+	from = index_size > (off_t)(sizeof(tail) - 1) ? index_size - (off_t)(sizeof(tail) - 1) : 0;
+	got = pread(archive->index, tail, index_size - from, from);
+	if (got != index_size - from) {
+		return -1;
+	}
+	tail[got] = '\0';
+
+	line_end = tail + got;
+	while (line_end > tail && line_end[-1] != '\n') {
+		line_end--;
+	}
+	if (line_end == tail) {
+		index_size = 0; /* Not one whole line */
+	} else {
+		char *line;
+
+		line_end--;
+		index_size = from + (line_end - tail) + 1;
+		*line_end = '\0';
+		line = strrchr(tail, '\n');
+		line = line != NULL ? line + 1 : tail;
+		if (sscanf(line, "%lld %lld", &offset, &length) != 2) {
+			errno = EINVAL; /* Corrupt */
+			return -1;
+		}
+	}
+
+	archive->size = offset + length;
+	if (ftruncate(archive->index, index_size) == -1 || ftruncate(archive->file, archive->size) == -1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens the archive, and goes on with its newest segment
+ * @param path the directory of the segments
+ * @return a pointer to the ResponseArchive, or NULL on error (check errno)
+ */
+ResponseArchive *
+response_archive_open(char *path)
+{
+	ResponseArchive *archive = (ResponseArchive *)calloc(1, sizeof(ResponseArchive));
+
+	if (archive == NULL) {
+		return NULL;
+	}
+
+	archive->path = path;
+	archive->file = -1;
+	archive->index = -1;
+	archive->block = string_buffer_create (ARCHIVE_BLOCK_SIZE + 1024);
+	archive->name = string_buffer_create (ARCHIVE_MAX_LINE + 1);
+	if (archive->block == NULL || archive->name == NULL) {
+		response_archive_close (archive);
+		return NULL;
+	}
+
+	switch (response_archive_scan (path, ULLONG_MAX, &archive->segment)) {
+	case -1:
+		response_archive_close (archive);
+		return NULL;
+	case 0:
+		archive->segment = 0; /* Nothing written yet */
+		break;
+	}
+
+	if (response_archive_start (archive) == -1) {
+		response_archive_close (archive);
+		return NULL;
+	}
+
+	return archive;
+}
+
+/*
+ * Adds the response of a message. It is written with its block, once the
+ * block is full, or when the archive is flushed.
+ * @param archive the pointer to the ResponseArchive object
+ * @param name the name of the message
+ * @param sent 1 if the message was sent, 0 if it failed
+ * @param read_time when the message was read from the queue
+ * @param response the response
+ * @param length the length of the response
+ * @return 0 on success, -1 on error
+ */
+int
+response_archive_add(ResponseArchive *archive, char *name, int sent, time_t read_time, char *response, size_t length)
+{
+	time_t now = time(NULL);
+	unsigned int positions[ARCHIVE_BLOOM_HASHES];
+	unsigned int before = archive->block->length;
+	int i;
+
+	if (! string_buffer_append_format (archive->block, "%d %lld %lld %lu %s\n", sent, (long long)read_time,
+	                                   (long long)now, (unsigned long)length, name)
+	    || (length > 0 && ! string_buffer_append_n (archive->block, response, length))
+	    || ! string_buffer_append_char (archive->block, '\n')) {
+		/* Out of memory, leave the block as it was */
+		archive->block->length = before;
+		archive->block->data[before] = '\0';
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (archive->count == 0) {
+		archive->first = now;
+	}
+	archive->last = now;
+	archive->count++;
+
+	response_archive_bits (name, positions);
+	for (i = 0; i < ARCHIVE_BLOOM_HASHES; i++) {
+		archive->bloom[positions[i] / 8] |= 1 << (positions[i] % 8);
+	}
+
+	if (archive->block->length >= ARCHIVE_BLOCK_SIZE) {
+		return response_archive_flush (archive);
+	}
+
+	return 0;
+}
+
+/*
+ * Compresses the records that were added and writes them as a block, with
+ * its index line. The segment is sealed if it is full.
+ * @param archive the pointer to the ResponseArchive object
+ * @return 0 on success, -1 on error (the records are lost)
+ */
+int
+response_archive_flush(ResponseArchive *archive)
+{
+	uLongf size = compressBound(archive->block->length);
+	char header[ARCHIVE_MAX_HEADER];
+	struct iovec parts[2];
+	int header_length;
+	int status = 0;
+	int i;
+
+	if (archive->count == 0) {
+		return 0;
+	}
+
+	if (archive->compressed_space < size) {
+		unsigned char *grown = (unsigned char *)realloc(archive->compressed, size);
+		if (grown == NULL) {
+			status = -1;
+		} else {
+			archive->compressed = grown;
+			archive->compressed_space = size;
+		}
+	}
+
+	if (status == 0 && compress2(archive->compressed, &size, (Bytef *)archive->block->data,
+	                             archive->block->length, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		errno = ENOMEM;
+		status = -1;
+	}
+
+	if (status == 0) {
+		/* The block, with a single write */
+		header_length = snprintf(header, sizeof(header), "%lu %u\n", (unsigned long)size, archive->block->length);
+		parts[0].iov_base = header;
+		parts[0].iov_len = header_length;
+		parts[1].iov_base = archive->compressed;
+		parts[1].iov_len = size;
+
+		/* Its index line */
+		string_buffer_recycle (archive->name);
+		string_buffer_append_format (archive->name, "%lld %lu %lld %lld ", (long long)archive->size,
+		                             (unsigned long)(header_length + size), (long long)archive->first,
+		                             (long long)archive->last);
+		for (i = 0; i < ARCHIVE_BLOOM_BYTES; i++) {
+			string_buffer_append_format (archive->name, "%02x", archive->bloom[i]);
+		}
+		string_buffer_append_char (archive->name, '\n');
+
+		if (writev(archive->file, parts, 2) != (ssize_t)(header_length + size)
+		    || write(archive->index, archive->name->data, archive->name->length) != (ssize_t)archive->name->length) {
+			/* Take back what was written, the index must match the segment */
+			(void) ftruncate(archive->file, archive->size);
+			status = -1;
+		} else {
+			archive->size += header_length + size;
+			archive->dirty = 1;
+		}
+	}
+
+	string_buffer_recycle (archive->block);
+	archive->count = 0;
+	memset(archive->bloom, 0, sizeof(archive->bloom));
+
+	if (status == 0 && archive->size >= ARCHIVE_SEGMENT_SIZE) {
+		/* Seal it, and start the next one */
+		if (response_archive_sync (archive) == -1) {
+			return -1;
+		}
+		close(archive->file);
+		close(archive->index);
+		archive->segment++;
+		status = response_archive_start (archive);
+	}
+
+	return status;
+}
+
+/*
+ * Writes the records that were added, and makes sure that everything that
+ * was written is on the disk
+ * @param archive the pointer to the ResponseArchive object
+ * @return 0 on success, -1 on error
+ */
+int
+response_archive_sync(ResponseArchive *archive)
+{
+	int status = response_archive_flush (archive);
+
+	if (archive->dirty) {
+		if (fsync(archive->file) == -1 || fsync(archive->index) == -1) {
+			return -1;
+		}
+		archive->dirty = 0;
+	}
+
+	return status;
+}
+
+/*
+ * Writes the records that were added, syncs and closes the archive
+ * @param archive the pointer to the ResponseArchive object
+ */
+void
+response_archive_close(ResponseArchive *archive)
+{
+	if (archive->file != -1 && archive->index != -1) {
+		(void) response_archive_sync (archive);
+	}
+	if (archive->file != -1) {
+		close(archive->file);
+	}
+	if (archive->index != -1) {
+		close(archive->index);
+	}
+	if (archive->block != NULL) {
+		string_buffer_free (archive->block);
+	}
+	if (archive->name != NULL) {
+		string_buffer_free (archive->name);
+	}
+	free(archive->compressed);
+	free(archive);
+}
+
+/*
+ * Reads a whole file
+ * @param path the file
+ * @param length will hold its length
+ * @return the data (free it), or NULL on error
+ */
+static char *
+response_archive_read(char *path, size_t *length)
+{
+	int file = open(path, O_RDONLY);
+	struct stat info;
+	char *data = NULL;
+	ssize_t got = 0;
+
+	if (file == -1) {
+		return NULL;
+	}
+
+	*length = 0;
+	if (fstat(file, &info) == 0) {
+		data = (char *)malloc(info.st_size + 1);
+	}
+	while (data != NULL && *length < (size_t)info.st_size
+	       && (got = read(file, data + *length, info.st_size - *length)) > 0) {
+		*length += got;
+	}
+	if (data != NULL && got == -1) {
+		free(data);
+		data = NULL;
+	}
+	if (data != NULL) {
+		data[*length] = '\0';
+	}
+	close(file);
+
+	return data;
+}
+
+/*
+ * Looks for the last record of a name in a block
+ * @param data the uncompressed block
+ * @param length its length
+ * @param name the name
+ * @param record the StringBuffer to copy the record to
+ * @return 1 if it was found, 0 if it wasn't
+ */
+static int
+response_archive_search(char *data, size_t length, char *name, StringBuffer *record)
+{
+	char *end = data + length;
+	char *match = NULL;
+	size_t match_length = 0;
+
+	while (data < end) {
+		char *line_end = memchr(data, '\n', end - data);
+		unsigned long response_length;
+		int name_offset = 0;
+		char *next;
+
+		if (line_end == NULL) {
+			break; /* Corrupt */
+		}
+		*line_end = '\0';
+		if (sscanf(data, "%*d %*d %*d %lu %n", &response_length, &name_offset) != 1 || name_offset == 0
+		    || response_length > (size_t)(end - line_end)) {
+			break; /* Corrupt */
+		}
+		next = line_end + 1 + response_length + 1;
+		if (strcmp(data + name_offset, name) == 0) {
+			*line_end = '\n';
+			match = data;
+			match_length = next - data;
+		}
+		data = next;
+	}
+
+	if (match == NULL) {
+		return 0;
+	}
+
+	string_buffer_append_n (record, match, match_length);
+	return 1;
+}
+
+/*
+ * Reads a block, and looks for the last record of a name in it
+ * @param file the segment
+ * @param offset where the block is
+ * @param length the length of the block, with its header
+ * @param name the name
+ * @param record the StringBuffer to copy the record to
+ * @return 1 if it was found, 0 if it wasn't (or the block is corrupt), -1 on
+ * error
+ */
+static int
+response_archive_search_block(int file, long long offset, long long length, char *name, StringBuffer *record)
+{
+	char *block = (char *)malloc(length + 1);
+	char *data = NULL;
+	unsigned long compressed;
+	unsigned int size;
+	int header_length = 0;
+	int result = -1;
+
+	if (block != NULL && pread(file, block, length, offset) == length) {
+		block[length] = '\0';
+		result = 0;
+		if (sscanf(block, "%lu %u%n", &compressed, &size, &header_length) == 2 && block[header_length] == '\n'
+		    && header_length + 1 + (long long)compressed == length) {
+			uLongf data_length = size;
+
+			data = (char *)malloc(size + 1);
+			if (data == NULL) {
+				result = -1;
+			} else if (uncompress((Bytef *)data, &data_length, (Bytef *)block + header_length + 1, 
+			                      compressed) == Z_OK) {
+				result = response_archive_search (data, data_length, name, record);
+			}
+		}
+	}
+
+	free(data);
+	free(block);
+	return result;
+}
+
+/*
+ * Looks for the last record of a name in a segment
+ * @param path the directory of the segments
+ * @param segment the segment
+ * @param name the name
+ * @param record the StringBuffer to copy the record to
+ * @return 1 if it was found, 0 if it wasn't, -1 on error
+ */
+static int
+response_archive_find_in(char *path, unsigned long long segment, char *name, StringBuffer *record)
+{
+	StringBuffer *file_name = string_buffer_create (256);
+	unsigned int positions[ARCHIVE_BLOOM_HASHES];
+	char *index;
+	size_t index_length;
+	char *line_end;
+	int file;
+	int result = 0;
+
+	if (file_name == NULL) {
+		return -1;
+	}
+	index = response_archive_read (response_archive_path (file_name, path, segment, ".index"), &index_length);
+	file = open(response_archive_path (file_name, path, segment, ".archive"), O_RDONLY);
+	string_buffer_free (file_name);
+	if (index == NULL || file == -1) {
+		free(index);
+		if (file != -1) {
+			close(file);
+		}
+		return -1;
+	}
+
+	response_archive_bits (name, positions);
+
+	/* The newest blocks first, the last record of the name is the one */
+	line_end = index_length > 0 && index[index_length - 1] == '\n' ? index + index_length - 1 : NULL;
+	while (result == 0 && line_end != NULL) {
+		char *line = line_end;
+		char *bloom;
+		long long offset;
+		long long length;
+		int bloom_offset = 0;
+		int i;
+
+		*line_end = '\0';
+		while (line > index && line[-1] != '\n') {
+			line--;
+		}
+		line_end = line > index ? line - 1 : NULL;
+
+		if (sscanf(line, "%lld %lld %*d %*d %n", &offset, &length, &bloom_offset) != 2 || bloom_offset == 0
+		    || strlen(line + bloom_offset) != 2 * ARCHIVE_BLOOM_BYTES) {
+			continue; /* Corrupt */
+		}
+		bloom = line + bloom_offset;
+		for (i = 0; i < ARCHIVE_BLOOM_HASHES; i++) {
+			char byte[3] = { bloom[positions[i] / 8 * 2], bloom[positions[i] / 8 * 2 + 1], '\0' };
+			if (!(strtoul(byte, NULL, 16) & (1 << (positions[i] % 8)))) {
+				break;
+			}
+		}
+		if (i < ARCHIVE_BLOOM_HASHES) {
+			continue; /* Not in this block */
+		}
+
+		result = response_archive_search_block (file, offset, length, name, record);
+	}
+
+	free(index);
+	close(file);
+	return result;
+}
+
+/*
+ * Finds the last record of a name: the segments are searched from the newest
+ * @param path the directory of the segments
+ * @param name the name
+ * @param record the StringBuffer to copy the record to
+ * @return 1 if it was found, 0 if it wasn't, -1 on error
+ */
+int
+response_archive_find(char *path, char *name, StringBuffer *record)
+{
+	unsigned long long segment;
+	unsigned long long below = ULLONG_MAX;
+	int found;
+
+	while ((found = response_archive_scan (path, below, &segment)) == 1) {
+		int result = response_archive_find_in (path, segment, name, record);
+		if (result != 0) {
+			return result;
+		}
+		below = segment;
+	}
+
+	return found;
+}
@@ -0,0 +1,63 @@
+/*
+ * The ResponseArchive keeps the responses of the messages in a few large
+ * files, instead of a file for every message. Every record is a line with
+ * "<sent> <read time> <done time> <length> <name>", then the response and a
+ * newline. The records are compressed with zlib in blocks, and the blocks
+ * are appended to segment files (%016llx.archive), a new one every
+ * ARCHIVE_SEGMENT_SIZE bytes. A block starts with a line with its
+ * compressed and uncompressed lengths.
+ * Every segment has a sparse index (%016llx.index), a line for every block:
+ * "<offset> <length> <first time> <last time> <names>", where names is a
+ * bloom filter of the names in the block, in hex. A name is looked up by
+ * uncompressing only the blocks whose filter has it.
+ */
+
+#ifndef _RESPONSEARCHIVE_H_
+#define _RESPONSEARCHIVE_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "stringbuffer.h"
+
+/* The bloom filter of a block: its size, and how many bits a name sets */
+#define ARCHIVE_BLOOM_BYTES 256
+#define ARCHIVE_BLOOM_HASHES 3
+
+typedef struct {
+	char *path; /* the directory */
+	unsigned long long segment; /* the segment being written */
+	int file; /* its descriptor */
+	int index; /* the descriptor of its index */
+	off_t size; /* of the segment */
+	StringBuffer *block; /* the records not written yet */
+	int count; /* how many */
+	time_t first; /* when the first and the last of them were done */
+	time_t last;
+	unsigned char bloom[ARCHIVE_BLOOM_BYTES]; /* their names */
+	unsigned char *compressed; /* where blocks are compressed to */
+	size_t compressed_space;
+	StringBuffer *name; /* to build file names and index lines in */
+	int dirty; /* written to since the last sync */
+} ResponseArchive;
+
+ResponseArchive *
+response_archive_open(char *path);
+
+int
+response_archive_add(ResponseArchive *archive, char *name, int sent, time_t read_time, char *response, size_t length);
+
+int
+response_archive_flush(ResponseArchive *archive);
+
+int
+response_archive_sync(ResponseArchive *archive);
+
+void
+response_archive_close(ResponseArchive *archive);
+
+int
+response_archive_find(char *path, char *name, StringBuffer *record);
+
+#endif
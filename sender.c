@@ -0,0 +1,656 @@
+#include "settings.h"
+#include "sender.h"
+#include "workers.h"
+#include "loopback.h"
+#include "stringbuffer.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <curl/curl.h>
+
+/*
+ * This function is in charge of handling the data from the server. It is being
+ * invoked by the cURL library and may be called several times per response,
+ * so we accumulate and parse here. The response is handled once the transfer
+ * is done.
+ * @param userp is the pointer to the transfer
+ * @return the number of chars handled
+ */
+size_t
+receive_data(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+	size_t real_size = size * nmemb;
+	struct SenderTransfer *transfer = (struct SenderTransfer *)userp;
+
+	/* If we are out of memory nothing is appended and cURL fails the transfer */
+	if (string_buffer_append_n (transfer->response, (char *)buffer, real_size) != (int)real_size) {
+		return 0;
+	}
+	(void) gcm_response_feed (&transfer->parsed, (char *)buffer, real_size);
+
+	return real_size;
+}
+
+/*
+ * This function is in charge of producing the data to be sent to the server.
+ * It is being used by the cURL library which supplies the parameters.
+ * The position in the message is kept in the transfer, so any number of
+ * transfers can be running at the same time.
+ * @param userp is the pointer to the transfer
+ * @return the number of chars written
+ */
+size_t
+send_data(char *bufptr, size_t size, size_t nitems, void *userp)
+{
+	size_t real_size = size * nitems;
+	struct SenderTransfer *transfer = (struct SenderTransfer *)userp;
+	size_t left = transfer->message->length - transfer->sent;
+
+	if (real_size > left) {
+		real_size = left;
+	}
+	memcpy(bufptr, transfer->message->data + transfer->sent, real_size);
+	transfer->sent += real_size;
+
+	return real_size; /* Return the number of characters written */
+}
+
+/*
+ * Sets the options that stay the same for every message on a cURL handle
+ * @param curl the cURL handle
+ * @param url the url of the push service
+ * @param headers the request headers
+ */
+void
+sender_setup_curl(CURL *curl, char *url, struct curl_slist *headers)
+{
+	/* Set the requested url to the one of the push service */
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	/* Allow following redirections */
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	/* Use HTTP/2 over TLS when the server supports it, and wait for the
+	 * multiplexed connection rather than opening new ones */
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	/* No signals, handles may be used from other threads */
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	/* Give up on a push service that doesn't answer */
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)CONNECT_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)REQUEST_TIMEOUT);
+	/* Set our receive_data function to handle the data sent FROM the server */
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, receive_data);
+	/* Set our send_data function to handle the data sent TO the server */
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, send_data);
+	/* Set the request to be HTTP POST */
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	/* Set the request heasers as per Google's requirments */
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	/* For debugging purposes: */
+	if (CURL_VERBOSE) {
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+	}
+}
+
+/*
+ * Reads the HTTP status of a finished transfer, the Retry-After header, and
+ * when the first byte came, into its parsed response, and records how long
+ * its round trip took (in the metrics of the thread that sent it)
+ * @param curl the cURL handle the transfer was sent with
+ * @param parsed the parsed response
+ */
+void
+sender_read_status(CURL *curl, GcmResponse *parsed)
+{
+	long status = 0;
+	curl_off_t retry_after = 0;
+	double first_byte = 0; /* in seconds */
+	double total = 0; /* the round trip, in seconds */
+
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+	parsed->status = status;
+#if LIBCURL_VERSION_NUM >= 0x074200
+	/* cURL reads the header since 7.66.0 */
+	curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after);
+#endif
+	parsed->retry_after = (long)retry_after;
+
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &first_byte);
+	parsed->first_byte = (long)(first_byte * 1000000);
+
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+	metrics_time (STAGE_ROUND_TRIP, (long long)(total * 1000000));
+}
+
+/*
+ * Hands a finished transfer's response to the callback and puts the transfer
+ * back on the idle list
+ * @param sender the pointer to the Sender object
+ * @param transfer the finished transfer
+ * @param result the cURL result code of the transfer
+ */
+static void
+sender_finish(Sender *sender, struct SenderTransfer *transfer, CURLcode result)
+{
+	sender->in_flight--;
+	rate_limiter_done (&sender->limiter, transfer->started, result != CURLE_OK || transfer->parsed.status == 429 
+	                   || transfer->parsed.status >= 500);
+
+	(void) gcm_response_finish (&transfer->parsed);
+	sender->callback(transfer->userp, string_buffer_get_string (transfer->response), &transfer->parsed, result);
+
+	/* Ready the transfer for the next message */
+	string_buffer_recycle (transfer->message);
+	string_buffer_recycle (transfer->response);
+	arena_reset (transfer->arena);
+	transfer->userp = NULL;
+	transfer->next = sender->idle;
+	sender->idle = transfer;
+}
+
+/*
+ * Sets up the cURL multi transport: a multi handle, and an easy handle for
+ * every transfer slot
+ * @param sender the pointer to the Sender object
+ * @return 0 on success, -1 on error
+ */
+static int
+multi_start(Sender *sender)
+{
+	CURLM *multi = curl_multi_init();
+	int i;
+
+	if (multi == NULL) {
+		return -1;
+	}
+	/* Let requests share one HTTP/2 connection when possible */
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	sender->transport_data = multi;
+
+	for (i = 0; i < sender->max_in_flight; i++) {
+		struct SenderTransfer *transfer = &sender->transfers[i];
+
+		transfer->curl = curl_easy_init();
+		if (transfer->curl == NULL) {
+			return -1;
+		}
+		sender_setup_curl (transfer->curl, sender->url, sender->headers);
+		curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, (char *)transfer);
+		curl_easy_setopt(transfer->curl, CURLOPT_WRITEDATA, (void *)transfer);
+		curl_easy_setopt(transfer->curl, CURLOPT_READDATA, (void *)transfer);
+	}
+
+	return 0;
+}
+
+/*
+ * Adds a transfer to the multi handle, it is started by the next multi_done
+ * @param sender the pointer to the Sender object
+ * @param transfer the transfer to send, with its message filled in
+ * @return 0 on success, -1 on error
+ */
+static int
+multi_submit(Sender *sender, struct SenderTransfer *transfer)
+{
+	/* Set content length based on the message's length */
+	curl_easy_setopt(transfer->curl, CURLOPT_POSTFIELDSIZE, (long)transfer->message->length);
+
+	return curl_multi_add_handle((CURLM *)sender->transport_data, transfer->curl) == CURLM_OK ? 0 : -1;
+}
+
+/*
+ * Drives the running transfers, and takes the ones that are done off the
+ * multi handle
+ * @param sender the pointer to the Sender object
+ * @return a list of transfers (linked by next, in the order they finished), or NULL
+ */
+static struct SenderTransfer *
+multi_done(Sender *sender)
+{
+	CURLM *multi = (CURLM *)sender->transport_data;
+	struct SenderTransfer *done = NULL;
+	struct SenderTransfer **last = &done;
+	CURLMsg *msg;
+	int running;
+	int left; /* messages left in the queue, not used */
+
+	curl_multi_perform(multi, &running);
+	while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+		struct SenderTransfer *transfer = NULL;
+
+		if (msg->msg != CURLMSG_DONE) {
+			continue;
+		}
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+		transfer->result = msg->data.result;
+		curl_multi_remove_handle(multi, transfer->curl);
+		sender_read_status (transfer->curl, &transfer->parsed);
+		transfer->next = NULL;
+		*last = transfer;
+		last = &transfer->next;
+	}
+
+	return done;
+}
+
+/*
+ * Waits for network activity, or for another file descriptor to become
+ * readable
+ * @param sender the pointer to the Sender object
+ * @param fd an extra file descriptor to wait for, or -1 for none
+ * @param timeout the longest time to wait, in milliseconds
+ * @return 1 if fd is readable, 0 otherwise
+ */
+static int
+multi_wait(Sender *sender, int fd, int timeout)
+{
+	struct curl_waitfd extra; /* the caller's file descriptor */
+
+	extra.fd = fd;
+	extra.events = CURL_WAIT_POLLIN;
+	extra.revents = 0;
+
+#if LIBCURL_VERSION_NUM >= 0x074200
+	/* cURL waits even when no transfer runs since 7.66.0 */
+	if (curl_multi_poll((CURLM *)sender->transport_data, fd != -1 ? &extra : NULL, fd != -1 ? 1 : 0, timeout, 
+	                    NULL) != CURLM_OK) {
+		return 0;
+	}
+#else
+	if (sender->in_flight == 0) {
+		/* curl_multi_wait returns at once when no transfer runs, wait ourselves */
+		struct pollfd idle;
+
+		idle.fd = fd;
+		idle.events = POLLIN;
+		idle.revents = 0;
+		if (poll(&idle, fd != -1 ? 1 : 0, timeout) <= 0) {
+			return 0;
+		}
+
+		return (idle.revents & POLLIN) != 0;
+	}
+	if (curl_multi_wait((CURLM *)sender->transport_data, fd != -1 ? &extra : NULL, fd != -1 ? 1 : 0, timeout, 
+	                    NULL) != CURLM_OK) {
+		return 0;
+	}
+#endif
+
+	return (extra.revents & CURL_WAIT_POLLIN) != 0;
+}
+
+/*
+ * Frees the easy handles of the transfer slots, and the multi handle
+ * @param sender the pointer to the Sender object
+ */
+static void
+multi_stop(Sender *sender)
+{
+	CURLM *multi = (CURLM *)sender->transport_data;
+	int i;
+
+	for (i = 0; i < sender->max_in_flight; i++) {
+		struct SenderTransfer *transfer = &sender->transfers[i];
+		if (transfer->curl != NULL) {
+			curl_multi_remove_handle(multi, transfer->curl);
+			curl_easy_cleanup(transfer->curl);
+			transfer->curl = NULL;
+		}
+	}
+	curl_multi_cleanup(multi);
+}
+
+/* The requests are sent from the thread that uses the Sender */
+static const SenderTransport multi_transport = {
+	"curl", multi_start, multi_submit, multi_done, multi_wait, multi_stop
+};
+
+/*
+ * Starts the worker threads, each with its own cURL handle
+ * @param sender the pointer to the Sender object
+ * @return 0 on success, -1 on error
+ */
+static int
+pool_start(Sender *sender)
+{
+	sender->transport_data = worker_pool_create (sender->threads, sender->max_in_flight, sender->url, 
+	                                             sender->headers);
+
+	return sender->transport_data != NULL ? 0 : -1;
+}
+
+/*
+ * Queues a transfer for the workers
+ * @param sender the pointer to the Sender object
+ * @param transfer the transfer to send, with its message filled in
+ * @return 0
+ */
+static int
+pool_submit(Sender *sender, struct SenderTransfer *transfer)
+{
+	worker_pool_submit ((WorkerPool *)sender->transport_data, transfer);
+
+	return 0;
+}
+
+/*
+ * Takes the transfers the workers finished
+ * @param sender the pointer to the Sender object
+ * @return a list of transfers (linked by next), or NULL
+ */
+static struct SenderTransfer *
+pool_done(Sender *sender)
+{
+	return worker_pool_done ((WorkerPool *)sender->transport_data);
+}
+
+/*
+ * Waits until a worker finishes a transfer, or fd becomes readable
+ * @param sender the pointer to the Sender object
+ * @param fd an extra file descriptor to wait for, or -1 for none
+ * @param timeout the longest time to wait, in milliseconds
+ * @return 1 if fd is readable, 0 otherwise
+ */
+static int
+pool_wait(Sender *sender, int fd, int timeout)
+{
+	struct pollfd fds[2];
+
+	fds[0].fd = ((WorkerPool *)sender->transport_data)->event_fd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	fds[1].fd = fd;
+	fds[1].events = POLLIN;
+	fds[1].revents = 0;
+
+	if (poll(fds, fd != -1 ? 2 : 1, timeout) <= 0) {
+		return 0;
+	}
+
+	return (fds[1].revents & POLLIN) != 0;
+}
+
+/*
+ * Stops the workers, after they send what is queued
+ * @param sender the pointer to the Sender object
+ */
+static void
+pool_stop(Sender *sender)
+{
+	worker_pool_free ((WorkerPool *)sender->transport_data);
+}
+
+/* The requests are sent by worker threads, see workers.h */
+static const SenderTransport pool_transport = {
+	"workers", pool_start, pool_submit, pool_done, pool_wait, pool_stop
+};
+
+/*
+ * Collects the finished transfers from the transport
+ * @param sender the pointer to the Sender object
+ */
+static void
+sender_complete(Sender *sender)
+{
+	struct SenderTransfer *transfer = sender->transport->done (sender);
+
+	while (transfer != NULL) {
+		struct SenderTransfer *next = transfer->next;
+		sender_finish (sender, transfer, transfer->result);
+		transfer = next;
+	}
+}
+
+/*
+ * Drives the running transfers and waits for network activity, or for another
+ * file descriptor to become readable, completing any transfer that is done.
+ * This lets a caller run its own event loop on top of the Sender.
+ * @param sender the pointer to the Sender object
+ * @param fd an extra file descriptor to wait for, or -1 for none
+ * @param timeout the longest time to wait, in milliseconds
+ * @return 1 if fd is readable, 0 otherwise
+ */
+int
+sender_poll(Sender *sender, int fd, int timeout)
+{
+	int in_flight = sender->in_flight;
+	int readable;
+
+	sender_complete (sender);
+	if (sender->in_flight != in_flight) {
+		/* Some requests are done, let the caller go on without waiting */
+		return 0;
+	}
+
+	readable = sender->transport->wait (sender, fd, timeout);
+	sender_complete (sender);
+
+	return readable;
+}
+
+/*
+ * Creates the Sender and its transfer slots
+ * @param url the url of the push service, or a loopback profile (see
+ * loopback.h) to answer the requests in memory
+ * @param headers the request headers, owned by the caller and must outlive the sender
+ * @param max_in_flight how many requests may be running at the same time
+ * @param threads the number of worker threads to send with, or 0 to send
+ * from the calling thread with the cURL multi interface
+ * @param callback the function that handles each response. It is always
+ * invoked from the thread that uses the Sender.
+ * @return a pointer to the Sender, or NULL on error
+ */
+Sender *
+sender_create(char *url, struct curl_slist *headers, int max_in_flight, int threads, SenderCallback callback)
+{
+	Sender *sender;
+	int i;
+
+	if (max_in_flight < 1) {
+		max_in_flight = 1;
+	}
+
+	sender = (Sender *)malloc(sizeof(Sender));
+	if (sender == NULL) {
+		return NULL;
+	}
+
+	sender->url = url;
+	sender->headers = headers;
+	sender->callback = callback;
+	sender->threads = threads;
+	sender->max_in_flight = max_in_flight;
+	sender->in_flight = 0;
+	rate_limiter_init (&sender->limiter, 0, 1, max_in_flight, max_in_flight, 1);
+	sender->idle = NULL;
+	sender->transport_data = NULL;
+	if (strncmp(url, LOOPBACK_SCHEME, strlen(LOOPBACK_SCHEME)) == 0) {
+		sender->transport = &loopback_transport;
+	} else if (threads > 0) {
+		sender->transport = &pool_transport; /* The workers own the cURL handles */
+	} else {
+		sender->transport = &multi_transport;
+	}
+	sender->transfers = (struct SenderTransfer *)calloc(max_in_flight, sizeof(struct SenderTransfer));
+	if (sender->transfers == NULL) {
+		sender_free (sender);
+		return NULL;
+	}
+
+	for (i = 0; i < max_in_flight; i++) {
+		struct SenderTransfer *transfer = &sender->transfers[i];
+
+		transfer->message = string_buffer_create (250);
+		transfer->response = string_buffer_create (250);
+		transfer->arena = arena_create (0);
+		if (transfer->message == NULL || transfer->response == NULL || transfer->arena == NULL) {
+			sender_free (sender);
+			return NULL;
+		}
+
+		transfer->next = sender->idle;
+		sender->idle = transfer;
+	}
+
+	if (sender->transport->start (sender) == -1) {
+		sender_free (sender);
+		return NULL;
+	}
+
+	return sender;
+}
+
+/*
+ * Paces the requests: by default every slot may be in flight, with no limit
+ * on how often they start. See ratelimit.h.
+ * @param sender the pointer to the Sender object
+ * @param rate the most requests to start every second, 0 for no ceiling
+ * @param burst the most requests to start at once, when there was a pause
+ * @param min_window the fewest requests to let run at the same time, the
+ * window adapts from there up to max_in_flight
+ * @param tolerance how many times the lowest round trip time is still healthy
+ */
+void
+sender_set_rate(Sender *sender, double rate, double burst, int min_window, double tolerance)
+{
+	rate_limiter_init (&sender->limiter, rate, burst, min_window, sender->max_in_flight, tolerance);
+}
+
+/*
+ * Waits until a transfer is idle, and the RateLimiter lets the next request
+ * start
+ * @param sender the pointer to the Sender object
+ */
+static void
+sender_wait_turn(Sender *sender)
+{
+	for (;;) {
+		int wait = sender->idle != NULL ? rate_limiter_delay (&sender->limiter, sender->in_flight) : -1;
+		if (wait == 0) {
+			return;
+		}
+		(void) sender_poll (sender, -1, wait > 0 ? wait : 1000);
+	}
+}
+
+/*
+ * Returns the arena of the transfer that will send the next message, waiting
+ * for one to become available. Everything the caller allocates there for the
+ * message is released at once, after the callback is done with it.
+ * @param sender the pointer to the Sender object
+ * @return the pointer to the Arena
+ */
+Arena *
+sender_arena(Sender *sender)
+{
+	sender_wait_turn (sender);
+
+	return sender->idle->arena;
+}
+
+/*
+ * Starts sending a message. If the window of requests is full, waits until
+ * one of them is done, and if the rate is over its ceiling, until it is
+ * under. The callback may be invoked from within this function for earlier
+ * messages.
+ * @param sender the pointer to the Sender object
+ * @param message the request body. It is copied, so the caller can reuse it.
+ * @param userp the caller's data, given back to the callback
+ * @return 1 if the message was submitted, 0 on error (the callback is not called)
+ */
+int
+sender_submit(Sender *sender, char *message, void *userp)
+{
+	struct SenderTransfer *transfer;
+	unsigned int length = strlen(message);
+
+	sender_wait_turn (sender);
+
+	transfer = sender->idle;
+	if (string_buffer_append_n (transfer->message, message, length) != (int)length) {
+		string_buffer_recycle (transfer->message);
+		return 0;
+	}
+	transfer->sent = 0;
+	transfer->userp = userp;
+	transfer->started = rate_limiter_clock ();
+	gcm_response_init (&transfer->parsed, transfer->arena);
+
+	if (sender->transport->submit (sender, transfer) == -1) {
+		string_buffer_recycle (transfer->message);
+		return 0;
+	}
+	sender->idle = transfer->next;
+	sender->in_flight++;
+	rate_limiter_start (&sender->limiter);
+
+	/* Get the request going without waiting */
+	sender_complete (sender);
+
+	return 1;
+}
+
+/*
+ * Waits for all the running requests to complete
+ * @param sender the pointer to the Sender object
+ */
+void
+sender_flush(Sender *sender)
+{
+	while (sender->in_flight > 0) {
+		(void) sender_poll (sender, -1, 1000);
+	}
+}
+
+/*
+ * Counts the heap allocations made by the transfers' arenas. Once they have
+ * grown to their working size, this stops going up.
+ * @param sender the pointer to the Sender object
+ * @return the number of allocations
+ */
+unsigned long
+sender_allocations(Sender *sender)
+{
+	unsigned long allocations = 0;
+	int i;
+
+	for (i = 0; i < sender->max_in_flight; i++) {
+		allocations += sender->transfers[i].arena->allocations;
+	}
+
+	return allocations;
+}
+
+/*
+ * Frees the Sender. Call sender_flush first, pending requests are dropped.
+ * @param sender the pointer to the Sender object
+ */
+void
+sender_free(Sender *sender)
+{
+	int i;
+
+	if (sender->transport_data != NULL) {
+		/* Stop the transport (e.g. the workers) before the transfers go away */
+		sender->transport->stop (sender);
+	}
+
+	if (sender->transfers != NULL) {
+		for (i = 0; i < sender->max_in_flight; i++) {
+			struct SenderTransfer *transfer = &sender->transfers[i];
+			if (transfer->message != NULL) {
+				string_buffer_free (transfer->message);
+			}
+			if (transfer->response != NULL) {
+				string_buffer_free (transfer->response);
+			}
+			if (transfer->arena != NULL) {
+				arena_free (transfer->arena);
+			}
+		}
+		free(sender->transfers);
+	}
+	free(sender);
+}
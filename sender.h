@@ -0,0 +1,117 @@
+/*
+ * The Sender posts messages to the push service through the cURL multi
+ * interface. Up to max_in_flight requests are kept running at the same time
+ * (multiplexed over a single HTTP/2 connection when the server supports it)
+ * and each one is completed as soon as its response arrives.
+ * Alternatively, the requests can be sent by a pool of worker threads (see
+ * workers.h), or answered in memory by the loopback, without a network (see
+ * loopback.h). These are the transports of the Sender. Either way, responses
+ * are handed to the callback on the thread that uses the Sender. A
+ * RateLimiter paces the requests, within the max_in_flight slots.
+ */
+
+#ifndef _SENDER_H_
+#define _SENDER_H_
+
+#include <curl/curl.h>
+
+#include "stringbuffer.h"
+#include "arena.h"
+#include "gcmresponse.h"
+#include "ratelimit.h"
+
+/*
+ * Called once for every submitted message, when its request is done.
+ * @param userp the pointer given to sender_submit
+ * @param response the body returned by the server (an empty string on error)
+ * @param parsed the response, parsed as it arrived
+ * @param result the cURL result code of the transfer
+ */
+typedef void (*SenderCallback)(void *userp, char *response, GcmResponse *parsed, CURLcode result);
+
+struct SenderTransfer {
+	CURL *curl; /* the easy handle, kept for the life of the sender */
+	StringBuffer *message; /* our copy of the request body */
+	size_t sent; /* how much of the body was handed to cURL so far */
+	StringBuffer *response; /* the response body, accumulated */
+	GcmResponse parsed; /* and parsed, as it arrives */
+	void *userp; /* the caller's data for this message */
+	Arena *arena; /* the caller's memory for this message, reset when done */
+	CURLcode result; /* the result, set by the transport */
+	double started; /* when it was submitted, see rate_limiter_clock */
+	double due; /* when the loopback answers it */
+	struct SenderTransfer *next; /* next idle (or finished) transfer */
+};
+
+struct Sender;
+
+/*
+ * A transport carries the requests of a Sender. Finished transfers are handed
+ * back with their result and their parsed response (the status included)
+ * filled in. Every function is called from the thread that uses the Sender.
+ */
+typedef struct {
+	char *name;
+	/* Sets up the transport and the transfer slots, 0 on success, -1 on error */
+	int (*start)(struct Sender *sender);
+	/* Starts sending a transfer, 0 on success, -1 on error */
+	int (*submit)(struct Sender *sender, struct SenderTransfer *transfer);
+	/* Takes the finished transfers (linked by next), without waiting */
+	struct SenderTransfer *(*done)(struct Sender *sender);
+	/* Waits for some progress, or for fd to become readable: 1 if it is */
+	int (*wait)(struct Sender *sender, int fd, int timeout);
+	/* Frees the transport, the transfers that are not done are dropped */
+	void (*stop)(struct Sender *sender);
+} SenderTransport;
+
+typedef struct Sender {
+	char *url;
+	struct curl_slist *headers;
+	SenderCallback callback;
+	struct SenderTransfer *transfers; /* all the transfer slots */
+	struct SenderTransfer *idle; /* list of transfers ready for use */
+	const SenderTransport *transport;
+	void *transport_data; /* the multi handle, the WorkerPool, or the Loopback; NULL until started */
+	int threads; /* the worker threads, for the WorkerPool */
+	int max_in_flight;
+	int in_flight;
+	RateLimiter limiter; /* how many may be in flight, and how often they start */
+} Sender;
+
+size_t
+receive_data(void *buffer, size_t size, size_t nmemb, void *userp);
+
+size_t
+send_data(char *bufptr, size_t size, size_t nitems, void *userp);
+
+void
+sender_setup_curl(CURL *curl, char *url, struct curl_slist *headers);
+
+void
+sender_read_status(CURL *curl, GcmResponse *parsed);
+
+Sender *
+sender_create(char *url, struct curl_slist *headers, int max_in_flight, int threads, SenderCallback callback);
+
+void
+sender_set_rate(Sender *sender, double rate, double burst, int min_window, double tolerance);
+
+Arena *
+sender_arena(Sender *sender);
+
+int
+sender_submit(Sender *sender, char *message, void *userp);
+
+int
+sender_poll(Sender *sender, int fd, int timeout);
+
+void
+sender_flush(Sender *sender);
+
+unsigned long
+sender_allocations(Sender *sender);
+
+void
+sender_free(Sender *sender);
+
+#endif
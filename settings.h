@@ -10,6 +10,49 @@
  */
 #define API_KEY ""
 
+/*
+ * How many requests to the push service may be running at the same time.
+ * Requests are multiplexed over one HTTP/2 connection when the service 
+ * supports it.
+ */
+#define MAX_IN_FLIGHT 32
+
+/*
+ * How long a connection to the push service may take to open, and a request
+ * to be answered, in milliseconds. A request that takes longer fails like a
+ * network error: it is sent again, and counts toward the circuit breaker.
+ */
+#define CONNECT_TIMEOUT 10000
+#define REQUEST_TIMEOUT 30000
+
+/*
+ * Set to the number of worker threads to send the requests from several 
+ * threads, each with its own connection, instead of from a single event loop.
+ * Useful when building the messages and TLS are the bottleneck. 0 disables it.
+ */
+#define WORKER_THREADS 0
+
+/*
+ * Set to 1 to have cURL print every request and response header to stderr.
+ * For debugging only: it is done for every request, from every connection.
+ */
+#define CURL_VERBOSE 0
+
+/*
+ * The requests are paced, so the push service doesn't throttle us. At most
+ * RATE_LIMIT requests are started every second, in bursts of up to RATE_BURST
+ * (0 for no limit). The number of requests running at the same time adapts,
+ * from RATE_MIN_WINDOW up to MAX_IN_FLIGHT: it grows while the responses come
+ * back healthy, and shrinks when the service answers 429 or 5xx, a request
+ * fails, or the round trips take more than RATE_RTT_TOLERANCE times the
+ * shortest one. Set USE_ADAPTIVE_WINDOW to 0 to always allow MAX_IN_FLIGHT.
+ */
+#define RATE_LIMIT 0
+#define RATE_BURST 50
+#define USE_ADAPTIVE_WINDOW 1
+#define RATE_MIN_WINDOW 1
+#define RATE_RTT_TOLERANCE 2
+
 /*
  * If you don't want to use files at all, set the option to 0.
  * If you do, make sure to set the three required directories
@@ -19,6 +62,56 @@
 #define PATH_MSGS_SENT "/var/pushr/messages.sent"
 #define PATH_MSGS_ERROR "/var/pushr/messages.error"
 
+/*
+ * With many files, the three directories can be split in QUEUE_SHARDS
+ * subdirectories each (up to 256), named 00, 01, ... in two hex digits. A file
+ * goes in the subdirectory of the FNV-1a hash of its name, modulo QUEUE_SHARDS
+ * (see the readme file), although files put in the queue directory itself are
+ * sent too. pushr creates the subdirectories. 0 keeps the directories flat.
+ */
+#define QUEUE_SHARDS 0
+
+/*
+ * The files of the queue can be read, moved and answered with io_uring (Linux
+ * 5.11 or newer), IO_URING_BATCH files with a few system calls, instead of
+ * several system calls for every file. When io_uring is not available, the
+ * files are handled one at a time. Set USE_IO_URING to 1 to use it.
+ */
+#define USE_IO_URING 0
+#define IO_URING_BATCH 64
+
+/*
+ * Instead of a .response file next to every file that was sent (or failed),
+ * the responses can be kept in a compressed archive in PATH_RESPONSE_ARCHIVE,
+ * with the name of the file, the verdict, and when the message was read and
+ * done (see the readme file). The records are compressed with zlib in blocks
+ * of ARCHIVE_BLOCK_SIZE bytes, and a new archive file is started every
+ * ARCHIVE_SEGMENT_SIZE bytes. The archive is synced to the disk every
+ * ARCHIVE_SYNC_INTERVAL milliseconds, and when pushr stops. 
+ * Set USE_RESPONSE_ARCHIVE to 1 to use it.
+ */
+#define USE_RESPONSE_ARCHIVE 0
+#define PATH_RESPONSE_ARCHIVE "/var/pushr/responses"
+#define ARCHIVE_BLOCK_SIZE (64 * 1024)
+#define ARCHIVE_SEGMENT_SIZE (64 * 1024 * 1024)
+#define ARCHIVE_SYNC_INTERVAL 1000
+
+/*
+ * The log queue is an alternative to one file per message: producers append
+ * the messages to segment files in PATH_LOG_QUEUE, and pushr writes their
+ * outcomes to results files next to them (see the readme file for the
+ * format). A segment is sealed once it is LOG_SEGMENT_SIZE bytes long, and
+ * once it is read it is deleted, or moved to PATH_LOG_ARCHIVE if LOG_ARCHIVE
+ * is 1. pushr reads up to LOG_READ_SIZE bytes of messages at a time.
+ * Set USE_LOG to 1 to use it.
+ */
+#define USE_LOG 0
+#define PATH_LOG_QUEUE "/var/pushr/log"
+#define PATH_LOG_ARCHIVE "/var/pushr/log.archive"
+#define LOG_ARCHIVE 0
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define LOG_READ_SIZE (1024 * 1024)
+
 /*
  * If you don't want to use a MySQL database at all, set the option to 0.
  * If you do, make sure to set the required fields below and create the 
@@ -30,6 +123,110 @@
 #define MYSQL_PASSWORD "xrNV1WkKVtGTH8ym"
 #define MYSQL_SCHEMA "pushr"
 
+/*
+ * The results of a MySQL batch are written back in a single transaction, with
+ * one UPDATE statement for every DB_UPDATE_BATCH messages.
+ */
+#define DB_UPDATE_BATCH 100
+
+/*
+ * Several pushr instances (on different hosts) can share the MySQL table.
+ * Each one claims up to DB_CLAIM_BATCH messages at a time, and holds them for
+ * DB_LEASE_TIME seconds. Messages that are not sent by then (e.g. the instance
+ * died) are claimed again. Needs MySQL 8.0 or MariaDB 10.6 (SKIP LOCKED).
+ */
+#define DB_CLAIM_BATCH 500
+#define DB_LEASE_TIME 300
+
+/*
+ * When running as a daemon (pushr daemon), new files are picked up as soon as
+ * they are written. The MySQL table is polled every DAEMON_MYSQL_INTERVAL
+ * milliseconds, and the log queue every DAEMON_LOG_INTERVAL milliseconds.
+ */
+#define DAEMON_MYSQL_INTERVAL 1000
+#define DAEMON_LOG_INTERVAL 100
+
+/*
+ * pushr remembers the registration ids that the push service reports as not
+ * registered (or invalid), and leaves them out of the next messages. Ids that
+ * were replaced by a canonical id are sent to the new id instead. The ids are
+ * kept in the PATH_TOKENS file. Set USE_TOKEN_STORE to 0 to send every message
+ * as it is.
+ */
+#define USE_TOKEN_STORE 1
+#define PATH_TOKENS "/var/pushr/tokens"
+
+/*
+ * Messages that differ only in their registration ids are coalesced: they are
+ * sent together, in one request with up to MAX_REGISTRATION_IDS ids, and the
+ * results of every message's ids are handed back to it. Up to COALESCE_GROUPS
+ * different payloads wait to be coalesced at the same time, until a batch is
+ * queued. Set USE_COALESCING to 0 to send every message in its own request.
+ * A message with more than MAX_REGISTRATION_IDS ids is always split in parts,
+ * that are sent in parallel, and their results are merged back.
+ */
+#define USE_COALESCING 1
+#define COALESCE_GROUPS 64
+#define MAX_REGISTRATION_IDS 1000
+
+/*
+ * Registration ids the push service can't take right now (Unavailable or
+ * InternalServerError), and messages whose request failed in a way that may
+ * not last (a network error, a 5xx or a 429 status), are sent again, up to
+ * RETRY_MAX_ATTEMPTS times in all. Only the ids that failed are sent again.
+ * The wait doubles with every attempt, from RETRY_DELAY milliseconds up to
+ * RETRY_MAX_DELAY, and a random part of it is left out so the retries spread.
+ * A Retry-After header is honored, up to RETRY_MAX_DELAY as well. The messages
+ * wait in memory, keep RETRY_MAX_ATTEMPTS * RETRY_MAX_DELAY well under
+ * DB_LEASE_TIME. Set USE_RETRIES to 0 to never send a message again.
+ */
+#define USE_RETRIES 1
+#define RETRY_MAX_ATTEMPTS 5
+#define RETRY_DELAY 1000
+#define RETRY_MAX_DELAY 30000
+
+/*
+ * When the push service is down, pushr stops sending, instead of failing the
+ * whole queue: after BREAKER_FAILURES requests in a row fail (a network error
+ * or a 5xx status), the messages are left in the queue as they are. After
+ * BREAKER_OPEN_TIME milliseconds, BREAKER_PROBES requests are let through to
+ * probe the service. Once they all succeed, sending resumes, and if one fails,
+ * pushr waits again. Set USE_BREAKER to 0 to always send.
+ */
+#define USE_BREAKER 1
+#define BREAKER_FAILURES 5
+#define BREAKER_OPEN_TIME 10000
+#define BREAKER_PROBES 3
+
+/*
+ * pushr keeps metrics: counters of the messages and registration ids, the
+ * depth of the queues, and latency histograms of every stage of a message
+ * (see the readme file). When running as a daemon, they are served in the
+ * Prometheus text format on http://METRICS_ADDRESS:METRICS_PORT/metrics.
+ * Otherwise, or when METRICS_PORT is 0, they are written to PATH_METRICS every
+ * METRICS_INTERVAL milliseconds, and when pushr stops. Set USE_METRICS to 0
+ * to not export them.
+ */
+#define USE_METRICS 1
+#define METRICS_ADDRESS "127.0.0.1"
+#define METRICS_PORT 9464
+#define PATH_METRICS "/var/pushr/metrics.prom"
+#define METRICS_INTERVAL 5000
+
+/*
+ * pushr keeps the timeline of every message: when it was queued (the time the
+ * file was written, or the CreatedAt column), picked up, when its request
+ * started and the first byte of the response came, and when it was done.
+ * With USE_TRACING, the timeline is written back with the result (the
+ * Timeline column, or the user.pushr.timeline extended attribute of a file,
+ * see the readme file), and one message in TRACE_SAMPLE is written to
+ * PATH_TRACE as trace spans, in the Trace Event Format (chrome://tracing,
+ * Perfetto).
+ */
+#define USE_TRACING 0
+#define PATH_TRACE "/var/pushr/trace.json"
+#define TRACE_SAMPLE 100
+
 /*
  * Only one instance should be active at a time. We use a file called LOCK to 
  * hold the process id of the active pushr to prevent other instances.
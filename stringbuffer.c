@@ -1,6 +1,9 @@
 #include "stringbuffer.h"
+#include "arena.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
 
 /* Create and initialize the StringBuffer
  *  @param length the initial length of the buffer. If value is smaller than 
@@ -19,14 +22,92 @@ string_buffer_create(int length)
 
 	buffer = (StringBuffer *)malloc(sizeof(StringBuffer));
 	if (buffer != NULL) {
+		buffer->data = (char *)malloc(buffered + 1); /* Allow room for null terminator */
+		if (buffer->data == NULL) {
+			free(buffer);
+			return NULL;
+		}
+		buffer->data[0] = '\0';
 		buffer->length = 0;
 		buffer->space = buffered;
-		buffer->data = (char *)malloc(buffered + 1); /* Allow room for null terminator */
+		buffer->arena = NULL;
 	}
 
 	return buffer;
 }
 
+/* Create and initialize a StringBuffer that takes all its memory from an Arena.
+ * It lives until the arena is reset, string_buffer_free does nothing.
+ * @param arena the pointer to the Arena object
+ * @param length the initial length of the buffer, as in string_buffer_create
+ * @return a pointer to the newly created StringBuffer, or NULL on error
+ */
+StringBuffer *
+string_buffer_create_in(Arena *arena, int length)
+{
+	int buffered = STRING_BUFFER_BUFFER;
+	StringBuffer *buffer;
+	if (length > buffered) 
+	{
+		buffered = length;
+	}
+
+	buffer = (StringBuffer *)arena_alloc (arena, sizeof(StringBuffer));
+	if (buffer != NULL) {
+		buffer->data = (char *)arena_alloc (arena, buffered + 1); /* Allow room for null terminator */
+		if (buffer->data == NULL) {
+			return NULL;
+		}
+		buffer->data[0] = '\0';
+		buffer->length = 0;
+		buffer->space = buffered;
+		buffer->arena = arena;
+	}
+
+	return buffer;
+}
+
+/* Makes sure the buffer can take more characters without reallocating.
+ * The buffer grows geometrically (at least doubling), so appending n characters
+ * one at a time costs O(n) overall.
+ * @param buffer a pointer to the StringBuffer object
+ * @param length the number of characters we want to append
+ * @return 1 on success, 0 if we are out of memory
+ */
+int
+string_buffer_reserve(StringBuffer *buffer, unsigned int length)
+{
+	unsigned int needed = buffer->length + length;
+	unsigned int space = buffer->space;
+	char *alloc;
+
+	if (needed <= space) {
+		return 1; /* Already enough room */
+	}
+
+	while (space < needed) {
+		space *= 2;
+	}
+
+	if (buffer->arena != NULL) {
+		/* The old space stays in the arena until it is reset */
+		alloc = (char *)arena_alloc (buffer->arena, space + 1); /* Leave room for the nul */
+		if (alloc == NULL) {
+			return 0;
+		}
+		memcpy(alloc, buffer->data, buffer->length + 1);
+	} else {
+		alloc = (char *)realloc(buffer->data, space + 1); /* Leave room for the nul */
+		if (alloc == NULL) {
+			return 0;
+		}
+	}
+	buffer->data = alloc;
+	buffer->space = space;
+
+	return 1;
+}
+
 /* Adding text into the buffer
  * @param buffer a pointer to the StringBuffer object
  * @param string the string to append
@@ -35,36 +116,69 @@ string_buffer_create(int length)
 int
 string_buffer_append(StringBuffer *buffer, char *string)
 {
-	unsigned int in_length = strlen(string); /* Don't count the null-terminator */
-	unsigned int i; /* for the loop */
-	int written = 0; /* how many characters were appended */
-
 	/* Protect against null pointer exceptions */
 	if (string == NULL) {
 		return 0;
 	}
-	
-	if (buffer->space - buffer->length < in_length) 
-	{
-		/* Not enough room for the new string, increase */
-		char *alloc = (char *)realloc(buffer->data, buffer->space + STRING_BUFFER_BUFFER + 1); /* Leave room for at least on nul */
-		if (alloc == NULL) {
-			return 0; /* Error: zero characters appended */
-		}
-		buffer->space += STRING_BUFFER_BUFFER;
-		buffer->data = alloc;
+
+	return string_buffer_append_n (buffer, string, strlen(string));
+}
+
+/* Adding a number of characters into the buffer
+ * @param buffer a pointer to the StringBuffer object
+ * @param string the characters to append (need not be null-terminated)
+ * @param length how many characters to append
+ * @return the number of characters appended
+ */
+int
+string_buffer_append_n(StringBuffer *buffer, const char *string, unsigned int length)
+{
+	if (! string_buffer_reserve (buffer, length)) {
+		return 0; /* Error: zero characters appended */
 	}
 
-	for (i = 0; i < in_length; i++)
-	{
-		
-		buffer->data[buffer->length] = string[i];
-		buffer->length++;
-		written++;
-		
+	memcpy(buffer->data + buffer->length, string, length);
+	buffer->length += length;
+	buffer->data[buffer->length] = '\0';
+
+	return length;
+}
+
+/* Adding printf-style formatted text into the buffer
+ * @param buffer a pointer to the StringBuffer object
+ * @param format the printf-style format
+ * @param ... the arguments for the format
+ * @return the number of characters appended
+ */
+int
+string_buffer_append_format(StringBuffer *buffer, const char *format, ...)
+{
+	va_list args;
+	int length;
+
+	/* Try with the room we have, most of the time it is enough */
+	va_start(args, format);
+	length = vsnprintf(buffer->data + buffer->length, buffer->space - buffer->length + 1, format, args);
+	va_end(args);
+
+	if (length < 0) {
+		buffer->data[buffer->length] = '\0';
+		return 0;
 	}
 
-	return written;
+	if ((unsigned int)length > buffer->space - buffer->length) {
+		/* It did not fit, grow and try again */
+		if (! string_buffer_reserve (buffer, length)) {
+			buffer->data[buffer->length] = '\0';
+			return 0;
+		}
+		va_start(args, format);
+		(void) vsnprintf(buffer->data + buffer->length, buffer->space - buffer->length + 1, format, args);
+		va_end(args);
+	}
+	buffer->length += length;
+
+	return length;
 }
 
 /* Adding a single character into the buffer
@@ -75,28 +189,22 @@ string_buffer_append(StringBuffer *buffer, char *string)
 int
 string_buffer_append_char(StringBuffer *buffer, int character)
 {
-	if (buffer->space - buffer->length < 1) 
+	if (buffer->length == buffer->space && ! string_buffer_reserve (buffer, 1)) 
 	{
-		/* Not enough room for the new character, increase */
-		char *alloc = (char *)realloc(buffer->data, buffer->space + STRING_BUFFER_BUFFER + 1); /* Allow room for at least on nul */
-		if (alloc == NULL) {
-			return 0; /* Error: zero characters appended */
-		}
-		buffer->space += STRING_BUFFER_BUFFER;
-		buffer->data = alloc;
+		return 0; /* Error: zero characters appended */
 	}
 
 	/* Add the character */
 	buffer->data[buffer->length] = character;
 	buffer->length++;
-		
+	buffer->data[buffer->length] = '\0';
 
 	return 1;
 }
 
 /* Return the string buffered
  * @param buffer the pointer to the StringBuffer object
- * @return a pointer to the string, after making sure that it is null-terminated.
+ * @return a pointer to the string. It is always null-terminated.
  * Call this function to get the string, instead of using the data field of the 
  * StringBuffer. Don't worry about freeing the string - it is done when you call
  * the StringBuffer's free function
@@ -104,20 +212,6 @@ string_buffer_append_char(StringBuffer *buffer, int character)
 char *
 string_buffer_get_string(StringBuffer *buffer)
 {
-	/* Since we have been ignoring the null-terminators so far, we need now
-	 * to make sure that our string ends in a null-terminator.
-	 */
-	unsigned int i; /* for the loop */
-
-	/* The loop goes from the character after the last actual character up to
-	 * and include the size of the buffer. It is inclusive because we have saved
-	 * when created, one character for the null-terminator. We fill it now.
-	 */
-	for (i = buffer->length; i <= buffer->space; i++)
-	{
-		buffer->data[i] = '\0';
-	}
-
 	return buffer->data;
 }
 
@@ -127,6 +221,9 @@ string_buffer_get_string(StringBuffer *buffer)
 void
 string_buffer_free(StringBuffer *buffer)
 {
+	if (buffer->arena != NULL) {
+		return; /* Released with the arena */
+	}
 	free(buffer->data);
 	free(buffer);
 }
@@ -138,10 +235,8 @@ void
 string_buffer_recycle(StringBuffer *buffer)
 {
 	/* Instead of deleting, set the buffer so it appears as if it contains an
-	 * empty string and prepare it for the next append
+	 * empty string and prepare it for the next append. The space is kept.
 	 */
-	buffer->data[0] = '\0'; /* Will be overwriten on the next append. For now,
-							 * an empty string */ 
+	buffer->data[0] = '\0';
 	buffer->length = 0;
 }
-
@@ -5,13 +5,16 @@
 #ifndef _STRINGBUFFER_H_
 #define _STRINGBUFFER_H_
 
-/* The default buffer size */
+/* The default (and smallest) buffer size */
 #define STRING_BUFFER_BUFFER 25
 
+struct Arena;
+
 struct StringBuffer {
-	char *data; /* the character data */
+	char *data; /* the character data, always null-terminated */
 	unsigned int length; /* the actual length of the string */
-	unsigned int space; /* the total length of the buffer */
+	unsigned int space; /* the total length of the buffer (without the null-terminator) */
+	struct Arena *arena; /* where the memory comes from, or NULL for the heap */
 };
 
 typedef struct StringBuffer StringBuffer;
@@ -20,10 +23,26 @@ typedef struct StringBuffer StringBuffer;
 StringBuffer *
 string_buffer_create(int length);
 
+/* Create a StringBuffer that allocates from an Arena */
+StringBuffer *
+string_buffer_create_in(struct Arena *arena, int length);
+
+/* Make room for more characters */
+int
+string_buffer_reserve(StringBuffer *buffer, unsigned int length);
+
 /* Adding text into the buffer */
 int
 string_buffer_append(StringBuffer *buffer, char *string);
 
+/* Adding a number of characters into the buffer */
+int
+string_buffer_append_n(StringBuffer *buffer, const char *string, unsigned int length);
+
+/* Adding printf-style formatted text into the buffer */
+int
+string_buffer_append_format(StringBuffer *buffer, const char *format, ...);
+
 /* Adding a single character into the buffer */
 int
 string_buffer_append_char(StringBuffer *buffer, int character);
@@ -40,4 +59,4 @@ string_buffer_free(StringBuffer *buffer);
 void
 string_buffer_recycle(StringBuffer *buffer);
 
-#endif
\ No newline at end of file
+#endif
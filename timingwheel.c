@@ -0,0 +1,144 @@
+#include "timingwheel.h"
+
+#include <string.h>
+
+/* The slots of a wheel */
+#define TIMING_WHEEL_MASK (TIMING_WHEEL_SLOTS - 1)
+
+/* The longest delay the wheels hold, in ticks */
+#define TIMING_WHEEL_RANGE (1ULL << (TIMING_WHEEL_BITS * TIMING_WHEEL_LEVELS))
+
+/*
+ * Initializes an empty TimingWheel
+ * @param wheel the pointer to the TimingWheel object
+ * @param now the current time, in milliseconds
+ * @param tick the length of a tick, in milliseconds
+ */
+void
+timing_wheel_init(TimingWheel *wheel, long long now, long long tick)
+{
+	memset(wheel, 0, sizeof(TimingWheel));
+	wheel->start = now;
+	wheel->tick = tick > 0 ? tick : 1;
+}
+
+/*
+ * Puts an entry in the slot of its tick, in the wheel that fits how far it is
+ * @param wheel the pointer to the TimingWheel object
+ * @param entry the entry, not due before the current tick
+ */
+static void
+timing_wheel_place(TimingWheel *wheel, TimingWheelEntry *entry)
+{
+	unsigned long long delta = entry->due - wheel->now;
+	int level = 0;
+	int slot;
+
+	while (level < TIMING_WHEEL_LEVELS - 1 && delta >= 1ULL << (TIMING_WHEEL_BITS * (level + 1))) {
+		level++;
+	}
+
+	slot = (entry->due >> (TIMING_WHEEL_BITS * level)) & TIMING_WHEEL_MASK;
+	entry->next = wheel->slots[level][slot];
+	wheel->slots[level][slot] = entry;
+}
+
+/*
+ * Adds an entry. An entry that is due already comes due with the next tick,
+ * one that is further than the wheels go waits as long as they go.
+ * @param wheel the pointer to the TimingWheel object
+ * @param entry the entry
+ * @param due when it is due, in milliseconds
+ */
+void
+timing_wheel_add(TimingWheel *wheel, TimingWheelEntry *entry, long long due)
+{
+	unsigned long long tick = due > wheel->start ? (due - wheel->start + wheel->tick - 1) / wheel->tick : 0;
+
+	if (tick <= wheel->now) {
+		tick = wheel->now + 1;
+	}
+	if (tick - wheel->now >= TIMING_WHEEL_RANGE) {
+		tick = wheel->now + TIMING_WHEEL_RANGE - 1;
+	}
+
+	entry->due = tick;
+	timing_wheel_place (wheel, entry);
+	wheel->count++;
+}
+
+/*
+ * Moves the clock forward, and takes out the entries that came due
+ * @param wheel the pointer to the TimingWheel object
+ * @param now the current time, in milliseconds
+ * @return the entries that came due, in a list, or NULL
+ */
+TimingWheelEntry *
+timing_wheel_advance(TimingWheel *wheel, long long now)
+{
+	unsigned long long target = now > wheel->start ? (now - wheel->start) / wheel->tick : 0;
+	TimingWheelEntry *due = NULL;
+
+	while (wheel->now < target && wheel->count > 0) {
+		TimingWheelEntry *entry;
+		int level;
+
+		wheel->now++;
+
+		/* A turn of a wheel is done, bring down the next slot of the wheel above */
+		for (level = 1; level < TIMING_WHEEL_LEVELS
+		     && (wheel->now & ((1ULL << (TIMING_WHEEL_BITS * level)) - 1)) == 0; level++) {
+			int slot = (wheel->now >> (TIMING_WHEEL_BITS * level)) & TIMING_WHEEL_MASK;
+
+			entry = wheel->slots[level][slot];
+			wheel->slots[level][slot] = NULL;
+			while (entry != NULL) {
+				TimingWheelEntry *next = entry->next;
+				timing_wheel_place (wheel, entry);
+				entry = next;
+			}
+		}
+
+		/* Everything in the slot of this tick is due */
+		entry = wheel->slots[0][wheel->now & TIMING_WHEEL_MASK];
+		wheel->slots[0][wheel->now & TIMING_WHEEL_MASK] = NULL;
+		while (entry != NULL) {
+			TimingWheelEntry *next = entry->next;
+			entry->next = due;
+			due = entry;
+			wheel->count--;
+			entry = next;
+		}
+	}
+
+	if (wheel->now < target) {
+		wheel->now = target; /* Nothing waits, skip ahead */
+	}
+
+	return due;
+}
+
+/*
+ * Tells how long to wait before advancing the wheel: until the next tick
+ * that has entries, or that brings entries down from a wheel above
+ * @param wheel the pointer to the TimingWheel object
+ * @param now the current time, in milliseconds
+ * @return the time to wait, in milliseconds, or -1 if nothing waits
+ */
+long long
+timing_wheel_next(TimingWheel *wheel, long long now)
+{
+	unsigned long long tick = wheel->now + 1;
+	long long wait;
+
+	if (wheel->count == 0) {
+		return -1;
+	}
+
+	while ((tick & TIMING_WHEEL_MASK) != 0 && wheel->slots[0][tick & TIMING_WHEEL_MASK] == NULL) {
+		tick++;
+	}
+
+	wait = wheel->start + (long long)tick * wheel->tick - now;
+	return wait > 0 ? wait : 0;
+}
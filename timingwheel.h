@@ -0,0 +1,44 @@
+/*
+ * The TimingWheel holds entries until they come due, in ticks of a fixed
+ * length. It is hierarchical: TIMING_WHEEL_LEVELS wheels of
+ * TIMING_WHEEL_SLOTS slots, a tick per slot in the first one, and a whole
+ * turn of the wheel before it per slot in every next one. An entry waits in
+ * the wheel that fits its delay, and moves down (cascades) as its time comes
+ * closer, so adding an entry and finding the ones that are due take the same
+ * time, however many entries there are. Entries are the caller's memory.
+ */
+
+#ifndef _TIMINGWHEEL_H_
+#define _TIMINGWHEEL_H_
+
+#define TIMING_WHEEL_BITS 6
+#define TIMING_WHEEL_SLOTS (1 << TIMING_WHEEL_BITS)
+#define TIMING_WHEEL_LEVELS 4
+
+typedef struct TimingWheelEntry {
+	struct TimingWheelEntry *next; /* in its slot, or in the list of due entries */
+	unsigned long long due; /* the tick */
+	void *data; /* the caller's */
+} TimingWheelEntry;
+
+typedef struct {
+	long long start; /* the time of tick 0, in milliseconds */
+	long long tick; /* the length of a tick, in milliseconds */
+	unsigned long long now; /* the last tick that was done */
+	TimingWheelEntry *slots[TIMING_WHEEL_LEVELS][TIMING_WHEEL_SLOTS];
+	int count; /* the entries waiting */
+} TimingWheel;
+
+void
+timing_wheel_init(TimingWheel *wheel, long long now, long long tick);
+
+void
+timing_wheel_add(TimingWheel *wheel, TimingWheelEntry *entry, long long due);
+
+TimingWheelEntry *
+timing_wheel_advance(TimingWheel *wheel, long long now);
+
+long long
+timing_wheel_next(TimingWheel *wheel, long long now);
+
+#endif
@@ -0,0 +1,342 @@
+#include "tokenstore.h"
+#include "stringbuffer.h"
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* The initial size of the hash table */
+#define TOKEN_STORE_SIZE 1024
+
+/*
+ * Hashes a token (FNV-1a)
+ * @param token the token
+ * @param length the length of the token
+ * @return the hash
+ */
+static unsigned int
+token_hash(const char *token, size_t length)
+{
+	unsigned int hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char)token[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Finds the place of a token in the hash table
+ * @param store the pointer to the TokenStore object
+ * @param token the token (need not be null-terminated)
+ * @param length the length of the token
+ * @param hash the hash of the token
+ * @return the entry of the token, or the empty entry where it belongs
+ */
+static struct TokenEntry *
+token_store_find(TokenStore *store, const char *token, size_t length, unsigned int hash)
+{
+	unsigned int mask = store->size - 1;
+	unsigned int i = hash & mask;
+
+	while (store->entries[i].token != NULL) {
+		struct TokenEntry *entry = &store->entries[i];
+		if (entry->hash == hash && strncmp(entry->token, token, length) == 0 && entry->token[length] == '\0') {
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+
+	return &store->entries[i];
+}
+
+/*
+ * Doubles the hash table
+ * @param store the pointer to the TokenStore object
+ * @return 1 on success, 0 if we are out of memory
+ */
+static int
+token_store_grow(TokenStore *store)
+{
+	struct TokenEntry *old = store->entries;
+	unsigned int old_size = store->size;
+	unsigned int i;
+
+	store->entries = (struct TokenEntry *)calloc(old_size * 2, sizeof(struct TokenEntry));
+	if (store->entries == NULL) {
+		store->entries = old;
+		return 0;
+	}
+	store->size = old_size * 2;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].token != NULL) {
+			*token_store_find (store, old[i].token, strlen(old[i].token), old[i].hash) = old[i];
+		}
+	}
+	free(old);
+
+	return 1;
+}
+
+/*
+ * Records what we know about a token
+ * @param store the pointer to the TokenStore object
+ * @param token the token
+ * @param canonical the id that replaced it, or NULL if it is dead
+ * @param log whether to add the record to the log file
+ */
+static void
+token_store_set(TokenStore *store, char *token, char *canonical, int log)
+{
+	size_t length = strlen(token);
+	unsigned int hash = token_hash (token, length);
+	struct TokenEntry *entry;
+
+	if (canonical != NULL && strcmp(token, canonical) == 0) {
+		return; /* Not really replaced */
+	}
+
+	if ((store->count + 1) * 10 >= store->size * 7 && ! token_store_grow (store)) {
+		return;
+	}
+
+	entry = token_store_find (store, token, length, hash);
+	if (entry->token == NULL) {
+		entry->token = arena_strdup (store->arena, token);
+		if (entry->token == NULL) {
+			return;
+		}
+		entry->hash = hash;
+		entry->canonical = NULL;
+		store->count++;
+	} else if (canonical == NULL ? entry->canonical == NULL
+	           : entry->canonical != NULL && strcmp(entry->canonical, canonical) == 0) {
+		return; /* Nothing new */
+	}
+
+	if (canonical != NULL) {
+		entry->canonical = arena_strdup (store->arena, canonical);
+	} else {
+		entry->canonical = NULL;
+	}
+
+	if (log) {
+		if (canonical != NULL) {
+			string_buffer_append_format (store->pending, "C %s %s\n", token, canonical);
+		} else {
+			string_buffer_append_format (store->pending, "D %s\n", token);
+		}
+	}
+}
+
+/*
+ * Writes every entry to a new log file, that replaces the old one
+ * @param store the pointer to the TokenStore object
+ */
+static void
+token_store_compact(TokenStore *store)
+{
+	StringBuffer *path = string_buffer_create (strlen(store->path) + 5);
+	FILE *file;
+	unsigned int i;
+
+	if (path == NULL) {
+		return;
+	}
+	string_buffer_append (path, store->path);
+	string_buffer_append (path, ".tmp");
+
+	file = fopen(string_buffer_get_string (path), "w");
+	if (file != NULL) {
+		for (i = 0; i < store->size; i++) {
+			struct TokenEntry *entry = &store->entries[i];
+			if (entry->token == NULL) {
+				continue;
+			}
+			if (entry->canonical != NULL) {
+				fprintf(file, "C %s %s\n", entry->token, entry->canonical);
+			} else {
+				fprintf(file, "D %s\n", entry->token);
+			}
+		}
+		if (fclose(file) == 0) {
+			(void) rename(string_buffer_get_string (path), store->path);
+		}
+	}
+	string_buffer_free (path);
+}
+
+/*
+ * Creates the TokenStore and reads the log file, if there is one. When the log
+ * holds many outdated records, it is rewritten.
+ * @param path the path of the log file
+ * @return a pointer to the TokenStore, or NULL on error
+ */
+TokenStore *
+token_store_open(char *path)
+{
+	TokenStore *store = (TokenStore *)calloc(1, sizeof(TokenStore));
+	FILE *file;
+	char *line = NULL;
+	size_t line_space = 0;
+	ssize_t length;
+	unsigned int records = 0;
+
+	if (store == NULL) {
+		return NULL;
+	}
+
+	store->size = TOKEN_STORE_SIZE;
+	store->entries = (struct TokenEntry *)calloc(store->size, sizeof(struct TokenEntry));
+	store->arena = arena_create (0);
+	store->pending = string_buffer_create (1024);
+	store->path = path;
+	if (store->entries == NULL || store->arena == NULL || store->pending == NULL) {
+		token_store_close (store);
+		return NULL;
+	}
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		return store; /* Nothing known yet */
+	}
+
+	while ((length = getline(&line, &line_space, file)) > 0) {
+		char *token = line + 2;
+		char *canonical = NULL;
+
+		if (line[length - 1] == '\n') {
+			line[length - 1] = '\0';
+		}
+		if (length < 3 || line[1] != ' ') {
+			continue; /* Not a record */
+		}
+		if (line[0] == 'C') {
+			canonical = strchr(token, ' ');
+			if (canonical == NULL) {
+				continue;
+			}
+			*canonical = '\0';
+			canonical++;
+		} else if (line[0] != 'D') {
+			continue;
+		}
+		token_store_set (store, token, canonical, 0);
+		records++;
+	}
+	free(line);
+	fclose(file);
+
+	if (records > store->count * 2 + TOKEN_STORE_SIZE) {
+		token_store_compact (store);
+	}
+
+	return store;
+}
+
+/*
+ * Looks up a token before it is sent
+ * @param store the pointer to the TokenStore object
+ * @param token the token (need not be null-terminated)
+ * @param length the length of the token
+ * @param resolved_length will hold the length of the id to send
+ * @return the id to send to: the token itself, or the id that replaced it.
+ * NULL if the token is dead.
+ */
+char *
+token_store_resolve(TokenStore *store, char *token, size_t length, size_t *resolved_length)
+{
+	int hops;
+
+	for (hops = 0; hops < TOKEN_STORE_HOPS; hops++) {
+		struct TokenEntry *entry = token_store_find (store, token, length, token_hash (token, length));
+		if (entry->token == NULL) {
+			break; /* Nothing known, send to it */
+		}
+		if (entry->canonical == NULL) {
+			return NULL;
+		}
+		token = entry->canonical;
+		length = strlen(token);
+	}
+
+	*resolved_length = length;
+	return token;
+}
+
+/*
+ * Records a token the push service reported as not registered, or invalid
+ * @param store the pointer to the TokenStore object
+ * @param token the token
+ */
+void
+token_store_dead(TokenStore *store, char *token)
+{
+	token_store_set (store, token, NULL, 1);
+}
+
+/*
+ * Records a token the push service reported as replaced by another id
+ * @param store the pointer to the TokenStore object
+ * @param token the token
+ * @param canonical the id that replaced it
+ */
+void
+token_store_canonical(TokenStore *store, char *token, char *canonical)
+{
+	token_store_set (store, token, canonical, 1);
+}
+
+/*
+ * Appends the new records to the log file, all at once
+ * @param store the pointer to the TokenStore object
+ * @return 0 on success, -1 on error (the records are kept for the next time)
+ */
+int
+token_store_flush(TokenStore *store)
+{
+	int file;
+	ssize_t written;
+
+	if (store->pending->length == 0) {
+		return 0;
+	}
+
+	file = open(store->path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (file == -1) {
+		return -1;
+	}
+	written = write(file, string_buffer_get_string (store->pending), store->pending->length);
+	close(file);
+	if (written != (ssize_t)store->pending->length) {
+		return -1;
+	}
+
+	string_buffer_recycle (store->pending);
+	return 0;
+}
+
+/*
+ * Writes the new records and frees the TokenStore
+ * @param store the pointer to the TokenStore object
+ */
+void
+token_store_close(TokenStore *store)
+{
+	if (store->pending != NULL) {
+		(void) token_store_flush (store);
+		string_buffer_free (store->pending);
+	}
+	if (store->arena != NULL) {
+		arena_free (store->arena);
+	}
+	free(store->entries);
+	free(store);
+}
@@ -0,0 +1,54 @@
+/*
+ * The TokenStore remembers what the push service told us about registration
+ * ids: the ones that are no longer registered (or were never valid), and the
+ * ones that were replaced by a canonical id. It is kept in a hash table, and
+ * in a compact log file that is written in bulk and read back on start.
+ * The log has one line per record: "D <token>" for a dead token and
+ * "C <token> <canonical>" for a replaced one.
+ */
+
+#ifndef _TOKENSTORE_H_
+#define _TOKENSTORE_H_
+
+#include <stddef.h>
+
+#include "stringbuffer.h"
+#include "arena.h"
+
+/* How many replacements we follow (a token can be replaced more than once) */
+#define TOKEN_STORE_HOPS 8
+
+struct TokenEntry {
+	char *token;
+	char *canonical; /* the id that replaced it, or NULL if the token is dead */
+	unsigned int hash;
+};
+
+typedef struct {
+	struct TokenEntry *entries; /* the hash table, open addressing */
+	unsigned int size; /* always a power of two */
+	unsigned int count;
+	Arena *arena; /* the strings */
+	char *path; /* the log file */
+	StringBuffer *pending; /* records not yet written to the log */
+} TokenStore;
+
+TokenStore *
+token_store_open(char *path);
+
+char *
+token_store_resolve(TokenStore *store, char *token, size_t length, size_t *resolved_length);
+
+void
+token_store_dead(TokenStore *store, char *token);
+
+void
+token_store_canonical(TokenStore *store, char *token, char *canonical);
+
+int
+token_store_flush(TokenStore *store);
+
+void
+token_store_close(TokenStore *store);
+
+#endif
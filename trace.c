@@ -0,0 +1,101 @@
+#include "trace.h"
+#include "stringbuffer.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*
+ * Opens the trace file, for appending. A new file gets the opening bracket
+ * of the array.
+ * @param path the path of the file
+ * @return a pointer to the TraceWriter, or NULL on error (errno is set)
+ */
+TraceWriter *
+trace_open(char *path)
+{
+	TraceWriter *trace = (TraceWriter *)calloc(1, sizeof(TraceWriter));
+	struct stat info;
+
+	if (trace == NULL) {
+		return NULL;
+	}
+	trace->pid = (int)getpid();
+	trace->buffer = string_buffer_create (TRACE_BUFFER_SIZE);
+	trace->file = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (trace->buffer == NULL || trace->file == -1 || fstat(trace->file, &info) == -1) {
+		trace_close (trace);
+		return NULL;
+	}
+
+	if (info.st_size == 0) {
+		string_buffer_append (trace->buffer, "[\n");
+	}
+
+	return trace;
+}
+
+/*
+ * Adds a span. Spans with an unknown start or end are left out.
+ * @param trace the pointer to the TraceWriter object
+ * @param name the name of the span
+ * @param start when it started, in microseconds since the epoch, 0 if unknown
+ * @param end when it ended, 0 if unknown
+ * @param track the track to show it on
+ * @param args the members of its "args" object, in JSON
+ */
+void
+trace_span(TraceWriter *trace, char *name, long long start, long long end, unsigned long track, char *args)
+{
+	if (start <= 0 || end < start) {
+		return;
+	}
+
+	string_buffer_append_format (trace->buffer, "{\"name\":\"%s\",\"cat\":\"pushr\",\"ph\":\"X\",\"ts\":%lld,"
+	                             "\"dur\":%lld,\"pid\":%d,\"tid\":%lu,\"args\":{%s}},\n", name, start, end - start,
+	                             trace->pid, track, args);
+	trace->spans++;
+	if (trace->buffer->length >= TRACE_BUFFER_SIZE) {
+		(void) trace_flush (trace);
+	}
+}
+
+/*
+ * Writes the spans that wait in the buffer
+ * @param trace the pointer to the TraceWriter object
+ * @return 0 on success, -1 on error (the spans are dropped)
+ */
+int
+trace_flush(TraceWriter *trace)
+{
+	ssize_t written;
+
+	if (trace->buffer->length == 0) {
+		return 0;
+	}
+
+	written = write(trace->file, trace->buffer->data, trace->buffer->length);
+	string_buffer_recycle (trace->buffer);
+
+	return written == -1 ? -1 : 0;
+}
+
+/*
+ * Writes the spans that wait, closes the file, and frees the TraceWriter
+ * @param trace the pointer to the TraceWriter object
+ */
+void
+trace_close(TraceWriter *trace)
+{
+	if (trace->file != -1 && trace->buffer != NULL) {
+		(void) trace_flush (trace);
+	}
+	if (trace->file != -1) {
+		close(trace->file);
+	}
+	if (trace->buffer != NULL) {
+		string_buffer_free (trace->buffer);
+	}
+	free(trace);
+}
@@ -0,0 +1,37 @@
+/*
+ * The TraceWriter appends spans to a file in the Trace Event Format (a JSON
+ * array of events, that chrome://tracing and Perfetto open). Every span is a
+ * complete event ("ph":"X") with its start and duration in microseconds, on
+ * a track of its own (its "tid"). The array is left open, the viewers accept
+ * that, so the spans of later runs are appended to the same file. The spans
+ * are buffered, and written with a single call once TRACE_BUFFER_SIZE bytes
+ * wait, or when the TraceWriter is flushed.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "stringbuffer.h"
+
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+	int file;
+	StringBuffer *buffer; /* the spans not written yet */
+	int pid; /* of the events */
+	unsigned long spans; /* for the statistics */
+} TraceWriter;
+
+TraceWriter *
+trace_open(char *path);
+
+void
+trace_span(TraceWriter *trace, char *name, long long start, long long end, unsigned long track, char *args);
+
+int
+trace_flush(TraceWriter *trace);
+
+void
+trace_close(TraceWriter *trace);
+
+#endif
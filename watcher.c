@@ -0,0 +1,118 @@
+#include "watcher.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+/*
+ * Creates a Watcher for the directory
+ * @param path the directory to watch
+ * @return a pointer to the Watcher, or NULL on error (check errno)
+ */
+Watcher *
+watcher_create(char *path)
+{
+	Watcher *watcher = (Watcher *)malloc(sizeof(Watcher));
+	if (watcher == NULL) {
+		return NULL;
+	}
+
+	watcher->overflow = 0;
+	watcher->length = 0;
+	watcher->offset = 0;
+	watcher->watches = NULL;
+	watcher->watch_count = 0;
+	watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watcher->fd == -1) {
+		free(watcher);
+		return NULL;
+	}
+
+	if (watcher_add (watcher, path) == -1) {
+		watcher_free (watcher);
+		return NULL;
+	}
+
+	return watcher;
+}
+
+/*
+ * Watches one more directory
+ * @param watcher the pointer to the Watcher object
+ * @param path the directory to watch
+ * @return its index, as watcher_next reports it, or -1 on error (check errno)
+ */
+int
+watcher_add(Watcher *watcher, char *path)
+{
+	int *watches = (int *)realloc(watcher->watches, (watcher->watch_count + 1) * sizeof(int));
+	int wd;
+
+	if (watches == NULL) {
+		return -1;
+	}
+	watcher->watches = watches;
+
+	/* We only care for files that are ready to be read */
+	wd = inotify_add_watch(watcher->fd, path, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd == -1) {
+		return -1;
+	}
+
+	watches[watcher->watch_count] = wd;
+	return watcher->watch_count++;
+}
+
+/*
+ * Returns the name of the next file that is ready in the directories. Never
+ * blocks: when there is nothing to report, returns NULL.
+ * @param watcher the pointer to the Watcher object
+ * @param index gets the index of the directory the file is in
+ * @return the file name (valid until the next call) or NULL
+ */
+char *
+watcher_next(Watcher *watcher, int *index)
+{
+	for (;;) {
+		struct inotify_event *event;
+		ssize_t read_length;
+
+		while (watcher->offset < watcher->length) {
+			event = (struct inotify_event *)(watcher->buffer + watcher->offset);
+			watcher->offset += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				/* The kernel queue was full, some files were missed */
+				watcher->overflow = 1;
+			} else if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+				for (*index = 0; *index < watcher->watch_count; (*index)++) {
+					if (watcher->watches[*index] == event->wd) {
+						return event->name;
+					}
+				}
+				/* Not a directory we watch (anymore) */
+			}
+		}
+
+		/* Read the next batch of events */
+		watcher->offset = 0;
+		watcher->length = 0;
+		read_length = read(watcher->fd, watcher->buffer, WATCHER_BUFFER);
+		if (read_length <= 0) {
+			/* Nothing more for now (EAGAIN) or an error */
+			return NULL;
+		}
+		watcher->length = read_length;
+	}
+}
+
+/*
+ * Frees the Watcher and stops watching
+ * @param watcher the pointer to the Watcher object
+ */
+void
+watcher_free(Watcher *watcher)
+{
+	close(watcher->fd); /* Closing also removes the watches */
+	free(watcher->watches);
+	free(watcher);
+}
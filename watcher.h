@@ -0,0 +1,38 @@
+/*
+ * The Watcher uses inotify to report the files that are written to, or moved
+ * into, a directory. Only complete files are reported: a file is reported 
+ * once its writer closes it (or when it is renamed into the directory).
+ */
+
+#ifndef _WATCHER_H_
+#define _WATCHER_H_
+
+#include <stddef.h>
+#include <sys/inotify.h>
+
+/* Room for a good number of events per read */
+#define WATCHER_BUFFER (64 * (sizeof(struct inotify_event) + 256))
+
+typedef struct {
+	int fd; /* the inotify file descriptor, poll it for reading */
+	int *watches; /* the watch descriptors of the directories, in the order they were added */
+	int watch_count;
+	int overflow; /* set when events were lost. Rescan the directory and reset it */
+	char buffer[WATCHER_BUFFER]; /* events read but not yet reported */
+	size_t length; /* how much of the buffer holds events */
+	size_t offset; /* the next event to report */
+} Watcher;
+
+Watcher *
+watcher_create(char *path);
+
+int
+watcher_add(Watcher *watcher, char *path);
+
+char *
+watcher_next(Watcher *watcher, int *index);
+
+void
+watcher_free(Watcher *watcher);
+
+#endif
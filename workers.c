@@ -0,0 +1,282 @@
+#include "workers.h"
+#include "sender.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <curl/curl.h>
+
+/*
+ * Adds a transfer at the tail of the deque
+ * @return 1 on success, 0 if the deque is full
+ */
+static int
+deque_push(struct WorkerDeque *deque, struct SenderTransfer *transfer)
+{
+	int pushed = 0;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->count < deque->capacity) {
+		deque->items[(deque->head + deque->count) % deque->capacity] = transfer;
+		deque->count++;
+		pushed = 1;
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return pushed;
+}
+
+/*
+ * Takes the oldest transfer, from the head of the deque. Used by the owner.
+ * @return the transfer, or NULL if the deque is empty
+ */
+static struct SenderTransfer *
+deque_take(struct WorkerDeque *deque)
+{
+	struct SenderTransfer *transfer = NULL;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->count > 0) {
+		transfer = deque->items[deque->head];
+		deque->head = (deque->head + 1) % deque->capacity;
+		deque->count--;
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return transfer;
+}
+
+/*
+ * Takes the newest transfer, from the tail of the deque. Used by the other
+ * workers, so they contend with the owner as little as possible.
+ * @return the transfer, or NULL if the deque is empty
+ */
+static struct SenderTransfer *
+deque_steal(struct WorkerDeque *deque)
+{
+	struct SenderTransfer *transfer = NULL;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->count > 0) {
+		deque->count--;
+		transfer = deque->items[(deque->head + deque->count) % deque->capacity];
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return transfer;
+}
+
+/*
+ * Finds the next transfer for the worker: its own first, then the others'
+ * @return the transfer, or NULL if there is no work at all
+ */
+static struct SenderTransfer *
+worker_find(Worker *worker)
+{
+	WorkerPool *pool = worker->pool;
+	struct SenderTransfer *transfer = deque_take (&worker->deque);
+	int i;
+
+	for (i = 1; transfer == NULL && i < pool->count; i++) {
+		transfer = deque_steal (&pool->workers[(worker->index + i) % pool->count].deque);
+	}
+
+	if (transfer != NULL) {
+		pthread_mutex_lock(&pool->lock);
+		pool->queued--;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return transfer;
+}
+
+/*
+ * The worker thread: sends messages until the pool is stopped
+ * @param data the pointer to the Worker
+ */
+static void *
+worker_run(void *data)
+{
+	Worker *worker = (Worker *)data;
+	WorkerPool *pool = worker->pool;
+	uint64_t one = 1;
+
+	for (;;) {
+		struct SenderTransfer *transfer = worker_find (worker);
+
+		if (transfer == NULL) {
+			/* Nothing to do, wait for more messages */
+			pthread_mutex_lock(&pool->lock);
+			while (pool->queued == 0 && ! pool->stopping) {
+				pthread_cond_wait(&pool->work, &pool->lock);
+			}
+			if (pool->queued == 0 && pool->stopping) {
+				pthread_mutex_unlock(&pool->lock);
+				break;
+			}
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+
+		curl_easy_setopt(worker->curl, CURLOPT_WRITEDATA, (void *)transfer);
+		curl_easy_setopt(worker->curl, CURLOPT_READDATA, (void *)transfer);
+		/* Set content length based on the message's length */
+		curl_easy_setopt(worker->curl, CURLOPT_POSTFIELDSIZE, (long)transfer->message->length);
+		transfer->result = curl_easy_perform(worker->curl);
+		sender_read_status (worker->curl, &transfer->parsed);
+
+		/* Hand it back to the submitting thread */
+		pthread_mutex_lock(&pool->lock);
+		transfer->next = pool->done;
+		pool->done = transfer;
+		pthread_mutex_unlock(&pool->lock);
+		(void) write(pool->event_fd, &one, sizeof(one));
+	}
+
+	return NULL;
+}
+
+/*
+ * Creates the pool and starts the worker threads
+ * @param count the number of worker threads
+ * @param capacity the most transfers that may be submitted at the same time
+ * @param url the url of the push service
+ * @param headers the request headers. Every worker makes its own copy.
+ * @return a pointer to the WorkerPool, or NULL on error
+ */
+WorkerPool *
+worker_pool_create(int count, int capacity, char *url, struct curl_slist *headers)
+{
+	WorkerPool *pool = (WorkerPool *)malloc(sizeof(WorkerPool));
+	int i;
+
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	pool->count = count;
+	pool->started = 0;
+	pool->next = 0;
+	pool->queued = 0;
+	pool->stopping = 0;
+	pool->done = NULL;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pool->workers = (Worker *)calloc(count, sizeof(Worker));
+	if (pool->event_fd == -1 || pool->workers == NULL) {
+		worker_pool_free (pool);
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		Worker *worker = &pool->workers[i];
+		struct curl_slist *header;
+
+		worker->pool = pool;
+		worker->index = i;
+		pthread_mutex_init(&worker->deque.lock, NULL);
+		worker->deque.capacity = capacity;
+		worker->deque.items = (struct SenderTransfer **)malloc(capacity * sizeof(struct SenderTransfer *));
+		worker->curl = curl_easy_init();
+		for (header = headers; header != NULL; header = header->next) {
+			worker->headers = curl_slist_append(worker->headers, header->data);
+		}
+		if (worker->deque.items == NULL || worker->curl == NULL) {
+			worker_pool_free (pool);
+			return NULL;
+		}
+		sender_setup_curl (worker->curl, url, worker->headers);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&pool->workers[i].thread, NULL, worker_run, &pool->workers[i]) != 0) {
+			worker_pool_free (pool);
+			return NULL;
+		}
+		pool->started++;
+	}
+
+	return pool;
+}
+
+/*
+ * Queues a transfer on the next worker's deque
+ * @param pool the pointer to the WorkerPool object
+ * @param transfer the transfer to send, with its message filled in
+ */
+void
+worker_pool_submit(WorkerPool *pool, struct SenderTransfer *transfer)
+{
+	/* Deques hold as many transfers as can be submitted, so one always has room */
+	while (! deque_push (&pool->workers[pool->next].deque, transfer)) {
+		pool->next = (pool->next + 1) % pool->count;
+	}
+	pool->next = (pool->next + 1) % pool->count;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->queued++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Takes all the finished transfers. Never blocks.
+ * @param pool the pointer to the WorkerPool object
+ * @return a list of transfers (linked by next), or NULL
+ */
+struct SenderTransfer *
+worker_pool_done(WorkerPool *pool)
+{
+	struct SenderTransfer *done;
+	uint64_t count;
+
+	(void) read(pool->event_fd, &count, sizeof(count));
+
+	pthread_mutex_lock(&pool->lock);
+	done = pool->done;
+	pool->done = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	return done;
+}
+
+/*
+ * Stops the workers (after they send what is queued) and frees the pool
+ * @param pool the pointer to the WorkerPool object
+ */
+void
+worker_pool_free(WorkerPool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->started; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+
+	if (pool->workers != NULL) {
+		for (i = 0; i < pool->count; i++) {
+			Worker *worker = &pool->workers[i];
+			if (worker->curl != NULL) {
+				curl_easy_cleanup(worker->curl);
+			}
+			curl_slist_free_all(worker->headers);
+			free(worker->deque.items);
+			pthread_mutex_destroy(&worker->deque.lock);
+		}
+		free(pool->workers);
+	}
+	if (pool->event_fd != -1) {
+		close(pool->event_fd);
+	}
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
@@ -0,0 +1,62 @@
+/*
+ * The WorkerPool is the multi-threaded alternative to the cURL multi interface
+ * of the Sender. Every worker thread owns its own cURL handle and header list
+ * and sends one message at a time. Messages are spread over per-worker deques
+ * and a worker that runs out of messages steals from the others.
+ * Finished transfers are collected with worker_pool_done by the thread that 
+ * submitted them; event_fd becomes readable when there are some.
+ */
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "sender.h"
+
+struct WorkerDeque {
+	pthread_mutex_t lock;
+	struct SenderTransfer **items; /* circular array */
+	int capacity;
+	int head; /* the oldest item */
+	int count;
+};
+
+typedef struct {
+	pthread_t thread;
+	CURL *curl; /* this worker's own handle */
+	struct curl_slist *headers; /* and its own copy of the headers */
+	struct WorkerDeque deque; /* messages queued for this worker */
+	struct WorkerPool *pool;
+	int index;
+} Worker;
+
+struct WorkerPool {
+	Worker *workers;
+	int count; /* number of workers */
+	int started; /* number of threads running */
+	int next; /* the deque that gets the next message */
+	pthread_mutex_t lock; /* protects the fields below */
+	pthread_cond_t work; /* signaled when messages are queued */
+	int queued; /* messages waiting in all the deques */
+	int stopping;
+	struct SenderTransfer *done; /* finished transfers */
+	int event_fd; /* readable while done is not empty */
+};
+
+typedef struct WorkerPool WorkerPool;
+
+WorkerPool *
+worker_pool_create(int count, int capacity, char *url, struct curl_slist *headers);
+
+void
+worker_pool_submit(WorkerPool *pool, struct SenderTransfer *transfer);
+
+struct SenderTransfer *
+worker_pool_done(WorkerPool *pool);
+
+void
+worker_pool_free(WorkerPool *pool);
+
+#endif